@@ -2,6 +2,45 @@
 
 #define UNIT 16
 
+/*
+	* slab class of an aligned request, spans start at a SPAN_SIZE boundary so every
+	* slot is aligned to the largest power of two dividing its class size
+	* up to BIN_MAX_SIZE the bin of the size rounded to the alignment fits,
+	* above it the power of two class at least as large as size and alignment,
+	* unless it takes more than the proxy path would, with the padding and both headers
+	* Returns: the class, -1 when no slab class fits
+*/
+
+__attribute__((always_inline))
+static inline int aligned_class(size_t alignment, size_t size)
+{
+    size_t rounded = align_up(size, alignment);
+
+    if (rounded <= BIN_MAX_SIZE)
+        return rounded / ALIGNMENT - 1;
+    if (rounded > ALIGNED_CLASS_MAX)
+        return -1;
+    int shift = 64 - __builtin_clzl(rounded - 1);
+    if (((size_t)1 << shift) > size + alignment + 2 * BLOCK_SIZE)
+        return -1;
+    return BIN_COUNT + shift - __builtin_ctz(BIN_MAX_SIZE * 2);
+}
+
+/*
+	* this is the custom aligned_alloc function
+	* alignment: power of two
+	* size: size of the memory to be allocated
+	* small and medium requests take a slot of an aligned slab class from the thread cache,
+	* large ones aligned up to a page get a mapping whose header sits right in front of
+	* the aligned address
+	* otherwise, when the block from _malloc is not aligned, a proxy header is written
+	* right in front of the aligned address, its aligned_address points back to the block
+	* every result goes back to _free, _realloc and _malloc_usable_size like any other pointer
+	* the slots and the mappings are charged to the profiler countdown here, the proxy
+	* path is charged by its _malloc
+	* Returns: pointer to the aligned memory
+*/
+
 __attribute__((hot, flatten, always_inline))
 inline void *_aligned_alloc(size_t alignment, size_t size) 
 {
@@ -10,23 +49,58 @@ inline void *_aligned_alloc(size_t alignment, size_t size)
         errno = EINVAL;
         return NULL;
     }
+    if (alignment <= ALIGNMENT)
+        return _malloc(size);
 
-    unsigned char *p = _malloc(size + alignment - 1 + sizeof(void*));
+    int class = aligned_class(alignment, size);
+    if (class >= 0)
+    {
+        if (__builtin_expect((tcache.prof_countdown -= size) < 0, 0))
+            return prof_aligned_alloc(alignment, size);
+        STAT_ADD(tcache.stats.requested[class], size);
+        void *ptr = tcache.bins[class];
+        if (__builtin_expect(ptr != NULL, 1))
+        {
+            tcache.bins[class] = *(void **)ptr;
+            tcache.counts[class]--;
+            STAT_ADD(tcache.stats.nmalloc[class], 1);
+            return ptr;
+        }
+        return tcache_refill(class);
+    }
+    size_t rounded = __builtin_align_up(size, ALIGNMENT);
+    if (rounded >= MMAP_THRESHOLD && alignment <= (size_t)sysconf(_SC_PAGESIZE))
+    {
+        if (__builtin_expect((tcache.prof_countdown -= size) < 0, 0))
+            return prof_aligned_alloc(alignment, size);
+        return request_space_mmap(rounded, alignment);
+    }
+    unsigned char *p = _malloc(rounded + alignment - 1 + sizeof(Block));
     if (!p)
         return NULL;
+    if (((uintptr_t)p & (alignment - 1)) == 0)
+        return p;
 
-    uintptr_t addr = (uintptr_t)(p + sizeof(void*));
-    uintptr_t aligned_addr = align_up(addr, alignment);
-
-    ((void**)aligned_addr)[-1] = p;
+    uintptr_t aligned_addr = align_up((uintptr_t)(p + sizeof(Block)), alignment);
+    Block *proxy = block_from_ptr((void *)aligned_addr);
+    proxy->size = (uintptr_t)p + _malloc_usable_size(p) - aligned_addr;
+    proxy->next = NULL;
+    proxy->prev = NULL;
+    proxy->free = 0;
+    proxy->zeroed = 0;
+    proxy->is_mmap = 0;
+    proxy->aligned_address = p;
 
     return (void*)aligned_addr;
 }
 
+/*
+	* kept for the callers written against the proxy headers, _free does the same
+*/
+
 __attribute__((hot, flatten, always_inline))
 void _aligned_free(void *ptr) 
 {
-    if (ptr)
-        _free(((void**)ptr)[-1]);
+    _free(ptr);
 	return;
 }
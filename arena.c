@@ -0,0 +1,213 @@
+#include "include.h"
+
+/*
+	* region allocator for memory that dies all at once, the objects of one request
+	* an allocation is a pointer bump in the newest chunk, nothing is freed one by one
+	* _arena_reset drops every allocation in one pass over the chunks, they are kept
+	* for the next round, _arena_destroy unmaps them
+	* chunks come straight from map_pages, they hold no Block header and never enter
+	* the heap, the pools or the pagemap, so a pointer of an arena must not reach _free
+*/
+
+static Arena *arenas = NULL;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+	* map a chunk of at least size bytes, header included
+	* Returns: the chunk, NULL if no memory is left
+*/
+
+static ArenaChunk *arena_map_chunk(size_t size)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	if (size > SIZE_MAX - page_size)
+		return NULL;
+	size = align_up(size, page_size);
+	ArenaChunk *chunk = map_pages(size);
+	if (!chunk)
+		return NULL;
+	chunk->next = NULL;
+	chunk->size = size;
+	return chunk;
+}
+
+/*
+	* create an arena
+	* reserve: bytes the first chunk can hold, 0 for ARENA_CHUNK_MIN
+	* the arena lives at the start of its first chunk
+	* Returns: the arena, NULL if no memory is left
+*/
+
+Arena *_arena_create(size_t reserve)
+{
+	size_t header = sizeof(ArenaChunk) + sizeof(Arena);
+
+	if (reserve > SIZE_MAX - header)
+		return NULL;
+	size_t size = reserve + header < ARENA_CHUNK_MIN ? ARENA_CHUNK_MIN : reserve + header;
+	ArenaChunk *chunk = arena_map_chunk(size);
+	if (!chunk)
+		return NULL;
+
+	Arena *arena = (Arena *)(chunk + 1);
+	arena->chunks = chunk;
+	arena->spare = NULL;
+	arena->base = (uintptr_t)(arena + 1);
+	arena->top = arena->base;
+	arena->end = (uintptr_t)chunk + chunk->size;
+	arena->chunk_size = chunk->size;
+	arena->allocated = 0;
+	arena->active = chunk->size;
+
+	pthread_mutex_lock(&arena_lock);
+	arena->prev = NULL;
+	arena->next = arenas;
+	if (arenas)
+		arenas->prev = arena;
+	arenas = arena;
+	pthread_mutex_unlock(&arena_lock);
+	return arena;
+}
+
+/*
+	* make a chunk with need free bytes the newest one
+	* a spare chunk large enough is taken first, otherwise a chunk twice as large as the
+	* last one is mapped, so the number of chunks grows with the log of the arena size
+	* Returns: 1 on success, 0 if no memory is left
+*/
+
+static int arena_grow(Arena *arena, size_t need)
+{
+	ArenaChunk **link = &arena->spare;
+
+	while (*link && (*link)->size - sizeof(ArenaChunk) < need)
+		link = &(*link)->next;
+	ArenaChunk *chunk = *link;
+	if (chunk)
+		*link = chunk->next;
+	else
+	{
+		if (need > SIZE_MAX - sizeof(ArenaChunk))
+			return 0;
+		size_t size = arena->chunk_size < ARENA_CHUNK_MAX ? arena->chunk_size * 2 : ARENA_CHUNK_MAX;
+		if (size < need + sizeof(ArenaChunk))
+			size = need + sizeof(ArenaChunk);
+		chunk = arena_map_chunk(size);
+		if (!chunk)
+			return 0;
+		if (chunk->size <= ARENA_CHUNK_MAX)
+			arena->chunk_size = chunk->size;
+	}
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	arena->top = (uintptr_t)(chunk + 1);
+	arena->end = (uintptr_t)chunk + chunk->size;
+	STAT_ADD(arena->active, chunk->size);
+	return 1;
+}
+
+/*
+	* allocate size bytes from the arena
+	* align: power of two, 0 for ALIGNMENT
+	* the rest of the newest chunk is given up when the block does not fit in it
+	* Returns: pointer to the memory, NULL for a size of 0, a bad alignment or no memory
+*/
+
+__attribute__((hot))
+void *_arena_alloc(Arena *arena, size_t size, size_t align)
+{
+	if (!align)
+		align = ALIGNMENT;
+	if (__builtin_expect(size == 0 || (align & (align - 1)), 0))
+	{
+		if (size)
+			errno = EINVAL;
+		return NULL;
+	}
+	uintptr_t ptr = align_up(arena->top, align);
+	if (__builtin_expect(ptr > arena->end || size > arena->end - ptr, 0))
+	{
+		if (size > SIZE_MAX - align || !arena_grow(arena, size + align - 1))
+			return NULL;
+		ptr = align_up(arena->top, align);
+	}
+	arena->top = ptr + size;
+	STAT_ADD(arena->allocated, size);
+	return (void *)ptr;
+}
+
+/*
+	* drop every allocation of the arena, the cost is one step per chunk
+	* the chunks other than the first one become spare chunks for the next allocations
+*/
+
+void _arena_reset(Arena *arena)
+{
+	ArenaChunk *chunk = arena->chunks;
+
+	while (chunk->next)
+	{
+		ArenaChunk *next = chunk->next;
+		chunk->next = arena->spare;
+		arena->spare = chunk;
+		chunk = next;
+	}
+	arena->chunks = chunk;
+	arena->top = arena->base;
+	arena->end = (uintptr_t)chunk + chunk->size;
+	STAT_ADD(arena->allocated, -arena->allocated);
+	STAT_ADD(arena->active, chunk->size - arena->active);
+}
+
+/*
+	* unmap every chunk of the arena, the arena itself goes with its first chunk
+*/
+
+void _arena_destroy(Arena *arena)
+{
+	if (!arena)
+		return;
+	pthread_mutex_lock(&arena_lock);
+	if (arena->prev)
+		arena->prev->next = arena->next;
+	else
+		arenas = arena->next;
+	if (arena->next)
+		arena->next->prev = arena->prev;
+	pthread_mutex_unlock(&arena_lock);
+
+	ArenaChunk *lists[2] = {arena->spare, arena->chunks};
+	for (int i = 0; i < 2; i++)
+		for (ArenaChunk *chunk = lists[i], *next; chunk; chunk = next)
+		{
+			next = chunk->next;
+			unmap_pages(chunk, chunk->size);
+		}
+}
+
+void arena_fork_lock()
+{
+	pthread_mutex_lock(&arena_lock);
+}
+
+void arena_fork_unlock()
+{
+	pthread_mutex_unlock(&arena_lock);
+}
+
+/*
+	* add the live arenas to a _malloc_stats snapshot
+*/
+
+void arena_stats(struct malloc_stats *stats)
+{
+	pthread_mutex_lock(&arena_lock);
+	for (Arena *arena = arenas; arena; arena = arena->next)
+	{
+		stats->arenas++;
+		stats->arena_allocated += STAT_LOAD(arena->allocated);
+		stats->arena_active += STAT_LOAD(arena->active);
+	}
+	pthread_mutex_unlock(&arena_lock);
+}
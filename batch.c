@@ -0,0 +1,95 @@
+#include "include.h"
+
+/*
+	* allocate count blocks of size bytes, one size class lookup for the whole batch
+	* size: size of each block
+	* count: number of blocks wanted
+	* out: receives the pointers
+	* a small size pops a run of slots off the thread cache, and when the bin runs dry
+	* takes the rest from the remote list and the slab spans in one locked section,
+	* the counters are updated once per batch
+	* larger sizes, and batches the profiler has to sample, go through _malloc one by one
+	* Returns: the number of blocks allocated, less than count only when memory runs out
+*/
+
+size_t _malloc_batch(size_t size, size_t count, void **out)
+{
+	size_t total;
+	size_t n = 0;
+
+	if (!size || !count)
+		return 0;
+	size_t aligned = __builtin_align_up(size, ALIGNMENT);
+	if (aligned > BIN_MAX_SIZE || tcache.state != TCACHE_ACTIVE
+		|| __builtin_mul_overflow(size, count, &total) || (int64_t)total < 0
+		|| tcache.prof_countdown - (int64_t)total < 0)
+	{
+		while (n < count && (out[n] = _malloc(size)))
+			n++;
+		return n;
+	}
+	tcache.prof_countdown -= total;
+
+	int bin_index = aligned / ALIGNMENT - 1;
+	void *ptr = tcache.bins[bin_index];
+	while (ptr && n < count)
+	{
+		out[n++] = ptr;
+		ptr = *(void **)ptr;
+	}
+	tcache.bins[bin_index] = ptr;
+	tcache.counts[bin_index] -= n;
+	if (n < count)
+		n += tcache_refill_batch(bin_index, count - n, out + n);
+	STAT_ADD(tcache.stats.nmalloc[bin_index], n);
+	STAT_ADD(tcache.stats.requested[bin_index], size * n);
+	return n;
+}
+
+/*
+	* free count pointers, NULL entries are skipped
+	* consecutive slab slots of one size class are pushed on the thread cache as a run,
+	* with one counter update and, if the bin overflows, one flush for the run
+	* other blocks, and every block while the profiler holds samples, go through _free
+*/
+
+void _free_batch(void **ptrs, size_t count)
+{
+	size_t i = 0;
+
+	if (STAT_LOAD(prof_samples) != 0 || tcache.state != TCACHE_ACTIVE)
+	{
+		for (; i < count; i++)
+			_free(ptrs[i]);
+		return;
+	}
+	while (i < count)
+	{
+		void *ptr = ptrs[i++];
+		if (!ptr)
+			continue;
+		if (!is_slab_ptr(ptr))
+		{
+			_free(ptr);
+			continue;
+		}
+		int bin_index = slab_class(ptr);
+		void *head = tcache.bins[bin_index];
+		int run = 0;
+		for (;;)
+		{
+			*(void **)ptr = head;
+			head = ptr;
+			run++;
+			if (i == count || !ptrs[i] || !is_slab_ptr(ptrs[i]) || slab_class(ptrs[i]) != bin_index)
+				break;
+			ptr = ptrs[i++];
+		}
+		tcache.bins[bin_index] = head;
+		tcache.counts[bin_index] += run;
+		STAT_ADD(tcache.stats.nfree[bin_index], run);
+		int max = alloc_config.tcache_max[bin_index];
+		if (tcache.counts[bin_index] > max)
+			tcache_flush(bin_index, tcache.counts[bin_index] - max + TCACHE_BATCH);
+	}
+}
@@ -0,0 +1,398 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+/*
+	* allocator macro-benchmarks
+	* the binary only calls malloc/free/realloc, the allocator under test is chosen
+	* with LD_PRELOAD (see run_bench.sh), so the same workloads run against glibc
+	* usage: bench <workload> <threads> <allocator label>
+	* prints one CSV line:
+	*   allocator,workload,threads,ops,seconds,ops_per_sec,peak_rss_kb,p50_ns,p99_ns,p999_ns
+	* one op is one malloc, free or realloc call, latency is sampled every SAMPLE_EVERY ops
+*/
+
+#define MAX_THREADS 256
+#define SAMPLE_EVERY 16
+#define MAX_SAMPLES (1 << 16)
+#define LARSON_SLOTS 1024
+#define LARSON_ROUNDS 20
+#define LARSON_OPS 20000
+#define XMALLOC_OBJECTS 200000
+#define XMALLOC_RING 1024
+#define CACHE_OBJECT_SIZE 8
+#define CACHE_ITERATIONS 20000
+#define CACHE_WRITES 200
+#define RANDOM_SLOTS 4096
+#define RANDOM_OPS 400000
+#define REALLOC_BUFFERS 64
+#define REALLOC_OPS 200000
+#define REALLOC_MAX_SIZE (1 << 20)
+
+typedef struct ThreadStats {
+	uint64_t ops;
+	uint32_t nb_samples;
+	uint32_t samples[MAX_SAMPLES];
+} ThreadStats;
+
+typedef struct ThreadArg {
+	int id;
+	int nb_threads;
+	unsigned int seed;
+	ThreadStats *stats;
+} ThreadArg;
+
+static pthread_barrier_t barrier;
+static void **larson_slots[MAX_THREADS];
+static void *scratch_objects[MAX_THREADS];
+
+static inline uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+	* timed wrappers, one in SAMPLE_EVERY calls records its latency
+*/
+
+static inline void record(ThreadStats *stats, uint64_t start)
+{
+	if (stats->nb_samples < MAX_SAMPLES)
+		stats->samples[stats->nb_samples++] = (uint32_t)(now_ns() - start);
+}
+
+static inline void *bench_malloc(ThreadStats *stats, size_t size)
+{
+	if (stats->ops++ % SAMPLE_EVERY)
+		return malloc(size);
+	uint64_t start = now_ns();
+	void *ptr = malloc(size);
+	record(stats, start);
+	return ptr;
+}
+
+static inline void bench_free(ThreadStats *stats, void *ptr)
+{
+	if (stats->ops++ % SAMPLE_EVERY)
+	{
+		free(ptr);
+		return;
+	}
+	uint64_t start = now_ns();
+	free(ptr);
+	record(stats, start);
+}
+
+static inline void *bench_realloc(ThreadStats *stats, void *ptr, size_t size)
+{
+	if (stats->ops++ % SAMPLE_EVERY)
+		return realloc(ptr, size);
+	uint64_t start = now_ns();
+	void *new_ptr = realloc(ptr, size);
+	record(stats, start);
+	return new_ptr;
+}
+
+static void touch(void *ptr, size_t size)
+{
+	if (ptr)
+		memset(ptr, 0xA5, size < 64 ? size : 64);
+}
+
+/*
+	* larson: server style, each thread replaces random objects in a slot array,
+	* after every round the arrays rotate to the next thread so most frees are remote
+*/
+
+static void *larson(void *arg)
+{
+	ThreadArg *t = arg;
+
+	for (int round = 0; round < LARSON_ROUNDS; round++)
+	{
+		void **slots = larson_slots[(t->id + round) % t->nb_threads];
+		for (int i = 0; i < LARSON_OPS; i++)
+		{
+			int idx = rand_r(&t->seed) % LARSON_SLOTS;
+			size_t size = 16 + rand_r(&t->seed) % 1009;
+			bench_free(t->stats, slots[idx]);
+			slots[idx] = bench_malloc(t->stats, size);
+			touch(slots[idx], size);
+		}
+		pthread_barrier_wait(&barrier);
+	}
+	return NULL;
+}
+
+/*
+	* xmalloc: producer/consumer, even threads allocate and hand objects
+	* to the next odd thread through a ring, which frees them
+	* with a single thread the same thread produces and consumes
+*/
+
+typedef struct Ring {
+	void *items[XMALLOC_RING];
+	volatile uint64_t head __attribute__((aligned(64)));
+	volatile uint64_t tail __attribute__((aligned(64)));
+} Ring;
+
+static Ring rings[MAX_THREADS / 2];
+
+static void *xmalloc(void *arg)
+{
+	ThreadArg *t = arg;
+
+	if (t->nb_threads == 1)
+	{
+		void *batch[XMALLOC_RING];
+		for (int i = 0; i < XMALLOC_OBJECTS; i += XMALLOC_RING)
+		{
+			for (int j = 0; j < XMALLOC_RING; j++)
+			{
+				batch[j] = bench_malloc(t->stats, 16 + rand_r(&t->seed) % 241);
+				touch(batch[j], 16);
+			}
+			for (int j = 0; j < XMALLOC_RING; j++)
+				bench_free(t->stats, batch[j]);
+		}
+		return NULL;
+	}
+	if (t->id / 2 >= t->nb_threads / 2)
+		return NULL;
+	Ring *ring = &rings[t->id / 2];
+	for (int i = 0; i < XMALLOC_OBJECTS; i++)
+	{
+		if (t->id % 2 == 0)
+		{
+			void *ptr = bench_malloc(t->stats, 16 + rand_r(&t->seed) % 241);
+			touch(ptr, 16);
+			while (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == XMALLOC_RING)
+				;
+			ring->items[ring->head % XMALLOC_RING] = ptr;
+			__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+		}
+		else
+		{
+			while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail)
+				;
+			void *ptr = ring->items[ring->tail % XMALLOC_RING];
+			__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+			bench_free(t->stats, ptr);
+		}
+	}
+	return NULL;
+}
+
+/*
+	* cache-thrash: every thread allocates tiny objects and writes them hard,
+	* an allocator that hands neighbouring bytes to different threads causes false sharing
+	* cache-scratch: same loop, but each thread first frees an object the main thread
+	* allocated next to the others, which tests whether freed memory is reused across threads
+*/
+
+static void cache_loop(ThreadArg *t)
+{
+	for (int i = 0; i < CACHE_ITERATIONS; i++)
+	{
+		volatile char *ptr = bench_malloc(t->stats, CACHE_OBJECT_SIZE);
+		for (int j = 0; j < CACHE_WRITES; j++)
+			ptr[j % CACHE_OBJECT_SIZE]++;
+		bench_free(t->stats, (void *)ptr);
+	}
+}
+
+static void *cache_thrash(void *arg)
+{
+	cache_loop(arg);
+	return NULL;
+}
+
+static void *cache_scratch(void *arg)
+{
+	ThreadArg *t = arg;
+
+	bench_free(t->stats, scratch_objects[t->id]);
+	cache_loop(t);
+	return NULL;
+}
+
+/*
+	* random: mixed sizes from 16 bytes to 64 KiB, smaller sizes are more likely
+*/
+
+static size_t random_size(unsigned int *seed)
+{
+	int shift = 4 + rand_r(seed) % 13;
+	return (1u << shift) + rand_r(seed) % (1u << shift);
+}
+
+static void *random_mixed(void *arg)
+{
+	ThreadArg *t = arg;
+	void **slots = calloc(RANDOM_SLOTS, sizeof(void *));
+
+	for (int i = 0; i < RANDOM_OPS; i++)
+	{
+		int idx = rand_r(&t->seed) % RANDOM_SLOTS;
+		if (slots[idx])
+		{
+			bench_free(t->stats, slots[idx]);
+			slots[idx] = NULL;
+		}
+		else
+		{
+			size_t size = random_size(&t->seed);
+			slots[idx] = bench_malloc(t->stats, size);
+			touch(slots[idx], size);
+		}
+	}
+	for (int i = 0; i < RANDOM_SLOTS; i++)
+		free(slots[i]);
+	free(slots);
+	return NULL;
+}
+
+/*
+	* realloc: growing buffers, each step grows a random buffer by half,
+	* buffers restart small once they pass REALLOC_MAX_SIZE
+*/
+
+static void *realloc_growth(void *arg)
+{
+	ThreadArg *t = arg;
+	void *buffers[REALLOC_BUFFERS] = {0};
+	size_t sizes[REALLOC_BUFFERS] = {0};
+
+	for (int i = 0; i < REALLOC_OPS; i++)
+	{
+		int idx = rand_r(&t->seed) % REALLOC_BUFFERS;
+		size_t size = sizes[idx] ? sizes[idx] + sizes[idx] / 2 + 1 : 16;
+		if (size > REALLOC_MAX_SIZE)
+			size = 16;
+		buffers[idx] = bench_realloc(t->stats, buffers[idx], size);
+		sizes[idx] = size;
+		touch(buffers[idx], size);
+	}
+	for (int i = 0; i < REALLOC_BUFFERS; i++)
+		free(buffers[i]);
+	return NULL;
+}
+
+typedef struct Workload {
+	const char *name;
+	void *(*run)(void *);
+} Workload;
+
+static const Workload workloads[] = {
+	{"larson", larson},
+	{"xmalloc", xmalloc},
+	{"cache-scratch", cache_scratch},
+	{"cache-thrash", cache_thrash},
+	{"random", random_mixed},
+	{"realloc", realloc_growth},
+};
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void setup(const char *name, int nb_threads)
+{
+	if (!strcmp(name, "larson"))
+		for (int i = 0; i < nb_threads; i++)
+			larson_slots[i] = calloc(LARSON_SLOTS, sizeof(void *));
+	if (!strcmp(name, "cache-scratch"))
+		for (int i = 0; i < nb_threads; i++)
+			scratch_objects[i] = malloc(CACHE_OBJECT_SIZE);
+}
+
+static void teardown(const char *name, int nb_threads)
+{
+	if (!strcmp(name, "larson"))
+	{
+		for (int i = 0; i < nb_threads; i++)
+		{
+			for (int j = 0; j < LARSON_SLOTS; j++)
+				free(larson_slots[i][j]);
+			free(larson_slots[i]);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 4)
+	{
+		fprintf(stderr, "usage: %s <workload> <threads> <allocator>\n", argv[0]);
+		fprintf(stderr, "workloads:");
+		for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+			fprintf(stderr, " %s", workloads[i].name);
+		fprintf(stderr, "\n");
+		return 1;
+	}
+	const Workload *workload = NULL;
+	for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+		if (!strcmp(argv[1], workloads[i].name))
+			workload = &workloads[i];
+	int nb_threads = atoi(argv[2]);
+	if (!workload || nb_threads < 1 || nb_threads > MAX_THREADS)
+	{
+		fprintf(stderr, "bench: bad workload or thread count\n");
+		return 1;
+	}
+
+	pthread_t threads[MAX_THREADS];
+	ThreadArg args[MAX_THREADS];
+	pthread_barrier_init(&barrier, NULL, nb_threads);
+	setup(workload->name, nb_threads);
+
+	uint64_t start = now_ns();
+	for (int i = 0; i < nb_threads; i++)
+	{
+		args[i].id = i;
+		args[i].nb_threads = nb_threads;
+		args[i].seed = 12345 + i;
+		args[i].stats = calloc(1, sizeof(ThreadStats));
+		pthread_create(&threads[i], NULL, workload->run, &args[i]);
+	}
+	for (int i = 0; i < nb_threads; i++)
+		pthread_join(threads[i], NULL);
+	double seconds = (now_ns() - start) / 1e9;
+	teardown(workload->name, nb_threads);
+
+	uint64_t ops = 0;
+	size_t nb_samples = 0;
+	for (int i = 0; i < nb_threads; i++)
+	{
+		ops += args[i].stats->ops;
+		nb_samples += args[i].stats->nb_samples;
+	}
+	uint32_t *samples = malloc((nb_samples + 1) * sizeof(uint32_t));
+	size_t n = 0;
+	for (int i = 0; i < nb_threads; i++)
+	{
+		memcpy(samples + n, args[i].stats->samples, args[i].stats->nb_samples * sizeof(uint32_t));
+		n += args[i].stats->nb_samples;
+		free(args[i].stats);
+	}
+	samples[n] = 0;
+	qsort(samples, n, sizeof(uint32_t), compare_u32);
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("%s,%s,%d,%lu,%.4f,%.0f,%ld,%u,%u,%u\n", argv[3], workload->name, nb_threads,
+		   (unsigned long)ops, seconds, ops / seconds, usage.ru_maxrss,
+		   samples[n / 2], samples[n * 99 / 100], samples[n * 999 / 1000]);
+	free(samples);
+	return 0;
+}
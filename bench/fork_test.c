@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/*
+	* fork smoke test, run with LD_PRELOAD=libft_malloc_x86_64_Linux.so (make fork_test)
+	* worker threads keep every lock of the allocator busy: small, heap, mmap and aligned
+	* blocks, realloc, object pools, arenas, the profiler and the trace recorder
+	* meanwhile the main thread forks, each child allocates from every tier and exits,
+	* a child that inherited a held lock hangs and is killed by its alarm
+	* the extensions are looked up with dlsym, without them only malloc and friends run
+	* prints "fork test ok" and exits 0, or names the child that failed and exits 1
+*/
+
+#define WORKERS 4
+#define FORKS 100
+#define CHILD_TIMEOUT_S 10
+#define SLOTS 64
+
+typedef void *(*pool_create_fn)(size_t, size_t);
+typedef void *(*pool_alloc_fn)(void *);
+typedef void (*pool_free_fn)(void *, void *);
+typedef void *(*arena_create_fn)(size_t);
+typedef void *(*arena_alloc_fn)(void *, size_t, size_t);
+typedef void (*arena_destroy_fn)(void *);
+typedef void (*prof_start_fn)(size_t);
+typedef int (*trace_start_fn)(const char *);
+typedef void (*trace_stop_fn)(void);
+
+static pool_create_fn pool_create;
+static pool_alloc_fn pool_alloc;
+static pool_free_fn pool_free;
+static arena_create_fn arena_create;
+static arena_alloc_fn arena_alloc;
+static arena_destroy_fn arena_destroy;
+static void *pool;
+static volatile int stop;
+
+static const size_t sizes[] = {16, 100, 256, 1000, 4000, 40000, 200000, 1 << 20};
+
+static void churn(uint32_t *seed, void **slots)
+{
+	uint32_t r = *seed = *seed * 1664525 + 1013904223;
+	int i = (r >> 8) % SLOTS;
+	size_t size = sizes[(r >> 16) % (sizeof(sizes) / sizeof(sizes[0]))];
+
+	switch ((r >> 24) % 4)
+	{
+		case 0:
+			free(slots[i]);
+			slots[i] = malloc(size);
+			break;
+		case 1:
+			slots[i] = realloc(slots[i], size);
+			break;
+		case 2:
+			free(slots[i]);
+			slots[i] = aligned_alloc(64 << (r % 4), size);
+			break;
+		default:
+			free(slots[i]);
+			slots[i] = calloc(1, size);
+	}
+	if (slots[i])
+		memset(slots[i], 1, 16);
+}
+
+static void extensions(void)
+{
+	if (pool)
+	{
+		void *obj[40];
+		for (int i = 0; i < 40; i++)
+			obj[i] = pool_alloc(pool);
+		for (int i = 0; i < 40; i++)
+			if (obj[i])
+				pool_free(pool, obj[i]);
+	}
+	if (arena_create)
+	{
+		void *arena = arena_create(1 << 16);
+		if (arena)
+		{
+			for (int i = 0; i < 100; i++)
+				arena_alloc(arena, 1000, 16);
+			arena_destroy(arena);
+		}
+	}
+}
+
+static void *worker(void *arg)
+{
+	uint32_t seed = (uint32_t)(uintptr_t)arg;
+	void *slots[SLOTS] = {0};
+
+	while (!stop)
+	{
+		for (int i = 0; i < 64; i++)
+			churn(&seed, slots);
+		extensions();
+	}
+	for (int i = 0; i < SLOTS; i++)
+		free(slots[i]);
+	return NULL;
+}
+
+static void child(void)
+{
+	uint32_t seed = getpid();
+	void *slots[SLOTS] = {0};
+
+	alarm(CHILD_TIMEOUT_S);
+	for (int i = 0; i < 2000; i++)
+		churn(&seed, slots);
+	extensions();
+	for (int i = 0; i < SLOTS; i++)
+		free(slots[i]);
+	_exit(0);
+}
+
+int main(void)
+{
+	pthread_t threads[WORKERS];
+	prof_start_fn prof_start = (prof_start_fn)dlsym(RTLD_DEFAULT, "_malloc_prof_start");
+	trace_start_fn trace_start = (trace_start_fn)dlsym(RTLD_DEFAULT, "_malloc_trace_start");
+	trace_stop_fn trace_stop = (trace_stop_fn)dlsym(RTLD_DEFAULT, "_malloc_trace_stop");
+
+	pool_create = (pool_create_fn)dlsym(RTLD_DEFAULT, "_pool_create");
+	pool_alloc = (pool_alloc_fn)dlsym(RTLD_DEFAULT, "_pool_alloc");
+	pool_free = (pool_free_fn)dlsym(RTLD_DEFAULT, "_pool_free");
+	arena_create = (arena_create_fn)dlsym(RTLD_DEFAULT, "_arena_create");
+	arena_alloc = (arena_alloc_fn)dlsym(RTLD_DEFAULT, "_arena_alloc");
+	arena_destroy = (arena_destroy_fn)dlsym(RTLD_DEFAULT, "_arena_destroy");
+	if (!pool_alloc || !pool_free || !arena_alloc || !arena_destroy)
+		pool_create = NULL, arena_create = NULL;
+	if (pool_create)
+		pool = pool_create(48, 0);
+	if (prof_start)
+		prof_start(4096);
+	if (trace_start && trace_stop)
+		trace_start("/dev/null");
+
+	for (int i = 0; i < WORKERS; i++)
+		pthread_create(&threads[i], NULL, worker, (void *)(uintptr_t)(i + 1));
+	for (int i = 0; i < FORKS; i++)
+	{
+		int status;
+		pid_t pid = fork();
+		if (pid < 0)
+		{
+			perror("fork");
+			return 1;
+		}
+		if (pid == 0)
+			child();
+		if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status))
+		{
+			fprintf(stderr, "fork test: child %d of %d %s\n", i, FORKS,
+				WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM ? "hung" : "failed");
+			return 1;
+		}
+	}
+	stop = 1;
+	for (int i = 0; i < WORKERS; i++)
+		pthread_join(threads[i], NULL);
+	if (trace_start && trace_stop)
+		trace_stop();
+	printf("fork test ok\n");
+	return 0;
+}
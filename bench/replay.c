@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+	* replays an allocation trace recorded with FT_MALLOC_TRACE=<file>
+	* like bench.c the binary only calls the libc allocator, LD_PRELOAD picks the one under test
+	* usage: replay <trace> <allocator label>
+	* prints one CSV line:
+	*   allocator,trace,threads,ops,seconds,ops_per_sec,peak_rss_kb,peak_live_kb,rss_per_live
+	* every recorded thread gets a thread of its own, which runs its calls in their order,
+	* a call on a block waits until the thread that allocated it is done with that allocation,
+	* so frees from other threads happen in the recorded order without serializing the rest
+	* each allocation gets an id of its own: an address may be handed out again while the
+	* realloc that freed it is still running, the oldest live block of an address is the
+	* one a free or a realloc names
+	* a byte of every page of a block is written, so the RSS is that of a program using its memory
+	* peak_rss_kb: highest RSS sampled while replaying, less the RSS before the first call
+	* peak_live_kb: highest sum of the sizes of the live blocks over the trace
+*/
+
+#define TRACE_MAGIC "FTTRACE1"
+#define TRACE_MALLOC 1
+#define TRACE_CALLOC 2
+#define TRACE_REALLOC 3
+#define TRACE_ALIGNED 4
+#define TRACE_FREE 5
+#define RSS_SAMPLE_NS 1000000
+#define SPIN_BEFORE_YIELD 64
+
+/*
+	* same layout as TraceHeader and TraceRecord in include.h
+*/
+
+typedef struct TraceHeader {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t pid;
+} TraceHeader;
+
+typedef struct TraceRecord {
+	uint64_t seq;
+	uint64_t time;
+	uint64_t ptr;
+	uint64_t old_ptr;
+	uint64_t size;
+	uint32_t thread;
+	uint8_t op;
+	uint8_t align_shift;
+	uint16_t reserved;
+} TraceRecord;
+
+/*
+	* in: block the call frees or reallocates, out: block it returns, 0 for none
+*/
+
+typedef struct Op {
+	uint32_t in;
+	uint32_t out;
+	uint64_t size;
+	uint8_t op;
+	uint8_t align_shift;
+} Op;
+
+typedef struct Replayer {
+	Op *ops;
+	size_t count;
+} Replayer;
+
+/*
+	* live ids by address, open addressing with linear probing
+	* an address that is live twice keeps its ids in a queue linked through id_next
+*/
+
+typedef struct Slot {
+	uint64_t addr;
+	uint32_t id;
+} Slot;
+
+static Slot *table;
+static size_t table_mask;
+static uint32_t *id_next;
+static uint32_t *id_tail;
+static void **blocks;
+static uint8_t *ready;
+static size_t threads_done;
+
+static inline uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline size_t hash_addr(uint64_t addr)
+{
+	addr >>= 4;
+	addr ^= addr >> 33;
+	addr *= 0xff51afd7ed558ccdULL;
+	return (addr ^ (addr >> 33)) & table_mask;
+}
+
+static void live_insert(uint64_t addr, uint32_t id)
+{
+	size_t i = hash_addr(addr);
+
+	id_next[id] = 0;
+	while (table[i].addr && table[i].addr != addr)
+		i = (i + 1) & table_mask;
+	if (table[i].addr)
+	{
+		id_next[id_tail[table[i].id]] = id;
+		id_tail[table[i].id] = id;
+		return;
+	}
+	table[i].addr = addr;
+	table[i].id = id;
+	id_tail[id] = id;
+}
+
+/*
+	* Returns: the oldest live id of addr, removed from the table, 0 if addr is not live
+*/
+
+static uint32_t live_remove(uint64_t addr)
+{
+	size_t i = hash_addr(addr);
+
+	while (table[i].addr && table[i].addr != addr)
+		i = (i + 1) & table_mask;
+	if (!table[i].addr)
+		return 0;
+	uint32_t id = table[i].id;
+	if (id_next[id])
+	{
+		table[i].id = id_next[id];
+		id_tail[id_next[id]] = id_tail[id];
+		return id;
+	}
+	table[i].addr = 0;
+	for (size_t j = (i + 1) & table_mask; table[j].addr; j = (j + 1) & table_mask)
+	{
+		size_t home = hash_addr(table[j].addr);
+		if (((j - home) & table_mask) >= ((j - i) & table_mask))
+		{
+			table[i] = table[j];
+			table[j].addr = 0;
+			i = j;
+		}
+	}
+	return id;
+}
+
+static int compare_seq(const void *a, const void *b)
+{
+	uint64_t x = ((const TraceRecord *)a)->seq;
+	uint64_t y = ((const TraceRecord *)b)->seq;
+	return (x > y) - (x < y);
+}
+
+static void touch(void *ptr, size_t size)
+{
+	if (!ptr)
+		return;
+	memset(ptr, 0xA5, size < 64 ? size : 64);
+	for (size_t i = 4096; i < size; i += 4096)
+		((volatile char *)ptr)[i] = 0xA5;
+}
+
+static long resident_kb()
+{
+	long size = 0, resident = 0;
+	FILE *file = fopen("/proc/self/statm", "r");
+
+	if (file)
+	{
+		if (fscanf(file, "%ld %ld", &size, &resident) != 2)
+			resident = 0;
+		fclose(file);
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*
+	* turn the records, sorted by seq, into the calls of each thread
+	* frees of blocks allocated before the trace started and failed allocations are dropped
+	* Returns: the number of ids, peak_live gets the highest sum of live sizes
+*/
+
+static uint32_t build_ops(TraceRecord *records, size_t count, Replayer *replayers, uint64_t *peak_live)
+{
+	uint32_t ids = 0;
+	uint64_t *sizes = calloc(count + 1, sizeof(uint64_t));
+	uint64_t live = 0;
+
+	*peak_live = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		TraceRecord *record = &records[i];
+		Replayer *replayer = &replayers[record->thread];
+		Op *op = &replayer->ops[replayer->count];
+		op->op = record->op;
+		op->size = record->size;
+		op->align_shift = record->align_shift;
+		op->in = 0;
+		op->out = 0;
+		if (record->op == TRACE_FREE || (record->op == TRACE_REALLOC && (record->ptr || !record->size)))
+		{
+			uint64_t addr = record->op == TRACE_FREE ? record->ptr : record->old_ptr;
+			op->in = addr ? live_remove(addr) : 0;
+			live -= sizes[op->in];
+		}
+		if (record->op != TRACE_FREE && record->ptr)
+		{
+			op->out = ++ids;
+			sizes[ids] = record->size;
+			live_insert(record->ptr, ids);
+			live += record->size;
+			if (live > *peak_live)
+				*peak_live = live;
+		}
+		if (op->in || op->out)
+			replayer->count++;
+	}
+	free(sizes);
+	return ids;
+}
+
+/*
+	* Returns: the block of id once its allocation has run
+*/
+
+static inline void *wait_block(uint32_t id)
+{
+	for (int spins = 0; !__atomic_load_n(&ready[id], __ATOMIC_ACQUIRE); spins++)
+		if (spins >= SPIN_BEFORE_YIELD)
+			sched_yield();
+	return blocks[id];
+}
+
+static void *replay_thread(void *arg)
+{
+	Replayer *replayer = arg;
+
+	for (size_t i = 0; i < replayer->count; i++)
+	{
+		Op *op = &replayer->ops[i];
+		void *in = op->in ? wait_block(op->in) : NULL;
+		void *out = NULL;
+		switch (op->op)
+		{
+			case TRACE_MALLOC:
+				out = malloc(op->size);
+				break;
+			case TRACE_CALLOC:
+				out = calloc(1, op->size);
+				break;
+			case TRACE_REALLOC:
+				out = realloc(in, op->size);
+				break;
+			case TRACE_ALIGNED:
+				out = aligned_alloc(1UL << op->align_shift, op->size);
+				break;
+			case TRACE_FREE:
+				free(in);
+				break;
+		}
+		if (op->out)
+		{
+			touch(out, op->size);
+			blocks[op->out] = out;
+			__atomic_store_n(&ready[op->out], 1, __ATOMIC_RELEASE);
+		}
+	}
+	__atomic_fetch_add(&threads_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 3)
+	{
+		fprintf(stderr, "usage: %s <trace> <allocator>\n", argv[0]);
+		return 1;
+	}
+	int fd = open(argv[1], O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(TraceHeader))
+	{
+		fprintf(stderr, "replay: cannot read %s\n", argv[1]);
+		return 1;
+	}
+	TraceHeader *header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED || memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic))
+		|| header->record_size != sizeof(TraceRecord))
+	{
+		fprintf(stderr, "replay: %s is not a trace of this version\n", argv[1]);
+		return 1;
+	}
+
+	size_t count = (st.st_size - sizeof(TraceHeader)) / sizeof(TraceRecord);
+	TraceRecord *records = malloc((count + 1) * sizeof(TraceRecord));
+	memcpy(records, header + 1, count * sizeof(TraceRecord));
+	munmap(header, st.st_size);
+	qsort(records, count, sizeof(TraceRecord), compare_seq);
+
+	uint32_t nb_threads = 0;
+	for (size_t i = 0; i < count; i++)
+		if (records[i].thread >= nb_threads)
+			nb_threads = records[i].thread + 1;
+	Replayer *replayers = calloc(nb_threads + 1, sizeof(Replayer));
+	size_t *per_thread = calloc(nb_threads + 1, sizeof(size_t));
+	for (size_t i = 0; i < count; i++)
+		per_thread[records[i].thread]++;
+	for (uint32_t i = 0; i < nb_threads; i++)
+		replayers[i].ops = malloc((per_thread[i] + 1) * sizeof(Op));
+	free(per_thread);
+
+	size_t table_size = 1024;
+	while (table_size < count)
+		table_size *= 2;
+	table = calloc(table_size, sizeof(Slot));
+	table_mask = table_size - 1;
+	id_next = calloc(count + 1, sizeof(uint32_t));
+	id_tail = calloc(count + 1, sizeof(uint32_t));
+	uint64_t peak_live;
+	uint32_t ids = build_ops(records, count, replayers, &peak_live);
+	free(records);
+	free(table);
+	free(id_next);
+	free(id_tail);
+	blocks = calloc(ids + 1, sizeof(void *));
+	ready = calloc(ids + 1, 1);
+
+	pthread_t *threads = malloc((nb_threads + 1) * sizeof(pthread_t));
+	long base_rss = resident_kb();
+	long peak_rss = base_rss;
+	uint64_t start = now_ns();
+	for (uint32_t i = 0; i < nb_threads; i++)
+		pthread_create(&threads[i], NULL, replay_thread, &replayers[i]);
+	while (__atomic_load_n(&threads_done, __ATOMIC_ACQUIRE) < nb_threads)
+	{
+		long rss = resident_kb();
+		if (rss > peak_rss)
+			peak_rss = rss;
+		nanosleep(&(struct timespec){0, RSS_SAMPLE_NS}, NULL);
+	}
+	for (uint32_t i = 0; i < nb_threads; i++)
+		pthread_join(threads[i], NULL);
+	double seconds = (now_ns() - start) / 1e9;
+
+	size_t ops = 0;
+	for (uint32_t i = 0; i < nb_threads; i++)
+		ops += replayers[i].count;
+	long rss_kb = peak_rss - base_rss;
+	unsigned long live_kb = (peak_live + 1023) / 1024;
+	const char *name = strrchr(argv[1], '/') ? strrchr(argv[1], '/') + 1 : argv[1];
+	printf("%s,%s,%u,%zu,%.4f,%.0f,%ld,%lu,%.3f\n", argv[2], name, nb_threads, ops, seconds,
+		   seconds > 0 ? ops / seconds : 0, rss_kb, live_kb, live_kb ? (double)rss_kb / live_kb : 0);
+	return 0;
+}
@@ -0,0 +1,23 @@
+#!/bin/sh
+# runs every workload at 1..MAX_THREADS threads against glibc and this allocator
+# usage: run_bench.sh <bench binary> <allocator .so> [max threads]
+# prints CSV on stdout, one process per run so peak RSS is per run
+
+BENCH=$1
+LIB=$(realpath "$2")
+MAX_THREADS=${3:-$(nproc)}
+WORKLOADS="larson xmalloc cache-scratch cache-thrash random realloc"
+
+echo "allocator,workload,threads,ops,seconds,ops_per_sec,peak_rss_kb,p50_ns,p99_ns,p999_ns"
+for workload in $WORKLOADS; do
+	threads=1
+	while [ "$threads" -le "$MAX_THREADS" ]; do
+		"$BENCH" "$workload" "$threads" glibc
+		LD_PRELOAD="$LIB" "$BENCH" "$workload" "$threads" ft_malloc
+		if [ "$threads" -lt "$MAX_THREADS" ] && [ $((threads * 2)) -gt "$MAX_THREADS" ]; then
+			threads=$MAX_THREADS
+		else
+			threads=$((threads * 2))
+		fi
+	done
+done
@@ -1,3 +1,27 @@
 #include "include.h"
 
+/*
+	* this is the custom calloc function
+	* nmemb: number of elements
+	* size: size of one element
+	* memory fresh from mmap is already zero and is not touched,
+	* only recycled memory is cleared
+	* Returns: pointer to the zeroed memory, NULL with ENOMEM on overflow
+*/
 
+void *_calloc(size_t nmemb, size_t size) 
+{
+	size_t total;
+
+	if (__builtin_mul_overflow(nmemb, size, &total))
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	void *ptr = _malloc(total);
+	if (!ptr)
+		return NULL;
+	if (is_slab_ptr(ptr) || !block_from_ptr(ptr)->zeroed)
+		_memset(ptr, 0, total);
+	return ptr;
+}
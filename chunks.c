@@ -2,87 +2,581 @@
 #include <sys/mman.h>
 
 extern Block *freelist;
-extern size_t block_size;
-extern int allocated_blocks;
+extern Block *heap_tail;
+
+static MemoryPool *pools = NULL;
+static MemoryPool *pool_hint = NULL;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t pool_purged_epoch;
+static int hugepage_mode = HUGEPAGE_OFF;
+static unsigned char *huge_pool_arena;
+static size_t huge_pool_left;
+
+#define BITMAP_WORDS (BITMAP_SIZE / 64)
+#define RUN_PAD 16
 
 /*
-	* Function to find a free block in the freelist
-	* size: size of the memory to be allocated
-	* alignment: alignment of the memory to be allocated
-	* Returns: pointer to the allocated memory
+	* every mapping of the allocator goes through map_pages and unmap_pages
+	* they keep the syscall counts and the mapped bytes of alloc_stats
+*/
+
+void *map_pages(size_t size)
+{
+    static size_t page_size;
+    if (!page_size)
+        page_size = sysconf(_SC_PAGESIZE);
+
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    STAT_ATOMIC_ADD(alloc_stats.mmap_calls, 1);
+    if (addr == MAP_FAILED)
+        return NULL;
+    STAT_ATOMIC_ADD(alloc_stats.mapped, align_up(size, page_size));
+    return addr;
+}
+
+void unmap_pages(void *addr, size_t size)
+{
+    static size_t page_size;
+    if (!page_size)
+        page_size = sysconf(_SC_PAGESIZE);
+
+    STAT_ATOMIC_ADD(alloc_stats.munmap_calls, 1);
+    if (munmap(addr, size) == 0)
+        STAT_ATOMIC_ADD(alloc_stats.mapped, -align_up(size, page_size));
+}
+
+/*
+	* map size bytes at an alignment larger than a page
+	* twice the size is mapped, the ends outside the aligned range are unmapped again
 */
 
-static uint32_t bitmap[BITMAP_SIZE / 32]; 
-static void *memory_pool = NULL;
+static void *map_aligned_pages(size_t size, size_t alignment)
+{
+    void *request = map_pages(size + alignment);
+    if (!request)
+        return NULL;
 
+    uintptr_t raw_addr = (uintptr_t)request;
+    uintptr_t addr = align_up(raw_addr, alignment);
+    if (addr > raw_addr)
+        unmap_pages(request, addr - raw_addr);
+    if (raw_addr + alignment > addr)
+        unmap_pages((void *)(addr + size), raw_addr + alignment - addr);
+    return (void *)addr;
+}
+
+/*
+	* map a huge page arena of at least *size bytes, *size is set to the mapped length
+	* HUGEPAGE_HUGETLB asks for explicit huge pages first, they only exist when the
+	* administrator reserved some (vm.nr_hugepages), otherwise mmap fails and the
+	* arena falls back to transparent huge pages
+	* a transparent arena is aligned to HUGE_PAGE_SIZE and advised with MADV_HUGEPAGE,
+	* if THP is disabled the advice fails and the arena simply stays on small pages
+	* Returns: the arena, aligned to HUGE_PAGE_SIZE, or NULL
+*/
 
-__attribute__((hot, flatten))
+void *map_huge_pages(size_t *size)
+{
+    size_t len = align_up(*size, HUGE_PAGE_SIZE);
+    void *addr;
 
-void *find_free_block(size_t size, size_t alignment) {
-    if (__builtin_expect(!memory_pool || size == 0 || size > MEMORY_POOL_SIZE, 0))
+#ifdef MAP_HUGETLB
+    if (STAT_LOAD(hugepage_mode) == HUGEPAGE_HUGETLB) 
+	{
+        addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        STAT_ATOMIC_ADD(alloc_stats.mmap_calls, 1);
+        if (addr != MAP_FAILED) 
+		{
+            STAT_ATOMIC_ADD(alloc_stats.mapped, len);
+            STAT_ATOMIC_ADD(alloc_stats.huge_mapped, len);
+            *size = len;
+            return addr;
+        }
+    }
+#endif
+    addr = map_aligned_pages(len, HUGE_PAGE_SIZE);
+    if (!addr)
         return NULL;
+#ifdef MADV_HUGEPAGE
+    STAT_ATOMIC_ADD(alloc_stats.madvise_calls, 1);
+    madvise(addr, len, MADV_HUGEPAGE);
+#endif
+    STAT_ATOMIC_ADD(alloc_stats.huge_mapped, len);
+    *size = len;
+    return addr;
+}
+
+/*
+	* mode: HUGEPAGE_OFF, HUGEPAGE_THP or HUGEPAGE_HUGETLB
+	* only mappings made afterwards are affected, set it before the first allocation
+*/
+
+void _malloc_set_hugepages(int mode)
+{
+    if (mode >= HUGEPAGE_OFF && mode <= HUGEPAGE_HUGETLB)
+        __atomic_store_n(&hugepage_mode, mode, __ATOMIC_RELAXED);
+}
+
+/*
+	* FT_MALLOC_HUGEPAGES=thp or hugetlb turns the huge page mode on at load time
+*/
+
+__attribute__((constructor))
+static void hugepage_init()
+{
+    const char *mode = getenv("FT_MALLOC_HUGEPAGES");
+
+    if (!mode)
+        return;
+    if (!strcmp(mode, "thp"))
+        _malloc_set_hugepages(HUGEPAGE_THP);
+    else if (!strcmp(mode, "hugetlb"))
+        _malloc_set_hugepages(HUGEPAGE_HUGETLB);
+}
+
+/*
+	* find a run of n free units in a pool bitmap (1 = used)
+	* run starts as the free mask and is narrowed by shift-and-AND passes:
+	* while bit p means units p..p+k-1 are free, and-ing with run >> step
+	* makes it mean units p..p+k+step-1 are free, step doubles up to n
+	* each pass works on 256 bits at once, the bits shifted in come from the following words
+	* Returns: index of the first unit of the run, -1 if there is none
+*/
+
+__attribute__((hot, target("avx2")))
+static long bitmap_find_run_avx2(const uint64_t *bitmap, size_t n)
+{
+    uint64_t run[BITMAP_WORDS + RUN_PAD] __attribute__((aligned(32)));
+    const __m256i ones = _mm256_set1_epi64x(-1);
 
-    size_t units_needed = (size + BLOCK_UNIT_SIZE - 1) / BLOCK_UNIT_SIZE;
-	printf("DEBUG");
-    __m256i mask = _mm256_set1_epi32(0xFFFFFFFF);
-    for (size_t i = 0; i < BITMAP_SIZE / 256; i++) {   
-        _mm_prefetch((const char*)&bitmap[(i + 1) * 8], _MM_HINT_NTA); 
-
-        __m256i bitmap_chunk = _mm256_loadu_si256((__m256i*)&bitmap[i * 8]);
-        __m256i inverted_chunk = _mm256_andnot_si256(bitmap_chunk, mask);
-        int bitmask = _mm256_movemask_epi8(inverted_chunk);
-
-        if (__builtin_expect(bitmask != 0, 1)) {
-            for (int j = 0; j < 8; j++) {
-                uint32_t bits = ~bitmap[i * 8 + j];
-
-                if (__builtin_expect(bits != 0, 1)) {
-                    int free_bit = __builtin_ctz(bits);
-                    size_t start = (i * 256) + (j * 32) + free_bit;
-
-                    if (__builtin_expect(start + units_needed > BITMAP_SIZE, 0))
-                        return NULL;
-
-                    int enough_space = 1;
-                    size_t idx;
-                    for (size_t k = 0; k < units_needed; k++) {
-                        idx = start + k;
-                        if (__builtin_expect(bitmap[idx / 32] & (1U << (idx % 32)), 0)) {
-                            enough_space = 0;
-                            break;
-                        }
-                    }
-
-                    if (__builtin_expect(enough_space, 1)) {
-                        for (size_t k = 0; k < units_needed; k++) {
-                            idx = start + k;
-                            bitmap[idx / 32] |= (1U << (idx & 31));
-                        }
-
-                        uintptr_t addr = (uintptr_t)memory_pool + start * BLOCK_UNIT_SIZE;
-                        uintptr_t aligned_addr = align_up(addr + sizeof(Block), alignment);
-
-                        if (__builtin_expect(aligned_addr + size > (uintptr_t)memory_pool + MEMORY_POOL_SIZE, 0))
-                            return NULL;
-
-                        Block *block = (Block *)(aligned_addr - sizeof(Block));
-                        block->size = size;
-                        block->free = 0;
-                        block->next = NULL;
-                        block->is_mmap = 0;
-                        block->aligned_address = (void *)aligned_addr;
-
-                        allocated_blocks++;
-						printf("Allocated block at %p\n", block->aligned_address);
-						printf("Allocated blocks: %d\n", allocated_blocks);
-                        return block->aligned_address;
-                    }
-                }
-            }
+    for (size_t i = 0; i < BITMAP_WORDS; i += 4)
+        _mm256_store_si256((__m256i *)&run[i], _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&bitmap[i]), ones));
+    for (size_t i = BITMAP_WORDS; i < BITMAP_WORDS + RUN_PAD; i++)
+        run[i] = 0;
+
+    for (size_t k = 1; k < n;) 
+	{
+        size_t step = k < n - k ? k : n - k;
+        size_t q = step / 64;
+        __m128i shift = _mm_cvtsi64_si128(step % 64);
+        __m128i carry = _mm_cvtsi64_si128(64 - step % 64);
+
+        for (size_t i = 0; i < BITMAP_WORDS; i += 4) 
+		{
+            __m256i current = _mm256_load_si256((__m256i *)&run[i]);
+            __m256i low = _mm256_loadu_si256((__m256i *)&run[i + q]);
+            __m256i high = _mm256_loadu_si256((__m256i *)&run[i + q + 1]);
+            __m256i shifted = _mm256_or_si256(_mm256_srl_epi64(low, shift), _mm256_sll_epi64(high, carry));
+            _mm256_store_si256((__m256i *)&run[i], _mm256_and_si256(current, shifted));
         }
+        k += step;
+    }
+
+    for (size_t i = 0; i < BITMAP_WORDS; i += 4) 
+	{
+        __m256i chunk = _mm256_load_si256((__m256i *)&run[i]);
+        if (_mm256_testz_si256(chunk, chunk))
+            continue;
+        for (size_t j = i; j < i + 4; j++)
+            if (run[j])
+                return j * 64 + __builtin_ctzll(run[j]);
+    }
+    return -1;
+}
+
+/*
+	* the same search one word at a time, for CPUs without AVX2
+*/
+
+static long bitmap_find_run_scalar(const uint64_t *bitmap, size_t n)
+{
+    uint64_t run[BITMAP_WORDS + RUN_PAD];
+
+    for (size_t i = 0; i < BITMAP_WORDS; i++)
+        run[i] = ~bitmap[i];
+    for (size_t i = BITMAP_WORDS; i < BITMAP_WORDS + RUN_PAD; i++)
+        run[i] = 0;
+
+    for (size_t k = 1; k < n;)
+	{
+        size_t step = k < n - k ? k : n - k;
+        size_t q = step / 64;
+        size_t shift = step % 64;
+
+        for (size_t i = 0; i < BITMAP_WORDS; i++)
+            run[i] &= shift ? run[i + q] >> shift | run[i + q + 1] << (64 - shift) : run[i + q];
+        k += step;
+    }
+
+    for (size_t i = 0; i < BITMAP_WORDS; i++)
+        if (run[i])
+            return i * 64 + __builtin_ctzll(run[i]);
+    return -1;
+}
+
+__attribute__((hot, always_inline))
+static inline long bitmap_find_run(const uint64_t *bitmap, size_t n)
+{
+    if (__builtin_expect(!__atomic_load_n(&cpu_features.ready, __ATOMIC_ACQUIRE), 0))
+        cpu_features_init();
+    if (cpu_features.avx2)
+        return bitmap_find_run_avx2(bitmap, n);
+    return bitmap_find_run_scalar(bitmap, n);
+}
+
+/*
+	* set (used = 1) or clear (used = 0) the units start..start+n-1
+*/
+
+static void bitmap_set_run(uint64_t *bitmap, size_t start, size_t n, int used)
+{
+    while (n) 
+	{
+        size_t bit = start % 64;
+        size_t count = n < 64 - bit ? n : 64 - bit;
+        uint64_t mask = (count == 64 ? ~0ULL : ((1ULL << count) - 1)) << bit;
+
+        if (used)
+            bitmap[start / 64] |= mask;
+        else
+            bitmap[start / 64] &= ~mask;
+        start += count;
+        n -= count;
+    }
+}
+
+static int bitmap_run_is_free(const uint64_t *bitmap, size_t start, size_t n)
+{
+    if (start + n > BITMAP_SIZE)
+        return 0;
+    while (n) 
+	{
+        size_t bit = start % 64;
+        size_t count = n < 64 - bit ? n : 64 - bit;
+        uint64_t mask = (count == 64 ? ~0ULL : ((1ULL << count) - 1)) << bit;
+
+        if (bitmap[start / 64] & mask)
+            return 0;
+        start += count;
+        n -= count;
+    }
+    return 1;
+}
+
+/*
+	* in huge page mode pools are cut from a huge page arena, HUGE_PAGE_SIZE is a
+	* multiple of MEMORY_POOL_SIZE so every slice keeps the pool alignment
+	* the pool lock must be held
+*/
+
+static void *huge_pool_slice()
+{
+    if (!huge_pool_left) 
+	{
+        size_t size = HUGE_PAGE_SIZE;
+        huge_pool_arena = map_huge_pages(&size);
+        if (!huge_pool_arena)
+            return NULL;
+        huge_pool_left = size;
+    }
+    void *slice = huge_pool_arena;
+    huge_pool_arena += MEMORY_POOL_SIZE;
+    huge_pool_left -= MEMORY_POOL_SIZE;
+    return slice;
+}
+
+/*
+	* map a new pool aligned to MEMORY_POOL_SIZE so a block finds its pool by masking
+	* the pool header takes the first units of the pool, they are marked as used
+*/
+
+static MemoryPool *map_pool()
+{
+    int huge = STAT_LOAD(hugepage_mode) != HUGEPAGE_OFF;
+    MemoryPool *pool = huge ? huge_pool_slice() : map_aligned_pages(MEMORY_POOL_SIZE, MEMORY_POOL_SIZE);
+    if (!pool)
+        return NULL;
+    if (!pagemap_set(pool, MEMORY_POOL_SIZE, (uintptr_t)pool | PAGEMAP_POOL))
+    {
+        pagemap_set(pool, MEMORY_POOL_SIZE, 0);
+        if (!huge)
+            unmap_pages(pool, MEMORY_POOL_SIZE);
+        return NULL;
     }
-    return NULL;
+
+    bitmap_set_run(pool->bitmap, 0, POOL_HEADER_UNITS, 1);
+    pool->free_units = BITMAP_SIZE - POOL_HEADER_UNITS;
+    pool->fresh_unit = POOL_HEADER_UNITS;
+    pool->dirty = 0;
+    pool->huge = huge;
+    pool->dirty_epoch = 0;
+    pool->next = pools;
+    pools = pool;
+    return pool;
 }
+
+__attribute__((always_inline))
+static inline MemoryPool *pool_from_block(Block *block)
+{
+    return (MemoryPool *)((uintptr_t)block & ~((uintptr_t)MEMORY_POOL_SIZE - 1));
+}
+
+__attribute__((always_inline))
+static inline size_t block_first_unit(MemoryPool *pool, Block *block)
+{
+    return ((uintptr_t)block - BLOCK_PAD - (uintptr_t)pool) / BLOCK_UNIT_SIZE;
+}
+
+/*
+	* Function to find a free block in the bitmap pools
+	* size: size of the memory to be allocated, at most POOL_MAX_SIZE
+	* alignment: alignment of the memory to be allocated, at most ALIGNMENT
+	* the block takes a run of units: header padding, the Block and the user data
+	* pools are searched from the last one that served a block, a new one is mapped when all are full
+	* Returns: pointer to the allocated memory
+*/
+
+__attribute__((hot))
+void *find_free_block(size_t size, size_t alignment) 
+{
+    if (__builtin_expect(size == 0 || size > POOL_MAX_SIZE || alignment > ALIGNMENT, 0))
+        return NULL;
+
+    size_t units = (size + BLOCK_SIZE + BLOCK_UNIT_SIZE - 1) / BLOCK_UNIT_SIZE;
+    MemoryPool *pool = pool_hint;
+    long start = -1;
+
+    pthread_mutex_lock(&pool_lock);
+    for (int pass = 0; pass < 2 && start < 0; pass++) 
+	{
+        for (pool = pass ? pools : pool_hint; pool; pool = pool->next) 
+		{
+            if (pass && pool == pool_hint)
+                break;
+            if (pool->free_units >= units && (start = bitmap_find_run(pool->bitmap, units)) >= 0)
+                break;
+        }
+    }
+    if (start < 0) 
+	{
+        pool = map_pool();
+        if (!pool) 
+		{
+            pthread_mutex_unlock(&pool_lock);
+            return NULL;
+        }
+        start = bitmap_find_run(pool->bitmap, units);
+    }
+    bitmap_set_run(pool->bitmap, start, units, 1);
+    pool->free_units -= units;
+    int zeroed = (size_t)start >= pool->fresh_unit;
+    if (start + units > pool->fresh_unit)
+        pool->fresh_unit = start + units;
+    pool_hint = pool;
+    STAT_ADD(alloc_stats.pool_nmalloc, 1);
+    STAT_ADD(alloc_stats.pool_units, units);
+    STAT_ADD(alloc_stats.pool_allocated, units * BLOCK_UNIT_SIZE - BLOCK_SIZE);
+    pthread_mutex_unlock(&pool_lock);
+
+    uintptr_t aligned_addr = (uintptr_t)pool + start * BLOCK_UNIT_SIZE + BLOCK_SIZE;
+    Block *block = (Block *)(aligned_addr - sizeof(Block));
+    block->size = units * BLOCK_UNIT_SIZE - BLOCK_SIZE;
+    block->free = 0;
+    block->zeroed = zeroed;
+    block->next = NULL;
+    block->prev = NULL;
+    block->is_mmap = BLOCK_POOL;
+    block->aligned_address = (void *)aligned_addr;
+    return block->aligned_address;
+}
+
+/*
+	* purge the whole pages of the free runs of a pool, the pool lock must be held
+	* units past fresh_unit were never touched and are skipped
+	* a zeroed run that reaches fresh_unit moves fresh_unit back, those units are fresh again
+	* Returns: 1 if pages were purged
+*/
+
+static int purge_pool(MemoryPool *pool)
+{
+    static size_t page_units;
+    if (!page_units)
+        page_units = sysconf(_SC_PAGESIZE) / BLOCK_UNIT_SIZE;
+
+    size_t unit = POOL_HEADER_UNITS;
+    int purged = 0;
+
+    while (unit < pool->fresh_unit) 
+	{
+        if (pool->bitmap[unit / 64] & (1ULL << (unit % 64))) 
+		{
+            unit++;
+            continue;
+        }
+        size_t end = unit;
+        while (end < pool->fresh_unit && !(pool->bitmap[end / 64] & (1ULL << (end % 64))))
+            end++;
+        size_t first = align_up(unit, page_units);
+        size_t last = end & ~(page_units - 1);
+        if (last > first) 
+		{
+            int zero = purge_pages((char *)pool + first * BLOCK_UNIT_SIZE, (last - first) * BLOCK_UNIT_SIZE);
+            if (zero && last == end && end == pool->fresh_unit)
+                pool->fresh_unit = first;
+            purged = 1;
+        }
+        unit = end;
+    }
+    pool->dirty = 0;
+    return purged;
+}
+
+static int purge_pools_locked(uint32_t epoch, int all)
+{
+    int purged = 0;
+
+    for (MemoryPool *pool = pools; pool; pool = pool->next)
+        if (pool->dirty && (all || decay_is_due(pool->dirty_epoch, epoch)))
+            purged |= purge_pool(pool);
+    return purged;
+}
+
+void pool_fork_lock()
+{
+    pthread_mutex_lock(&pool_lock);
+}
+
+void pool_fork_unlock()
+{
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+	* pool part of _malloc_frag_report, the free units of every pool
+*/
+
+void pool_frag(struct malloc_frag_report *report)
+{
+    pthread_mutex_lock(&pool_lock);
+    for (MemoryPool *pool = pools; pool; pool = pool->next)
+    {
+        report->pools++;
+        report->pool_free_bytes += pool->free_units * BLOCK_UNIT_SIZE;
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+	* purge the pools whose decay is over, or every dirty pool with all set
+	* Returns: 1 if pages were purged
+*/
+
+int purge_pools(int all)
+{
+    int purged;
+
+    pthread_mutex_lock(&pool_lock);
+    purged = purge_pools_locked(decay_epoch(), all);
+    pthread_mutex_unlock(&pool_lock);
+    return purged;
+}
+
+/*
+	* mark a pool as holding freed units, then run the decay once per epoch
+	* the pool lock must be held
+*/
+
+static void pool_decay(MemoryPool *pool)
+{
+    uint32_t epoch = decay_epoch();
+
+    pool->dirty = 1;
+    pool->dirty_epoch = epoch;
+    if (!epoch || epoch == pool_purged_epoch)
+        return;
+    pool_purged_epoch = epoch;
+    purge_pools_locked(epoch, 0);
+}
+
+/*
+	* give the units of a pool block back
+	* a pool that becomes empty is unmapped unless it is the only one or a huge page slice
+	* the freed units start a new decay in their pool
+*/
+
+void free_pool_block(Block *block)
+{
+    MemoryPool *pool = pool_from_block(block);
+    size_t units = (block->size + BLOCK_SIZE) / BLOCK_UNIT_SIZE;
+
+    pthread_mutex_lock(&pool_lock);
+    bitmap_set_run(pool->bitmap, block_first_unit(pool, block), units, 0);
+    pool->free_units += units;
+    STAT_ADD(alloc_stats.pool_nfree, 1);
+    STAT_ADD(alloc_stats.pool_units, -units);
+    STAT_ADD(alloc_stats.pool_allocated, -block->size);
+    if (pool->free_units == BITMAP_SIZE - POOL_HEADER_UNITS && !pool->huge && (pool != pools || pool->next)) 
+	{
+        MemoryPool **link = &pools;
+        while (*link != pool)
+            link = &(*link)->next;
+        *link = pool->next;
+        if (pool_hint == pool)
+            pool_hint = pools;
+        pagemap_set(pool, MEMORY_POOL_SIZE, 0);
+        unmap_pages(pool, MEMORY_POOL_SIZE);
+    }
+    else
+        pool_decay(pool);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+	* resize a pool block without moving it
+	* grows over the following units when they are free, shrinks by clearing the tail
+	* Returns: 1 if the block now holds new_size bytes
+*/
+
+int resize_pool_block(Block *block, size_t new_size)
+{
+    if (new_size > POOL_MAX_SIZE)
+        return 0;
+
+    MemoryPool *pool = pool_from_block(block);
+    size_t start = block_first_unit(pool, block);
+    size_t units = (block->size + BLOCK_SIZE) / BLOCK_UNIT_SIZE;
+    size_t new_units = (new_size + BLOCK_SIZE + BLOCK_UNIT_SIZE - 1) / BLOCK_UNIT_SIZE;
+    int done = 1;
+
+    pthread_mutex_lock(&pool_lock);
+    if (new_units > units) 
+	{
+        done = bitmap_run_is_free(pool->bitmap, start + units, new_units - units);
+        if (done) 
+		{
+            bitmap_set_run(pool->bitmap, start + units, new_units - units, 1);
+            pool->free_units -= new_units - units;
+            if (start + new_units > pool->fresh_unit)
+                pool->fresh_unit = start + new_units;
+        }
+    } 
+	else if (new_units < units) 
+	{
+        bitmap_set_run(pool->bitmap, start + new_units, units - new_units, 0);
+        pool->free_units += units - new_units;
+        pool_decay(pool);
+    }
+    if (done)
+    {
+        STAT_ADD(alloc_stats.pool_units, new_units - units);
+        STAT_ADD(alloc_stats.pool_allocated, (new_units - units) * BLOCK_UNIT_SIZE);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if (done)
+        block->size = new_units * BLOCK_UNIT_SIZE - BLOCK_SIZE;
+    return done;
+}
+
 /*
 	* Function to split a block into two blocks
 	* block: block to be split
@@ -95,25 +589,38 @@ inline void split_block(Block *block, size_t size, size_t alignment)
 {
     size_t remaining_size = block->size - size - BLOCK_SIZE;
     uintptr_t new_block_address = (uintptr_t)block + BLOCK_SIZE + size;
-    uintptr_t aligned_new_block_address = align_up(new_block_address, alignment);
+    (void)alignment;
     
-    if (remaining_size >= BLOCK_SIZE) 
+    if (remaining_size >= ALIGNMENT) 
 	{
-        Block *new_block = (Block *)aligned_new_block_address;
+        Block *new_block = (Block *)new_block_address;
         new_block->size = remaining_size;
         new_block->free = 1;
+        new_block->zeroed = block->zeroed;
+        new_block->purged = block->purged;
+        new_block->dirty_epoch = block->dirty_epoch;
+        new_block->is_mmap = BLOCK_HEAP;
+        new_block->aligned_address = (void *)(new_block_address + sizeof(Block));
         new_block->next = block->next;
+        new_block->prev = block;
+        if (block->next)
+            block->next->prev = new_block;
         block->size = size;
         block->next = new_block;
+        if (block == heap_tail)
+            heap_tail = new_block;
     }
 }
 
 /*
-	* this function call sbrk to allocate memory
+	* this function maps a new heap chunk
 	* last: last block in the freelist
 	* size: size of the memory to be allocated
 	* alignment: alignment of the memory to be allocated
-	* only be used if the requested size is larger than the block size
+	* the chunk is at least MMAP_SIZE bytes, what is left after the block becomes a free block
+	* in huge page mode the chunk is a huge page arena, a multiple of HUGE_PAGE_SIZE
+	* both blocks are linked after last, the heap lock must be held
+	* nothing is printed here, stdio may call back into the allocator
 	* Returns: pointer to the allocated memory
 */
 
@@ -124,83 +631,110 @@ Block *request_space(Block *last, size_t size, size_t alignment)
 
     if ((alignment & (alignment - 1)) != 0) 
 	{
-        fprintf(stderr, "Error: Alignment must be a power of two.\n");
+        errno = EINVAL;
         return NULL;
     }
 
     size_t alignment_mask = alignment - 1;
-    size_t total_size = size + sizeof(Block) + sizeof(Block *) + alignment_mask;
+    size_t total_size = size + BLOCK_SIZE + alignment_mask;
     size_t page_size = sysconf(_SC_PAGESIZE);
+    if (total_size < MMAP_SIZE)
+        total_size = MMAP_SIZE;
     total_size = (total_size + page_size - 1) & ~(page_size - 1);
 
-    void *request = mmap(NULL, total_size, PROT_READ | PROT_WRITE,
-                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (request == MAP_FAILED) 
-	{
-        perror("mmap failed");
+    void *request;
+    if (STAT_LOAD(hugepage_mode) != HUGEPAGE_OFF)
+        request = map_huge_pages(&total_size);
+    else
+        request = map_pages(total_size);
+    if (!request) 
+        return NULL;
+    if (!pagemap_set(request, total_size, (uintptr_t)request | PAGEMAP_HEAP))
+    {
+        pagemap_set(request, total_size, 0);
+        if (STAT_LOAD(hugepage_mode) != HUGEPAGE_OFF)
+            STAT_ATOMIC_ADD(alloc_stats.huge_mapped, -total_size);
+        unmap_pages(request, total_size);
         return NULL;
     }
 
-	if (mprotect(request, total_size, PROT_READ | PROT_WRITE) == -1) 
-	{
-		perror("mprotect failed");
-		if (munmap(request, total_size) == -1)
-			perror("munmap failed");
-		return NULL;
-	}
-
     uintptr_t raw_addr = (uintptr_t)request;
-    uintptr_t aligned_addr = align_up(raw_addr + sizeof(Block) + sizeof(Block *), alignment); 
-
-    if (aligned_addr + size > raw_addr + total_size) 
-	{
-        if (munmap(request, total_size) == -1)
-			perror("munmap failed");
-        fprintf(stderr, "Error: Aligned address exceeds allocated memory.\n");
-        return NULL;
-    }
+    uintptr_t aligned_addr = align_up(raw_addr + BLOCK_SIZE, alignment); 
+    uintptr_t chunk_end = raw_addr + total_size;
 
-    Block *block = (Block *)(raw_addr);
+    Block *block = (Block *)(aligned_addr - sizeof(Block));
     block->size = size;
     block->free = 0;
-    block->is_mmap = 1;
+    block->zeroed = 1;
+    block->purged = 0;
+    block->dirty_epoch = 0;
+    block->is_mmap = BLOCK_HEAP;
     block->next = NULL;
+    block->prev = last;
     block->aligned_address = (void *)aligned_addr;
 
-    Block **back_ptr = (Block **)(aligned_addr - sizeof(Block *));
-    *back_ptr = block;
+    if (chunk_end - (aligned_addr + size) >= BLOCK_SIZE + ALIGNMENT) 
+	{
+        Block *rest = (Block *)(aligned_addr + size + BLOCK_PAD);
+        rest->size = chunk_end - (aligned_addr + size + BLOCK_SIZE);
+        rest->free = 1;
+        rest->zeroed = 1;
+        rest->purged = 0;
+        rest->dirty_epoch = 0;
+        rest->is_mmap = BLOCK_HEAP;
+        rest->next = NULL;
+        rest->prev = block;
+        rest->aligned_address = (void *)(aligned_addr + size + BLOCK_SIZE);
+        block->next = rest;
+    }
 
     if (last)
         last->next = block;
     else if (!freelist)
         freelist = block;
-    allocated_blocks++;
     return block;
 }
 
 /*
 	* this function call mmap to allocate memory
 	* size: size of the memory to be allocated
-	* alignment: alignment of the memory to be allocated
+	* alignment: alignment of the memory to be allocated, at most a page
+	* the mapping is page aligned so the header offset is known up front,
+	* _free unmaps exactly offset + size bytes
+	* in huge page mode blocks of HUGE_PAGE_SIZE and more get a huge page arena,
+	* their size is raised to the end of the arena so _free unmaps all of it
+	* other blocks take a mapping from the large mapping cache first, it is not zeroed
 	* Returns: pointer to the allocated memory
 */
 
 __attribute__((hot))
 void *request_space_mmap(size_t size, size_t alignment) 
 {
-    size_t total_size = size + BLOCK_SIZE + alignment - 1;
-    void *mapped_memory = mmap(NULL, total_size, PROT_READ | PROT_WRITE,
-                               MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    size_t offset = align_up(BLOCK_SIZE, alignment);
+    size_t total_size = offset + size;
+    int huge = STAT_LOAD(hugepage_mode) != HUGEPAGE_OFF && total_size >= HUGE_PAGE_SIZE;
+    void *mapped_memory;
+    int zeroed = 1;
 
-    if (mapped_memory == MAP_FAILED)
-        return NULL;
-	
-	if (mprotect(mapped_memory, total_size, PROT_READ | PROT_WRITE) == -1) 
+    if (huge) 
 	{
-		perror("mprotect failed");
-		munmap(mapped_memory, total_size);
-		return NULL;
-	}
+        mapped_memory = map_huge_pages(&total_size);
+        size = total_size - offset;
+    }
+    else if ((mapped_memory = mapcache_get(align_up(total_size, sysconf(_SC_PAGESIZE)))))
+        zeroed = 0;
+    else
+        mapped_memory = map_pages(total_size);
+    if (!mapped_memory)
+        return NULL;
+    if (!pagemap_set(mapped_memory, total_size, (uintptr_t)mapped_memory | PAGEMAP_MMAP))
+    {
+        pagemap_set(mapped_memory, total_size, 0);
+        if (huge)
+            STAT_ATOMIC_ADD(alloc_stats.huge_mapped, -total_size);
+        unmap_pages(mapped_memory, total_size);
+        return NULL;
+    }
 
     uintptr_t raw_addr = (uintptr_t)mapped_memory;
     uintptr_t aligned_addr = align_up(raw_addr + BLOCK_SIZE, alignment); 
@@ -208,11 +742,16 @@ void *request_space_mmap(size_t size, size_t alignment)
 
     block->size = size;
     block->next = NULL;
+    block->prev = NULL;
     block->free = 0;
-    block->is_mmap = 1;
+    block->zeroed = zeroed;
+    block->huge = huge;
+    block->is_mmap = BLOCK_MMAP;
     block->aligned_address = (void *)aligned_addr;
 
-    allocated_blocks++;
+    STAT_ATOMIC_ADD(alloc_stats.large_nmalloc, 1);
+    STAT_ATOMIC_ADD(alloc_stats.large_allocated, size);
+    STAT_ATOMIC_ADD(alloc_stats.large_mapped, align_up(total_size, sysconf(_SC_PAGESIZE)));
     return block->aligned_address;
 }
 
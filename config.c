@@ -0,0 +1,65 @@
+#include "include.h"
+
+extern size_t block_size[];
+
+/*
+	* allocator tuning derived from the cache topology of the machine it runs on
+	* filled once by alloc_config_init, called by the first thread cache before any
+	* slab span exists, and by the copy kernels before they read their thresholds
+*/
+
+AllocConfig __attribute__((visibility("hidden")))alloc_config = {0};
+
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+
+__attribute__((always_inline))
+static inline size_t clamp(size_t value, size_t low, size_t high)
+{
+	return value < low ? low : value > high ? high : value;
+}
+
+/*
+	* thread cache: a thread keeps at most a quarter of its L2, or of its share of the LLC
+	*   when that is smaller, spread evenly over the bins, so the slots it reuses are still hot,
+	*   the larger aligned classes go down to a single flush batch
+	* slab spans: a span carves at most an L1d of slots of its class, and at least a refill
+	*   batch, so a span that empties goes back to the free spans after no more slots than
+	*   the class keeps hot, the tail of a span left uncarved is never touched
+	* non-temporal threshold: 3/4 of the LLC, a copy larger than that would evict it anyway
+	* prefetch distance: 16 lines ahead of the streaming copy
+*/
+
+static void alloc_config_setup()
+{
+	AllocConfig *config = &alloc_config;
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	config->l1d_size = CACHE_SIZE_L1;
+	config->l2_size = CACHE_SIZE_L2;
+	config->line_size = CACHE_LINE_SIZE;
+	get_cache_info(config);
+	if (!config->llc_size)
+		config->llc_size = config->l2_size;
+	if (config->line_size < CACHE_LINE_SIZE || (config->line_size & (config->line_size - 1)))
+		config->line_size = CACHE_LINE_SIZE;
+	config->cores = cores > 0 ? cores : 1;
+
+	size_t budget = config->l2_size / 4;
+	size_t llc_share = config->llc_size / config->cores / 2;
+	if (llc_share < budget)
+		budget = llc_share;
+	for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+	{
+		config->tcache_max[i] = clamp(budget / BIN_COUNT / block_size[i], i < BIN_COUNT ? TCACHE_MIN : TCACHE_BATCH, TCACHE_MAX);
+		size_t span_slots = SPAN_SIZE / block_size[i];
+		config->slab_slots[i] = clamp(config->l1d_size / block_size[i],
+									  span_slots < TCACHE_BATCH ? span_slots : TCACHE_BATCH, span_slots);
+	}
+	config->nt_threshold = config->llc_size / 4 * 3;
+	config->prefetch_distance = 16 * config->line_size;
+}
+
+void alloc_config_init()
+{
+	pthread_once(&config_once, alloc_config_setup);
+}
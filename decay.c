@@ -0,0 +1,160 @@
+#include "include.h"
+#include <stdlib.h>
+#include <time.h>
+
+extern Block *freelist;
+
+/*
+	* free memory goes back to the kernel after it has stayed free for a while
+	* time is cut in epochs of decay_ms / 2, a free heap block or pool remembers the epoch
+	* it was last written in and is purged once two epochs have passed: between
+	* decay_ms / 2 and decay_ms after its last free
+	* the check piggybacks on the heap and pool frees, which already hold their lock,
+	* so there is no background thread, and an idle process keeps its pages until _malloc_trim
+	* DECAY_DEFAULT_MS: decay when neither FT_MALLOC_DECAY_MS nor _malloc_set_decay say otherwise
+*/
+
+#define DECAY_DEFAULT_MS 10000
+
+static long decay_ms = DECAY_DEFAULT_MS;
+static int decay_advice = MADV_DONTNEED;
+static uint32_t heap_purged_epoch;
+
+/*
+	* Returns: the current epoch, 0 while the decay is off
+*/
+
+uint32_t decay_epoch()
+{
+	struct timespec now;
+	long ms = STAT_LOAD(decay_ms);
+
+	if (ms < 0)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	long epoch_ms = ms / 2 ? ms / 2 : 1;
+	return (uint32_t)((now.tv_sec * 1000 + now.tv_nsec / 1000000) / epoch_ms) + 1;
+}
+
+/*
+	* hand the pages of addr..addr+size back to the kernel, both ends are page aligned
+	* MADV_DONTNEED pages read back as zero, MADV_FREE pages may keep their old content
+	* Returns: 1 if the pages now read as zero
+*/
+
+int purge_pages(void *addr, size_t size)
+{
+	int advice = STAT_LOAD(decay_advice);
+
+	STAT_ATOMIC_ADD(alloc_stats.madvise_calls, 1);
+	if (madvise(addr, size, advice) != 0)
+		return 0;
+	STAT_ATOMIC_ADD(alloc_stats.purged, size);
+	return advice == MADV_DONTNEED;
+}
+
+/*
+	* purge the whole pages inside the user area of a free heap block
+	* the partial pages at both ends are cleared by hand so a MADV_DONTNEED block is zeroed
+	* Returns: 1 if pages were purged
+*/
+
+static int purge_heap_block(Block *block)
+{
+	static size_t page_size;
+	if (!page_size)
+		page_size = sysconf(_SC_PAGESIZE);
+
+	uintptr_t area = (uintptr_t)block->aligned_address;
+	uintptr_t start = align_up(area, page_size);
+	uintptr_t end = (area + block->size) & ~(page_size - 1);
+
+	if (end <= start)
+		return 0;
+	if (purge_pages((void *)start, end - start))
+	{
+		_memset((void *)area, 0, start - area);
+		_memset((void *)end, 0, area + block->size - end);
+		block->zeroed = 1;
+	}
+	else
+		block->purged = 1;
+	return 1;
+}
+
+/*
+	* purge the free heap blocks that are due, or all of them with all set
+	* the heap lock must be held
+	* Returns: 1 if pages were purged
+*/
+
+int purge_heap(uint32_t epoch, int all)
+{
+	int purged = 0;
+
+	for (Block *block = freelist; block; block = block->next)
+		if (block->free && !block->zeroed && !block->purged
+			&& (all || decay_is_due(block->dirty_epoch, epoch)))
+			purged |= purge_heap_block(block);
+	return purged;
+}
+
+/*
+	* called by heap_free_block, the heap lock is held
+	* the heap is walked at most once per epoch
+*/
+
+void heap_decay(uint32_t epoch)
+{
+	if (!epoch || epoch == heap_purged_epoch)
+		return;
+	heap_purged_epoch = epoch;
+	purge_heap(epoch, 0);
+}
+
+/*
+	* decay_ms: time a free page stays resident, negative turns the decay off
+	* advice: MADV_DONTNEED (RSS drops at once) or MADV_FREE (the kernel takes the pages when it needs them)
+*/
+
+void _malloc_set_decay(long ms, int advice)
+{
+	__atomic_store_n(&decay_ms, ms, __ATOMIC_RELAXED);
+	if (advice == MADV_DONTNEED || advice == MADV_FREE)
+		__atomic_store_n(&decay_advice, advice, __ATOMIC_RELAXED);
+}
+
+/*
+	* hand every free page of the heap, the slab spans and the pools back to the kernel now, whatever its age,
+	* and unmap the mappings parked in the large mapping cache
+	* pad: kept for the malloc_trim signature, nothing is held back
+	* Returns: 1 if memory was released, 0 otherwise
+*/
+
+int _malloc_trim(size_t pad)
+{
+	int purged;
+
+	(void)pad;
+	pthread_mutex_lock(&heap_lock);
+	purged = purge_heap(0, 1);
+	purged |= purge_spans(0, 1);
+	pthread_mutex_unlock(&heap_lock);
+	purged |= mapcache_flush();
+	return purge_pools(1) | purged;
+}
+
+/*
+	* FT_MALLOC_DECAY_MS=<ms> sets the decay at load time, -1 turns it off
+	* FT_MALLOC_MADV_FREE=1 purges with MADV_FREE instead of MADV_DONTNEED
+*/
+
+__attribute__((constructor))
+static void decay_init()
+{
+	const char *ms = getenv("FT_MALLOC_DECAY_MS");
+	const char *lazy = getenv("FT_MALLOC_MADV_FREE");
+
+	_malloc_set_decay(ms ? strtol(ms, NULL, 10) : DECAY_DEFAULT_MS,
+					  lazy && *lazy == '1' ? MADV_FREE : MADV_DONTNEED);
+}
@@ -1,49 +1,109 @@
 #include "include.h"
+#include <stdlib.h>
 
 extern Block *freelist;
-extern size_t block_size;
-extern int allocated_blocks;
+extern Block *heap_tail;
+
+/*
+	* merge next into block, both are free and touch in memory, the heap lock must be held
+	* two zeroed blocks stay zeroed, the header between them is cleared
+	* the merged block keeps the newest dirty epoch of the two
+*/
+
+__attribute__((always_inline))
+static inline void merge_free_blocks(Block *block, Block *next)
+{
+    size_t merged_end = block->size;
+    int zeroed = block->zeroed && next->zeroed;
+
+    if (next == heap_tail)
+        heap_tail = block;
+    block->size += BLOCK_SIZE + next->size;
+    block->purged = block->purged && next->purged;
+    if (next->dirty_epoch > block->dirty_epoch)
+        block->dirty_epoch = next->dirty_epoch;
+    block->next = next->next;
+    if (block->next)
+        block->next->prev = block;
+    block->zeroed = zeroed;
+    if (zeroed)
+        memset((char *)block->aligned_address + merged_end, 0, BLOCK_SIZE);
+}
 
 /*
 	* Function to coalesce free blocks
-	* this function is called after freeing a block
-	* it coalesces adjacent free blocks
-	* if two adjacent blocks are free, they are merged into a single block
-	* this is done to reduce fragmentation
-	* the size of the first block is increased by the size of the second block
-	* the next pointer of the first block is updated to point to the block after the second block
-	* this process is repeated until no more free blocks can be coalesced
-	* this function is called after freeing a block
+	* block: a heap block that was just freed
+	* it is merged with its neighbours in the list when they are free and touch it,
+	* the list also links separate chunks
+	* a free block never touches another free block, so looking at both neighbours is enough
+	* this is done to reduce fragmentation, the heap lock must be held
+	* Returns: the merged block
+*/
+
+__attribute__((hot, always_inline))
+inline Block *coalesce_free_blocks(Block *block) {
+    Block *next = block->next;
+    Block *prev = block->prev;
+
+    if (next && next->free && block_is_adjacent(block, next))
+        merge_free_blocks(block, next);
+    if (prev && prev->free && block_is_adjacent(prev, block))
+    {
+        merge_free_blocks(prev, block);
+        block = prev;
+    }
+    return block;
+}
+
+/*
+	* hand a heap block back, the heap lock must be held
+	* the user has written to it, so it is no longer zeroed and it starts a new decay
+	* free blocks whose decay is over are purged afterwards
 */
 
+void heap_free_block(Block *block) 
+{
+	block->free = 1;
+	block->zeroed = 0;
+	block->purged = 0;
+	block->dirty_epoch = decay_epoch();
+	block = coalesce_free_blocks(block);
+	heap_decay(block->dirty_epoch);
+}
+
+/*
+	* push a slab slot of bin_index on the thread cache, flush a batch when the bin is full
+*/
 
-__attribute__((hot, flatten, always_inline))
-inline void coalesce_free_blocks() {
-    Block *current = freelist;
-    while (current && current->next) {
-        if (current->free && current->next->free) {
-            current->size += BLOCK_SIZE + current->next->size;
-            current->next = current->next->next;
-
-            uintptr_t aligned_addr = (uintptr_t)(current + 1);
-            if ((aligned_addr & ALIGNMENT - 1) != 0) 
-                printf("Warning: Coalesced block not aligned at %p\n", (void *)aligned_addr);
-		_mm_prefetch(current->next, _MM_HINT_T0);
-        } else {
-            current = current->next;
-        }
+__attribute__((hot, always_inline))
+static inline void free_slot(void *ptr, int bin_index)
+{
+    if (__builtin_expect(tcache.state != TCACHE_ACTIVE, 0)) 
+	{
+        tcache_free_slow(ptr, bin_index);
+        return;
     }
+    *(void **)ptr = tcache.bins[bin_index];
+    tcache.bins[bin_index] = ptr;
+    STAT_ADD(tcache.stats.nfree[bin_index], 1);
+    if (__builtin_expect(++tcache.counts[bin_index] > (int)alloc_config.tcache_max[bin_index], 0))
+        tcache_flush(bin_index, TCACHE_BATCH);
 }
 
 /*
 	* Function to free a block of memory
 	* ptr: pointer to the block to be freed
 	* this function is called to free a block of memory
-	* if the block was allocated using mmap, it is freed using munmap
-	* if the block was allocated using sbrk, it is marked as free
-	* the block is added to the freelist
-	* the free flag is set to 1
-	* the number of freed blocks is incremented
+	* while the profiler holds samples, the sample of ptr is dropped first
+	* slab slots go back to the thread cache, the cache flushes a batch when full,
+	* the slots of other threads in it go to their owners' remote lists
+	* other pointers are looked up in the pagemap, a pointer it does not know is not ours and is ignored
+	* aligned pointers free the block their proxy header points to
+	* pool blocks clear their units in the pool bitmap
+	* if the block was allocated using mmap, its mapping leaves the pagemap and goes to the
+	* large mapping cache or is unmapped
+	* other heap blocks are marked as free under the heap lock and coalesced with their neighbours
+	* the counters of the tier the block came from are updated
 */
 
 
@@ -52,20 +112,126 @@ inline void _free(void *ptr)
 {
     if (!ptr)
         return;
-    Block *block = (Block *)((uintptr_t)ptr - sizeof(Block));
-	if (ptr != block->aligned_address) 
-		ptr = block->aligned_address;	
+    if (__builtin_expect(STAT_LOAD(prof_samples) != 0, 0))
+        prof_free(ptr);
+    if (__builtin_expect(is_slab_ptr(ptr), 1)) 
+	{
+        free_slot(ptr, slab_class(ptr));
+        return;
+    }
+    uintptr_t page = pagemap_lookup(ptr);
+    if (__builtin_expect(!page, 0))
+    {
+#ifdef DEBUG
+        fprintf(stderr, "free: %p was not allocated by this allocator\n", ptr);
+        abort();
+#endif
+        return;
+    }
+    Block *block = block_from_ptr(ptr);
+    if (__builtin_expect(is_aligned_proxy(block, ptr), 0)) 
+	{
+        _free(block->aligned_address);
+        return;
+    }
 
-    if (__builtin_expect(block->size > block_size, 0)) 
+    if ((page & PAGEMAP_TAG_MASK) == PAGEMAP_POOL) 
 	{
-        size_t alignment_mask = sysconf(_SC_PAGESIZE) - 1;
-        size_t total_size = block->size + sizeof(Block) + alignment_mask;
-		total_size = __builtin_align_up(total_size, ALIGNMENT);
-        munmap((void *)block, total_size);
-    } else {
-		coalesce_free_blocks();
-		block->free = 1;
+        free_pool_block(block);
+        return;
+    }
+    if (__builtin_expect((page & PAGEMAP_TAG_MASK) == PAGEMAP_MMAP, 0)) 
+	{
+        static size_t page_size;
+        if (!page_size)
+            page_size = sysconf(_SC_PAGESIZE);
+        uintptr_t base = page & ~(uintptr_t)PAGEMAP_TAG_MASK;
+        size_t total_size = (uintptr_t)ptr + block->size - base;
+        STAT_ATOMIC_ADD(alloc_stats.large_nfree, 1);
+        STAT_ATOMIC_ADD(alloc_stats.large_allocated, -block->size);
+        STAT_ATOMIC_ADD(alloc_stats.large_mapped, -align_up(total_size, page_size));
+        if (block->huge)
+            STAT_ATOMIC_ADD(alloc_stats.huge_mapped, -align_up(total_size, page_size));
+        pagemap_set((void *)base, total_size, 0);
+        if (block->huge || !mapcache_put((void *)base, align_up(total_size, page_size)))
+            unmap_pages((void *)base, total_size);
+        return;
     }
-    allocated_blocks--;
+    pthread_mutex_lock(&heap_lock);
+    STAT_ADD(alloc_stats.heap_nfree, 1);
+    STAT_ADD(alloc_stats.heap_allocated, -block->size);
+    heap_free_block(block);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+#ifdef DEBUG
+/*
+	* DEBUG builds check the size given to _free_sized against the block
+	* a small size must name the bin of ptr, a larger one must fit in the block or the slot
+*/
+
+static void check_free_size(void *ptr, size_t size)
+{
+	int slab = is_slab_ptr(ptr);
+
+	if (size <= BIN_MAX_SIZE ? !slab || slab_class(ptr) != (int)((size + ALIGNMENT - 1) / ALIGNMENT - 1)
+		: (slab && slab_class(ptr) < BIN_COUNT) || _malloc_usable_size(ptr) < size)
+	{
+		fprintf(stderr, "free_sized: %p was not allocated with a size of %zu bytes\n", ptr, size);
+		abort();
+	}
 }
+#endif
 
+/*
+	* free a block whose size the caller knows, C23 free_sized
+	* size: the size given when ptr was allocated, or to the _realloc that returned it
+	* every allocation of at most BIN_MAX_SIZE bytes at the default alignment is a slab slot,
+	* so a small size gives the bin without reading anything in front of ptr,
+	* larger sizes go through _free
+*/
+
+__attribute__((hot))
+void _free_sized(void *ptr, size_t size)
+{
+    if (!ptr)
+        return;
+#ifdef DEBUG
+    check_free_size(ptr, size);
+#endif
+    if (__builtin_expect(size - 1 >= BIN_MAX_SIZE, 0))
+    {
+        _free(ptr);
+        return;
+    }
+    if (__builtin_expect(STAT_LOAD(prof_samples) != 0, 0))
+        prof_free(ptr);
+    free_slot(ptr, (size - 1) / ALIGNMENT);
+}
+
+/*
+	* C23 free_aligned_sized, for blocks from _aligned_alloc
+	* up to ALIGNMENT the block came from _malloc and takes the _free_sized path
+*/
+
+void _free_aligned_sized(void *ptr, size_t alignment, size_t size)
+{
+    if (alignment <= ALIGNMENT)
+    {
+        _free_sized(ptr, size);
+        return;
+    }
+#ifdef DEBUG
+    if (ptr && ((uintptr_t)ptr & (alignment - 1)))
+    {
+        fprintf(stderr, "free_aligned_sized: %p is not aligned to %zu bytes\n", ptr, alignment);
+        abort();
+    }
+    if (ptr && _malloc_usable_size(ptr) < size)
+    {
+        fprintf(stderr, "free_aligned_sized: %p was not allocated with a size of %zu bytes\n", ptr, size);
+        abort();
+    }
+#endif
+    _free(ptr);
+}
@@ -1,28 +1,62 @@
 #include "include.h"
 
-void get_cache_info() 
+/*
+	* walk the deterministic cache parameters of CPUID leaf (4 on Intel, 0x8000001D on AMD)
+	* the L1 data cache, the L2 and the last level are stored in config, with the line size
+	* Returns: 1 if the leaf described at least one cache
+*/
+
+static int read_cache_leaf(unsigned int leaf, AllocConfig *config)
 {
     unsigned int eax, ebx, ecx, edx;
+    int found = 0;
 
-    for (int i = 1; i < 4; i++) 
+    for (unsigned int i = 0; i < 16; i++)
 	{
-        ecx = i;
-
-        asm volatile 
+        asm volatile
 		(
             "cpuid"
             : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
-            : "a" (4), "c" (ecx)
+            : "a" (leaf), "c" (i)
         );
 
         unsigned int cache_type = eax & 0x1F;
-        if (cache_type == 0) continue;
+        if (cache_type == 0)
+            break;
+        if (cache_type == 2)
+            continue;
 
         unsigned int cache_level = (eax >> 5) & 0x7;
-        unsigned int cache_size = ((ebx >> 22) + 1) * ((ebx >> 12 & 0x3FF) + 1) * ((ebx & 0xFFF) + 1) * (ecx + 1);
+        size_t line_size = (ebx & 0xFFF) + 1;
+        size_t cache_size = (size_t)((ebx >> 22) + 1) * ((ebx >> 12 & 0x3FF) + 1) * line_size * (ecx + 1);
 
-        printf("Cache level: L%d\n", cache_level);
-        printf("Cache size: %u KB\n", cache_size / 1024);
-		printf("\n");
+        if (cache_level == L1_CACHE)
+        {
+            config->l1d_size = cache_size;
+            config->line_size = line_size;
+        }
+        else if (cache_level == L2_CACHE)
+            config->l2_size = cache_size;
+        else
+            config->llc_size = cache_size;
+        found = 1;
     }
+    return found;
+}
+
+/*
+	* fill the cache sizes and the line size of config from CPUID
+	* the fields CPUID does not report are left untouched
+*/
+
+void get_cache_info(AllocConfig *config)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    asm volatile ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (0), "c" (0));
+    if (eax >= 4 && read_cache_leaf(4, config))
+        return;
+    asm volatile ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (0x80000000), "c" (0));
+    if (eax >= 0x8000001D)
+        read_cache_leaf(0x8000001D, config);
 }
@@ -11,6 +11,8 @@
 #include <stdint.h>
 #include <sys/syscall.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <limits.h>
 
 /*
 	* ALIGNMENT: alignment of the block 
@@ -20,8 +22,19 @@
 	* MMAP_ALIGN(size): align the size to the mmap size
 	* BIN_COUNT: number of bins
 	* BIN_MAX_SIZE: maximum size of the bin
-	* CACHE_SIZE_L1: size of the L1 cache
-	* CACHE_SIZE_L2: size of the L2 cache
+	* ALIGNED_CLASS_COUNT: power of two slab classes above BIN_MAX_SIZE, up to ALIGNED_CLASS_MAX,
+	*   only _aligned_alloc uses them, a slot of such a class is aligned to its size
+	* SLAB_CLASS_COUNT: all slab classes, the bins come first
+	* CACHE_SIZE_L1: size of the L1 data cache assumed when CPUID does not report it
+	* CACHE_SIZE_L2: size of the L2 cache assumed when CPUID does not report it
+	* CACHE_LINE_SIZE: smallest cache line size assumed
+	* BITMAP_SIZE: number of units in a bitmap pool
+	* BLOCK_UNIT_SIZE: size of a bitmap pool unit
+	* POOL_MAX_SIZE: largest size served by the bitmap pools
+	* TCACHE_BATCH: number of blocks moved between a thread cache and the central bins at once
+	* TCACHE_MIN, TCACHE_MAX: bounds of the number of blocks kept per bin in a thread cache,
+	*   the limit itself is sized from the caches in alloc_config
+	* HUGE_PAGE_SIZE: size and alignment of the arenas mapped in huge page mode
 */
 
 #ifndef __GNUC__
@@ -33,16 +46,30 @@
 #define MMAP_THRESHOLD (128 * 1024) 
 #define MMAP_SIZE (128 * 1024)
 #define MMAP_ALIGN(size) (((size) + (MMAP_SIZE - 1)) & ~(MMAP_SIZE - 1))
-#define BIN_COUNT 10
-#define BIN_MAX_SIZE 128
+#define BIN_COUNT 16
+#define BIN_MAX_SIZE 256
+#define ALIGNED_CLASS_COUNT 7
+#define ALIGNED_CLASS_MAX (BIN_MAX_SIZE << ALIGNED_CLASS_COUNT)
+#define SLAB_CLASS_COUNT (BIN_COUNT + ALIGNED_CLASS_COUNT)
 #define CACHE_SIZE_L1 32768
 #define CACHE_SIZE_L2 262144
+#define CACHE_LINE_SIZE 64
 #define UNIT 16
-#define BITMAP_SIZE 1024   
+#define BITMAP_SIZE 8192   
 #define BLOCK_UNIT_SIZE 32 
 #define MEMORY_POOL_SIZE (BITMAP_SIZE * BLOCK_UNIT_SIZE)
+#define POOL_MAX_SIZE (32 * 1024)
 #define BLOCK_SIZE ALIGN(sizeof(Block), ALIGNMENT)
 #define MAX_BLOCK_SIZE 1024 * 1024
+#define BLOCK_PAD (BLOCK_SIZE - sizeof(Block))
+#define TCACHE_BATCH 16
+#define TCACHE_MIN (2 * TCACHE_BATCH)
+#define TCACHE_MAX 256
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#define HUGEPAGE_OFF 0
+#define HUGEPAGE_THP 1
+#define HUGEPAGE_HUGETLB 2
 
 
 typedef enum {
@@ -69,33 +96,187 @@ typedef enum {
 	*  this is used to determine the cache size
 */
 
-void get_cache_info();
+/*
+	* tuning of the allocator for the caches of this machine, see config.c
+	* l1d_size, l2_size, llc_size, line_size: read from CPUID, the defaults above otherwise
+	* cores: online CPUs, they share the last level cache
+	* tcache_max: blocks a thread cache keeps per bin before it flushes
+	* slab_slots: slots carved from a slab span of each size class
+	* nt_threshold: copies and fills from this size use non-temporal stores
+	* prefetch_distance: bytes the streaming copy reads ahead
+*/
+
+typedef struct AllocConfig {
+	size_t l1d_size;
+	size_t l2_size;
+	size_t llc_size;
+	size_t line_size;
+	int cores;
+	unsigned int tcache_max[SLAB_CLASS_COUNT];
+	unsigned int slab_slots[SLAB_CLASS_COUNT];
+	size_t nt_threshold;
+	size_t prefetch_distance;
+} AllocConfig;
+
+extern AllocConfig alloc_config;
+void alloc_config_init();
+void get_cache_info(AllocConfig *config);
 void *allocate_cache(size_t size);
 
+/*
+	* CPU features read once with CPUID, see memory_utils.c
+	* erms: fast rep movsb / rep stosb
+	* fsrm: fast rep movsb for short copies too
+	* avx2, avx512: the vector units, and the OS saves their registers
+*/
+
+typedef struct CpuFeatures {
+	int ready;
+	int erms;
+	int fsrm;
+	int avx2;
+	int avx512;
+} CpuFeatures;
+
+extern CpuFeatures cpu_features;
+void cpu_features_init();
+
 /*
 	* this structure is used to store the block information 
 	* size: size of the block
 	* next: pointer to the next block
+	* prev: pointer to the previous block, heap blocks only, so a free merges with both
+	*   neighbours without walking the list
 	* free: flag to indicate if the block is free
+	* zeroed: the user area is known to be all zero (fresh pages never handed out)
+	* purged: a free block whose pages were handed back with MADV_FREE
+	* huge: a BLOCK_MMAP block mapped by map_huge_pages
+	* dirty_epoch: decay epoch in which a free heap block was last written
 	* aligned_address: aligned address of the block
-	* is_mmap: flag to indicate if the block is allocated using mmap
+	* is_mmap: origin of the block, BLOCK_HEAP, BLOCK_MMAP or BLOCK_POOL
 */
 
-struct group {
-    struct meta *meta;
-    unsigned char active_idx:5;
-    char pad[UNIT - sizeof(struct meta *) - 1];
-    unsigned char storage[];
-};
-
 typedef struct Block {
     size_t size;
     struct Block *next;
-    int free;
+    struct Block *prev;
+    unsigned char free;
+	unsigned char zeroed;
+	unsigned char purged;
+	unsigned char huge;
+	uint32_t dirty_epoch;
 	void *aligned_address;
 	int is_mmap;
 } Block;
 
+#define BLOCK_HEAP 0
+#define BLOCK_MMAP 1
+#define BLOCK_POOL 2
+
+/*
+	* bitmap pool for the medium sizes, mapped at a MEMORY_POOL_SIZE boundary
+	* bitmap: one bit per unit, 1 = used, the units holding this header are used
+	* free_units: number of clear bits
+	* fresh_unit: units from here on were never handed out and are still zero
+	* dirty, dirty_epoch: units were freed since the last purge, and the epoch of the last such free
+	* huge: the pool is a slice of a huge page arena, it is kept when it becomes empty
+*/
+
+typedef struct MemoryPool {
+    uint64_t bitmap[BITMAP_SIZE / 64];
+    size_t free_units;
+    size_t fresh_unit;
+    struct MemoryPool *next;
+    unsigned char dirty;
+    unsigned char huge;
+    uint32_t dirty_epoch;
+} MemoryPool;
+
+#define POOL_HEADER_UNITS ((sizeof(MemoryPool) + BLOCK_UNIT_SIZE - 1) / BLOCK_UNIT_SIZE)
+
+/*
+	* slab spans for the small size classes, the slots carry no header at all
+	* a span is SPAN_SIZE bytes at a SPAN_SIZE boundary holding slots of one size class,
+	* every span is carved from one reserved region, so a pointer is a slot when it falls
+	* in the region, and its span index gives its size class and its meta
+	* the classes and metas arrays are mapped apart from the region, the metadata never
+	* shares a cache line with user data
+	* SLAB_REGION_MAX, SLAB_REGION_MIN: virtual size reserved for the region, halved on failure
+	* SPAN_COMMIT: bytes made accessible in the region at a time
+*/
+
+#define SPAN_SHIFT 16
+#define SPAN_SIZE (1UL << SPAN_SHIFT)
+#define SPAN_COMMIT (2UL * 1024 * 1024)
+#define SLAB_REGION_MAX (64UL * 1024 * 1024 * 1024)
+#define SLAB_REGION_MIN (1UL * 1024 * 1024 * 1024)
+
+/*
+	* base, size: the reserved region, size stays 0 until the region exists
+	* classes: size class of each span, metas: its meta, both indexed by span
+*/
+
+typedef struct SlabRegion {
+	uintptr_t base;
+	size_t size;
+	unsigned char *classes;
+	struct meta *metas;
+} SlabRegion;
+
+extern SlabRegion slab_region;
+
+/*
+	* owner of slab spans, one per thread cache
+	* a slot freed by the thread that owns its span goes to that thread's cache,
+	* a slot freed by any other thread waits in that thread's cache, when the cache flushes
+	* it is pushed on remote[bin], a run of slots with the same owner in a single CAS,
+	* the owner takes the whole list back on its next refill of the bin, without the heap lock
+	* remote: slots freed by other threads, REMOTE_CLOSED while the heap has no thread,
+	*   a free to a closed heap goes straight back to its span under the heap lock
+	* remote_count: slots pushed on remote[bin], added after the CAS of each run, so it lags
+	*   the list by the runs being pushed, the owner resets it when it takes the list
+	* active: spans of this heap with free slots, heap lock
+	* a heap outlives its thread: on exit it is closed and parked, the next new thread adopts it
+	* next: list of parked heaps, heap lock
+*/
+
+#define REMOTE_CLOSED ((void *)1)
+
+typedef struct SlabHeap {
+	void *remote[SLAB_CLASS_COUNT];
+	int remote_count[SLAB_CLASS_COUNT];
+	struct meta *active[SLAB_CLASS_COUNT];
+	struct SlabHeap *next;
+} __attribute__((aligned(64))) SlabHeap;
+
+/*
+	* out of band state of a span, the heap lock must be held
+	* prev, next: active list of the owner, or list of the free spans
+	* owner: slab heap of the span
+	* span: first byte of the span
+	* free: slots given back, linked through their first word
+	* bump: first slot never handed out, limit: end of the last whole slot,
+	*   pages past bump have not been touched since the span was last purged
+	* used: slots handed out, capacity: slots in the span
+	* sizeclass: size class of the slots, -1 for a free span
+	* dirty_epoch, purged: decay of a free span, see decay.c
+*/
+
+struct meta {
+    struct meta *prev;
+    struct meta *next;
+    SlabHeap *owner;
+    unsigned char *span;
+    void *free;
+    unsigned char *bump;
+    unsigned char *limit;
+    uint32_t used;
+    uint32_t capacity;
+    int sizeclass;
+    uint32_t dirty_epoch;
+    unsigned char purged;
+};
+
 typedef struct MemoryAllocator {
     Block *freelist;
     int allocated_blocks;
@@ -103,34 +284,582 @@ typedef struct MemoryAllocator {
     Block *bins[BIN_COUNT];
 } MemoryAllocator;
 
+/*
+	* counters of one thread cache, only the owning thread writes them
+	* nmalloc / nfree: small allocations and frees per size class
+	* requested: bytes asked for by the small allocations per size class, the slots
+	*   handed out hold nmalloc * size of them
+	* refills: allocations that missed the cache, flushes: batches handed back to the spans
+	* remote_frees: slots this thread freed to the heap of another thread
+*/
+
+typedef struct TcacheStats {
+	uint64_t nmalloc[SLAB_CLASS_COUNT];
+	uint64_t nfree[SLAB_CLASS_COUNT];
+	uint64_t requested[SLAB_CLASS_COUNT];
+	uint64_t refills;
+	uint64_t flushes;
+	uint64_t remote_frees;
+} TcacheStats;
+
+/*
+	* per-thread cache sitting in front of the slab spans
+	* bins: singly linked lists of free user pointers, the link lives in the first word of the block
+	* counts: number of entries in each bin
+	* state: TCACHE_UNINIT until first use, TCACHE_DEAD once the thread has exited
+	* heap: slab spans owned by this thread, NULL unless the cache is active
+	* prev, next: registry of live caches, walked by _malloc_stats
+	* stats: counters of this thread
+	* prof_countdown: bytes left before the next profiler sample, prof_rng: its random state
+*/
+
+typedef enum {
+	TCACHE_UNINIT = 0,
+	TCACHE_ACTIVE = 1,
+	TCACHE_DEAD = 2
+} TcacheState;
+
+typedef struct ThreadCache {
+	void *bins[SLAB_CLASS_COUNT];
+	int counts[SLAB_CLASS_COUNT];
+	int state;
+	SlabHeap *heap;
+	struct ThreadCache *prev;
+	struct ThreadCache *next;
+	TcacheStats stats;
+	int64_t prof_countdown;
+	uint64_t prof_rng;
+} ThreadCache;
+
+/*
+	* region allocator, see arena.c, an arena is used by one thread at a time
+	* ArenaChunk: header of every chunk, size counts the header
+	* chunks: chunks in use, newest first, the oldest one holds the arena itself
+	* spare: chunks kept by _arena_reset for the next allocations
+	* base: first free byte of the oldest chunk, top, end: free range of the newest chunk
+	* chunk_size: size of the last chunk mapped, the next one doubles it up to ARENA_CHUNK_MAX
+	* allocated: bytes handed out since the last reset, active: bytes of the chunks in use,
+	*   written by the owner, read by _malloc_stats
+	* prev, next: registry of live arenas, arena lock
+	* ARENA_CHUNK_MIN: smallest chunk, ARENA_CHUNK_MAX: chunks stop growing at this size
+*/
+
+#define ARENA_CHUNK_MIN (64 * 1024)
+#define ARENA_CHUNK_MAX (64 * 1024 * 1024)
+
+typedef struct ArenaChunk {
+	struct ArenaChunk *next;
+	size_t size;
+} ArenaChunk;
+
+typedef struct Arena {
+	ArenaChunk *chunks;
+	ArenaChunk *spare;
+	uintptr_t base;
+	uintptr_t top;
+	uintptr_t end;
+	size_t chunk_size;
+	size_t allocated;
+	size_t active;
+	struct Arena *prev;
+	struct Arena *next;
+} Arena;
+
+/*
+	* pool of objects of one size, see objpool.c, not to be confused with the bitmap MemoryPool
+	* size: stride of an object, a multiple of its alignment, no header is added
+	* span_size: bytes mapped at a time, whole pages
+	* id: picks the slot of the pool in the thread caches
+	* lock: guards free, bump and limit
+	* free: objects handed back by the thread caches, linked through their first word
+	* bump, limit: part of the newest span never handed out
+	* OBJPOOL_SPAN_PAGES: pages of a span for small objects, a span holds at least
+	*   OBJPOOL_BATCH objects
+	* OBJPOOL_CACHE_SLOTS: pools a thread caches at once
+	* OBJPOOL_CACHE_MAX: objects a thread keeps per pool before it hands OBJPOOL_BATCH back
+*/
+
+#define OBJPOOL_SPAN_PAGES 16
+#define OBJPOOL_CACHE_SLOTS 8
+#define OBJPOOL_CACHE_MAX 64
+#define OBJPOOL_BATCH 32
+
+typedef struct ObjectPool {
+	size_t size;
+	size_t span_size;
+	unsigned int id;
+	pthread_mutex_t lock;
+	void *free;
+	unsigned char *bump;
+	unsigned char *limit;
+	struct ObjectPool *next;
+} ObjectPool;
+
+/*
+	* allocation trace, see trace.c for the recorder and bench/replay.c for the replay
+	* the file is a TraceHeader followed by TraceRecords, threads append whole buffers so
+	* the records are sorted by seq only within a thread
+	* seq: global order of the calls, time: CLOCK_MONOTONIC in ns
+	* ptr: block returned, or freed for TRACE_FREE, old_ptr: block passed to TRACE_REALLOC
+	* size: bytes asked for, calloc gives the product, align_shift: log2 of the alignment
+	*   of TRACE_ALIGNED, thread: index of the thread in the order of its first record
+*/
+
+#define TRACE_MAGIC "FTTRACE1"
+#define TRACE_MALLOC 1
+#define TRACE_CALLOC 2
+#define TRACE_REALLOC 3
+#define TRACE_ALIGNED 4
+#define TRACE_FREE 5
+
+typedef struct TraceHeader {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t pid;
+} TraceHeader;
+
+typedef struct TraceRecord {
+	uint64_t seq;
+	uint64_t time;
+	uint64_t ptr;
+	uint64_t old_ptr;
+	uint64_t size;
+	uint32_t thread;
+	uint8_t op;
+	uint8_t align_shift;
+	uint16_t reserved;
+} TraceRecord;
+
+/*
+	* allocator wide counters, each group is written under the lock of its tier
+	* syscalls and mapped bytes: every mmap, munmap and mremap, updated atomically
+	* pool_*: bitmap pool blocks, pool lock, pool_units counts the units held by blocks
+	* heap_*: heap blocks handed to the user, heap lock
+	* large_*: blocks from request_space_mmap, updated atomically, large_mapped is their mapping size
+	* madvise_calls, purged: pages handed back to the kernel by the decay and _malloc_trim, atomic
+	* huge_mapped: bytes mapped as huge page arenas, atomic
+	* mapcache_*: lookups of the large mapping cache, atomic, and the bytes it holds, mapcache lock
+	* slab_groups, slab_free_slots: spans of each class and the free slots left in them, heap lock
+	* retired: counters of the thread caches of exited threads
+*/
+
+typedef struct AllocStats {
+	uint64_t mmap_calls;
+	uint64_t munmap_calls;
+	uint64_t mremap_calls;
+	uint64_t madvise_calls;
+	uint64_t mapped;
+	uint64_t purged;
+	uint64_t huge_mapped;
+	uint64_t mapcache_hits;
+	uint64_t mapcache_misses;
+	uint64_t mapcache_bytes;
+	uint64_t pool_nmalloc;
+	uint64_t pool_nfree;
+	uint64_t pool_allocated;
+	uint64_t pool_units;
+	uint64_t heap_nmalloc;
+	uint64_t heap_nfree;
+	uint64_t heap_allocated;
+	uint64_t large_nmalloc;
+	uint64_t large_nfree;
+	uint64_t large_allocated;
+	uint64_t large_mapped;
+	uint64_t slab_groups[SLAB_CLASS_COUNT];
+	uint64_t slab_free_slots[SLAB_CLASS_COUNT];
+	TcacheStats retired;
+} AllocStats;
+
+/*
+	* snapshot filled by _malloc_stats
+	* allocated: bytes in live allocations, as seen by _malloc_usable_size
+	* active: bytes of the slots carved in the slab spans, pool units, heap blocks and mappings backing them
+	* mapped: bytes currently mapped from the kernel
+	* retained: mapped but not active, free heap and pool space, metadata
+	* purged: bytes handed back with madvise since start, they stay mapped
+	* huge_mapped: part of mapped reserved as huge page arenas
+	* mapcache_*: large blocks served from released mappings, and the bytes those mappings hold
+	* remote_frees: small frees handed to the thread that owns the slot
+	* arenas: live arenas, arena_allocated, arena_active: their bytes handed out and the
+	*   bytes of their chunks in use, both are also counted in allocated and active
+	* per class: live = nmalloc - nfree, cached slots sit in thread caches,
+	* occupancy = live / slots in percent
+*/
+
+struct malloc_class_stats {
+	size_t size;
+	uint64_t nmalloc;
+	uint64_t nfree;
+	uint64_t live;
+	uint64_t groups;
+	uint64_t slots;
+	uint64_t cached;
+	double occupancy;
+};
+
+struct malloc_stats {
+	size_t allocated;
+	size_t active;
+	size_t mapped;
+	size_t retained;
+	uint64_t nmalloc;
+	uint64_t nfree;
+	uint64_t live;
+	uint64_t mmap_calls;
+	uint64_t munmap_calls;
+	uint64_t mremap_calls;
+	uint64_t madvise_calls;
+	uint64_t purged;
+	uint64_t huge_mapped;
+	uint64_t mapcache_hits;
+	uint64_t mapcache_misses;
+	uint64_t mapcache_bytes;
+	uint64_t arenas;
+	size_t arena_allocated;
+	size_t arena_active;
+	uint64_t tcache_hits;
+	uint64_t tcache_misses;
+	uint64_t tcache_flushes;
+	uint64_t remote_frees;
+	double tcache_hit_rate;
+	struct malloc_class_stats classes[SLAB_CLASS_COUNT];
+};
+
+/*
+	* fragmentation report of _malloc_frag_report, where the mapped bytes go
+	* per class, from the span metadata:
+	*   spans, full_spans, partial_spans, empty_spans: spans of the class, those with every
+	*   slot taken, with both taken and free slots, and with none taken, kept as the last
+	*   span of the class in a slab heap
+	*   span_occupancy: spans by quarter of their slots taken, the last bucket is full spans
+	*   live_bytes: slots held by the program, cached_bytes: slots taken by a thread cache
+	*   that the program does not hold, free_bytes: slots of the spans no thread took
+	*   requested_bytes: live slots times the mean size asked for in the class since start,
+	*   internal_waste = live_bytes - requested_bytes
+	* free_spans: empty spans waiting for any class, free_span_resident: bytes their last
+	*   class carved in those not purged yet
+	* heap_*: blocks of the first fit list, header_bytes is BLOCK_SIZE per live block,
+	*   heap_external: 1 - largest free block / free bytes, 0 when the free space is one block
+	* pool_*: bitmap pool units, overhead is the headers and the rounding to BLOCK_UNIT_SIZE
+	* large_overhead: mapped bytes of the large blocks beyond their size, page rounding and header
+	* requested: bytes the program asked for, the heap, pool and large tiers count their
+	*   block sizes, internal_waste: rounding and headers of the live blocks, external_free:
+	*   free bytes held in spans, thread caches, heap, pools, arenas and the mapping cache
+	* rss: resident bytes of the process, rss_per_requested: rss / requested
+*/
+
+#define FRAG_OCCUPANCY_BUCKETS 5
+
+struct malloc_frag_class {
+	size_t size;
+	uint64_t spans;
+	uint64_t full_spans;
+	uint64_t partial_spans;
+	uint64_t empty_spans;
+	uint64_t span_occupancy[FRAG_OCCUPANCY_BUCKETS];
+	size_t live_bytes;
+	size_t cached_bytes;
+	size_t free_bytes;
+	size_t requested_bytes;
+	size_t internal_waste;
+};
+
+struct malloc_frag_report {
+	struct malloc_frag_class classes[SLAB_CLASS_COUNT];
+	uint64_t free_spans;
+	size_t free_span_resident;
+	uint64_t heap_live_blocks;
+	size_t heap_live_bytes;
+	size_t heap_header_bytes;
+	uint64_t heap_free_blocks;
+	size_t heap_free_bytes;
+	size_t heap_largest_free;
+	double heap_external;
+	uint64_t pools;
+	size_t pool_live_bytes;
+	size_t pool_overhead;
+	size_t pool_free_bytes;
+	size_t large_live_bytes;
+	size_t large_overhead;
+	size_t requested;
+	size_t internal_waste;
+	size_t external_free;
+	size_t mapped;
+	size_t rss;
+	double rss_per_requested;
+};
+
+/*
+	* STAT_ADD: counter with a single writer (its thread or the lock of its tier)
+	* STAT_ATOMIC_ADD: counter shared by writers that hold no lock
+	* both are relaxed so a reader never tears a value and the writer never pays for a locked op
+*/
+
+#define STAT_ADD(counter, n) __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define STAT_ATOMIC_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define STAT_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+extern __thread ThreadCache tcache __attribute__((tls_model("initial-exec")));
+extern pthread_mutex_t heap_lock;
+extern AllocStats alloc_stats;
+extern size_t prof_samples;
+extern int trace_enabled;
+
 __attribute__((always_inline))
 static inline uintptr_t align_up(uintptr_t addr, size_t alignment) {
     return (addr + alignment - 1) & ~(alignment - 1);
 }
 
+/*
+	* the header always ends right in front of the user pointer,
+	* BLOCK_PAD bytes of padding keep the user pointer aligned inside a chunk
+*/
+
+__attribute__((always_inline))
+static inline Block *block_from_ptr(void *ptr) {
+    return (Block *)((uintptr_t)ptr - sizeof(Block));
+}
+
+__attribute__((always_inline))
+static inline int block_is_adjacent(Block *block, Block *next) {
+    return (uintptr_t)block->aligned_address + block->size + BLOCK_PAD == (uintptr_t)next;
+}
+
+/*
+	* radix pagemap: owner of every page the allocator maps outside the slab region
+	* a 48-bit address is cut into a root index, a leaf index and the page offset,
+	* a lookup is two dependent loads, the leaves are mapped when a range first needs them
+	* an entry is the base of the mapping holding the page, tagged with the tier that
+	* owns it, 0 for a page that is not ours
+	* PAGEMAP_PAGE_SHIFT: page granularity of the map, PAGEMAP_LEAF_BITS: a leaf covers 1 GiB
+*/
+
+#define PAGEMAP_PAGE_SHIFT 12
+#define PAGEMAP_LEAF_BITS 18
+#define PAGEMAP_ROOT_BITS (48 - PAGEMAP_PAGE_SHIFT - PAGEMAP_LEAF_BITS)
+#define PAGEMAP_HEAP 1
+#define PAGEMAP_MMAP 2
+#define PAGEMAP_POOL 3
+#define PAGEMAP_TAG_MASK 3
+
+extern uintptr_t *pagemap_root[1UL << PAGEMAP_ROOT_BITS];
+
+__attribute__((always_inline))
+static inline uintptr_t pagemap_lookup(void *ptr) {
+    uintptr_t addr = (uintptr_t)ptr;
+    if (addr >> 48)
+        return 0;
+    uintptr_t *leaf = __atomic_load_n(&pagemap_root[addr >> (PAGEMAP_PAGE_SHIFT + PAGEMAP_LEAF_BITS)], __ATOMIC_ACQUIRE);
+    if (!leaf)
+        return 0;
+    return leaf[(addr >> PAGEMAP_PAGE_SHIFT) & ((1UL << PAGEMAP_LEAF_BITS) - 1)];
+}
+
+/*
+	* a proxy header sits in front of an address returned by _aligned_alloc,
+	* its aligned_address is the block it was carved from
+*/
+
+__attribute__((always_inline))
+static inline int is_aligned_proxy(Block *block, void *ptr) {
+    return block->aligned_address != ptr;
+}
+
+/*
+	* the size is published last, a reader that sees it also sees the base and the arrays
+*/
+
+__attribute__((always_inline))
+static inline int is_slab_ptr(void *ptr) {
+    size_t size = __atomic_load_n(&slab_region.size, __ATOMIC_ACQUIRE);
+    return (uintptr_t)ptr - slab_region.base < size;
+}
+
+__attribute__((always_inline))
+static inline size_t slab_span_index(void *ptr) {
+    return ((uintptr_t)ptr - slab_region.base) >> SPAN_SHIFT;
+}
+
+__attribute__((always_inline))
+static inline int slab_class(void *ptr) {
+    return slab_region.classes[slab_span_index(ptr)];
+}
+
+__attribute__((always_inline))
+static inline struct meta *slab_meta(void *ptr) {
+    return &slab_region.metas[slab_span_index(ptr)];
+}
+
+/*
+	* Returns: 1 if ptr points into memory this allocator handed out
+*/
+
+__attribute__((always_inline))
+static inline int is_our_ptr(void *ptr) {
+    return is_slab_ptr(ptr) || pagemap_lookup(ptr);
+}
+
+/*
+	* a free span is purged once two decay epochs have passed since it was last written,
+	* epoch 0 means the decay is off
+*/
+
+__attribute__((always_inline))
+static inline int decay_is_due(uint32_t dirty_epoch, uint32_t epoch) {
+	return epoch && dirty_epoch + 2 <= epoch;
+}
+
 /* memory utils */
 
+void *_memcpy(void *dest, const void *src, size_t n);
+void *_memset(void *s, int c, size_t n);
 void *_memcpy_avx(void *dest, const void *src, size_t n);
 void *_memset_avx(void *s, int c, size_t n);
+void *_memcpy_avx512(void *dest, const void *src, size_t n);
+void *_memset_avx512(void *s, int c, size_t n);
+void *_memcpy_nt(void *dest, const void *src, size_t n);
+void *_memset_nt(void *s, int c, size_t n);
 void *_memset_ERMS(void *s, int c, size_t n); 
 void *_memcpy_ERMS(void *dest, const void *src, size_t n);
 
 /* block utils */
 
-void coalesce_free_blocks(); 
+Block *coalesce_free_blocks(Block *block); 
 void *find_free_block(size_t size, size_t alignment); 
+void free_pool_block(Block *block);
+int resize_pool_block(Block *block, size_t new_size);
 void split_block(Block *block, size_t size, size_t alignment);
 void initialize_allocator();
+
+/* slab spans, the heap lock must be held */
+
+int slab_alloc_batch(SlabHeap *heap, int sizeclass, int count, void **list);
+void slab_free(void *ptr);
+int purge_spans(uint32_t epoch, int all);
+SlabHeap *slab_heap_adopt();
+void slab_heap_park(SlabHeap *heap);
+
+/* thread cache */
+
+void *tcache_refill(int bin_index);
+void tcache_flush(int bin_index, int count);
+size_t tcache_refill_batch(int bin_index, size_t count, void **out);
+void tcache_free_slow(void *ptr, int bin_index);
+void tcache_register(ThreadCache *cache);
+void tcache_unregister(ThreadCache *cache);
+
+/* sampling heap profiler */
+
+void *prof_malloc(size_t size);
+void *prof_aligned_alloc(size_t alignment, size_t size);
+void prof_free(void *ptr);
+void *prof_detach(void *ptr);
+void prof_attach(void *detached, void *ptr, size_t size);
+void _malloc_prof_start(size_t interval);
+void _malloc_prof_stop(void);
+int _malloc_prof_dump(const char *path);
+
+/* allocation trace recorder */
+
+void trace_record(int op, void *ptr, void *old_ptr, size_t size, size_t alignment);
+int _malloc_trace_start(const char *path);
+void _malloc_trace_stop(void);
+
+/* locks held across fork, see interpose.c for their order */
+
+void trace_fork_lock();
+void trace_fork_unlock();
+void prof_fork_lock();
+void prof_fork_unlock();
+void objpool_fork_lock();
+void objpool_fork_unlock();
+void arena_fork_lock();
+void arena_fork_unlock();
+void registry_fork_lock();
+void registry_fork_unlock();
+void pool_fork_lock();
+void pool_fork_unlock();
+void mapcache_fork_lock();
+void mapcache_fork_unlock();
+
 /* memory allocation */
 
+void *map_pages(size_t size);
+void unmap_pages(void *addr, size_t size);
+int pagemap_set(void *addr, size_t size, uintptr_t entry);
+int purge_pages(void *addr, size_t size);
+void *map_huge_pages(size_t *size);
+void *mapcache_get(size_t len);
+int mapcache_put(void *addr, size_t len);
+int mapcache_flush();
+void _malloc_set_hugepages(int mode);
+
+/* decay of free memory, see decay.c */
+
+uint32_t decay_epoch();
+void heap_decay(uint32_t epoch);
+int purge_heap(uint32_t epoch, int all);
+int purge_pools(int all);
+void _malloc_set_decay(long decay_ms, int advice);
+int _malloc_trim(size_t pad);
 void *request_space_mmap(size_t size, size_t alignment);
 Block *request_space(Block *last, size_t size, size_t alignment);
+Block *heap_alloc_block(size_t size);
+void heap_free_block(Block *block);
 void check_alignment(void *aligned_address);
 void *_malloc(size_t size);
 void *_aligned_alloc(size_t alignment, size_t size);
 void _free(void *ptr);
+void _free_sized(void *ptr, size_t size);
+void _free_aligned_sized(void *ptr, size_t alignment, size_t size);
 void _aligned_free(void *ptr); 
 void *_realloc(void *ptr, size_t new_size); 
+size_t _malloc_usable_size(void *ptr);
+void *_calloc(size_t nmemb, size_t size);
+size_t _malloc_batch(size_t size, size_t count, void **out);
+void _free_batch(void **ptrs, size_t count);
+Arena *_arena_create(size_t reserve);
+void *_arena_alloc(Arena *arena, size_t size, size_t align);
+void _arena_reset(Arena *arena);
+void _arena_destroy(Arena *arena);
+void arena_stats(struct malloc_stats *stats);
+void slab_frag(struct malloc_frag_report *report);
+void pool_frag(struct malloc_frag_report *report);
+void _malloc_frag_report(struct malloc_frag_report *report);
+ObjectPool *_pool_create(size_t obj_size, size_t align);
+void *_pool_alloc(ObjectPool *pool);
+void _pool_free(ObjectPool *pool, void *ptr);
+void _malloc_stats(struct malloc_stats *stats);
+
+/*
+	* inline front end of _malloc for sizes known at compile time, _malloc(sizeof(struct node))
+	* the bins are 16 bytes apart, so BIN_INDEX of a constant folds to a constant and the
+	* call becomes the profiler countdown, a pop from the bin and a call to tcache_refill
+	* when the bin is empty, the same steps _malloc takes after its size checks
+	* other sizes, 0 and sizes above BIN_MAX_SIZE, call _malloc, a name in parentheses
+	* such as (_malloc)(size) or &_malloc always does
+*/
+
+#define BIN_INDEX(size) (((size) + ALIGNMENT - 1) / ALIGNMENT - 1)
+
+__attribute__((hot, always_inline))
+static inline void *malloc_bin_inline(size_t size, int bin_index) {
+    if (__builtin_expect((tcache.prof_countdown -= size) < 0, 0))
+        return prof_malloc(size);
+    STAT_ADD(tcache.stats.requested[bin_index], size);
+    void *ptr = tcache.bins[bin_index];
+    if (__builtin_expect(ptr != NULL, 1))
+    {
+        tcache.bins[bin_index] = *(void **)ptr;
+        tcache.counts[bin_index]--;
+        STAT_ADD(tcache.stats.nmalloc[bin_index], 1);
+        return ptr;
+    }
+    return tcache_refill(bin_index);
+}
+
+#define _malloc(size) (__builtin_constant_p(size) && (size_t)(size) - 1 < BIN_MAX_SIZE \
+    ? malloc_bin_inline((size), BIN_INDEX((size_t)(size))) : (_malloc)(size))
 /* memory leak detection and utils */
 
 long _syscall(long number, ...);
@@ -138,6 +867,8 @@ void check_for_leaks();
 void* _sbrk(intptr_t increment);
 void hexdump(void *ptr, size_t size);
 int count_blocks(Block *list); 
+void heap_info(void);
+void frag_info(void);
 
 #define __vector __attribute__((vector_size(16) ))
 
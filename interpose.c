@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+#include "include.h"
+#include <dlfcn.h>
+
+/*
+	* libc entry points exported by libft_malloc_x86_64_Linux.so
+	* LD_PRELOAD=./libft_malloc_x86_64_Linux.so puts them in front of the libc allocator
+	* in_malloc guards against recursion: a call made from inside the allocator
+	* (stdio, a signal handler) is served from bootstrap_heap, which is never freed
+	* while a trace is recorded each call served by the allocator is logged, see trace.c
+*/
+
+#define BOOTSTRAP_SIZE (64 * 1024)
+
+static __thread int in_malloc __attribute__((tls_model("initial-exec")));
+static unsigned char bootstrap_heap[BOOTSTRAP_SIZE] __attribute__((aligned(ALIGNMENT)));
+static size_t bootstrap_used;
+
+static void *bootstrap_alloc(size_t size)
+{
+	size_t total = ALIGNMENT + __builtin_align_up(size, ALIGNMENT);
+	size_t offset = __atomic_fetch_add(&bootstrap_used, total, __ATOMIC_RELAXED);
+
+	if (offset + total > BOOTSTRAP_SIZE)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	*(size_t *)(bootstrap_heap + offset) = size;
+	return bootstrap_heap + offset + ALIGNMENT;
+}
+
+__attribute__((always_inline))
+static inline int is_bootstrap_ptr(void *ptr)
+{
+	return (unsigned char *)ptr >= bootstrap_heap && (unsigned char *)ptr < bootstrap_heap + BOOTSTRAP_SIZE;
+}
+
+/*
+	* a pointer neither the pagemap nor the slab region knows was handed out by the
+	* allocator loaded before this one, it goes back there through RTLD_NEXT
+	* the entry points are looked up on first use, without them the pointer is left alone
+*/
+
+static void *next_symbol(const char *name)
+{
+	int nested = in_malloc;
+
+	in_malloc = 1;
+	void *symbol = dlsym(RTLD_NEXT, name);
+	in_malloc = nested;
+	return symbol;
+}
+
+static void next_free(void *ptr)
+{
+	static void (*next)(void *);
+
+	if (!next)
+		next = next_symbol("free");
+	if (next)
+		next(ptr);
+}
+
+static void *next_realloc(void *ptr, size_t size)
+{
+	static void *(*next)(void *, size_t);
+
+	if (!next)
+		next = next_symbol("realloc");
+	return next ? next(ptr, size) : NULL;
+}
+
+static size_t next_usable_size(void *ptr)
+{
+	static size_t (*next)(void *);
+
+	if (!next)
+		next = next_symbol("malloc_usable_size");
+	return next ? next(ptr) : 0;
+}
+
+__attribute__((always_inline))
+static inline int is_foreign_ptr(void *ptr)
+{
+	return ptr && !is_our_ptr(ptr);
+}
+
+/*
+	* every lock of the allocator is held across fork so the child never inherits one
+	* locked by a thread it does not have
+	* they are taken from the outermost, the recorders, to the innermost, the mapping
+	* cache, and released in the reverse order
+*/
+
+static void fork_prepare()
+{
+	trace_fork_lock();
+	prof_fork_lock();
+	objpool_fork_lock();
+	arena_fork_lock();
+	registry_fork_lock();
+	pthread_mutex_lock(&heap_lock);
+	pool_fork_lock();
+	mapcache_fork_lock();
+}
+
+static void fork_release()
+{
+	mapcache_fork_unlock();
+	pool_fork_unlock();
+	pthread_mutex_unlock(&heap_lock);
+	registry_fork_unlock();
+	arena_fork_unlock();
+	objpool_fork_unlock();
+	prof_fork_unlock();
+	trace_fork_unlock();
+}
+
+__attribute__((constructor))
+static void interpose_init()
+{
+	pthread_atfork(fork_prepare, fork_release, fork_release);
+}
+
+void *malloc(size_t size)
+{
+	if (__builtin_expect(in_malloc, 0))
+		return bootstrap_alloc(size);
+	in_malloc = 1;
+	void *ptr = _malloc(size ? size : 1);
+	if (__builtin_expect(STAT_LOAD(trace_enabled), 0))
+		trace_record(TRACE_MALLOC, ptr, NULL, size, 0);
+	in_malloc = 0;
+	if (!ptr)
+		errno = ENOMEM;
+	return ptr;
+}
+
+void free(void *ptr)
+{
+	if (__builtin_expect(is_bootstrap_ptr(ptr), 0))
+		return;
+	if (__builtin_expect(is_foreign_ptr(ptr), 0))
+	{
+		next_free(ptr);
+		return;
+	}
+	if (__builtin_expect(STAT_LOAD(trace_enabled), 0) && ptr)
+		trace_record(TRACE_FREE, ptr, NULL, 0, 0);
+	_free(ptr);
+}
+
+void free_sized(void *ptr, size_t size)
+{
+	if (__builtin_expect(is_bootstrap_ptr(ptr), 0))
+		return;
+	if (__builtin_expect(is_foreign_ptr(ptr), 0))
+	{
+		next_free(ptr);
+		return;
+	}
+	if (__builtin_expect(STAT_LOAD(trace_enabled), 0) && ptr)
+		trace_record(TRACE_FREE, ptr, NULL, 0, 0);
+	_free_sized(ptr, size ? size : 1);
+}
+
+void free_aligned_sized(void *ptr, size_t alignment, size_t size)
+{
+	if (__builtin_expect(is_bootstrap_ptr(ptr), 0))
+		return;
+	if (__builtin_expect(is_foreign_ptr(ptr), 0))
+	{
+		next_free(ptr);
+		return;
+	}
+	if (__builtin_expect(STAT_LOAD(trace_enabled), 0) && ptr)
+		trace_record(TRACE_FREE, ptr, NULL, 0, 0);
+	_free_aligned_sized(ptr, alignment, size ? size : 1);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (__builtin_expect(in_malloc, 0))
+	{
+		if (size && nmemb > SIZE_MAX / size)
+			return NULL;
+		return bootstrap_alloc(nmemb * size);
+	}
+	in_malloc = 1;
+	void *ptr = _calloc(nmemb ? nmemb : 1, size ? size : 1);
+	if (__builtin_expect(STAT_LOAD(trace_enabled), 0))
+		trace_record(TRACE_CALLOC, ptr, NULL, nmemb * size, 0);
+	in_malloc = 0;
+	if (!ptr)
+		errno = ENOMEM;
+	return ptr;
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+	if (__builtin_expect(is_bootstrap_ptr(ptr), 0))
+		return *(size_t *)((unsigned char *)ptr - ALIGNMENT);
+	if (__builtin_expect(is_foreign_ptr(ptr), 0))
+		return next_usable_size(ptr);
+	return _malloc_usable_size(ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (__builtin_expect(is_bootstrap_ptr(ptr), 0))
+	{
+		void *new_ptr = malloc(size);
+		size_t old_size = malloc_usable_size(ptr);
+		if (new_ptr)
+			memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+		return new_ptr;
+	}
+	if (__builtin_expect(is_foreign_ptr(ptr), 0))
+		return next_realloc(ptr, size);
+	if (__builtin_expect(in_malloc, 0))
+		return bootstrap_alloc(size);
+	in_malloc = 1;
+	void *new_ptr = _realloc(ptr, size);
+	if (__builtin_expect(STAT_LOAD(trace_enabled), 0))
+		trace_record(TRACE_REALLOC, new_ptr, ptr, size, 0);
+	in_malloc = 0;
+	if (!new_ptr && size)
+		errno = ENOMEM;
+	return new_ptr;
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+	size_t total;
+
+	if (__builtin_mul_overflow(nmemb, size, &total))
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	return realloc(ptr, total);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	if ((alignment & (alignment - 1)) != 0)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	if (__builtin_expect(in_malloc, 0))
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	in_malloc = 1;
+	void *ptr = _aligned_alloc(alignment, size ? size : 1);
+	if (__builtin_expect(STAT_LOAD(trace_enabled), 0))
+		trace_record(TRACE_ALIGNED, ptr, NULL, size, alignment);
+	in_malloc = 0;
+	if (!ptr)
+		errno = ENOMEM;
+	return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	if ((alignment & (alignment - 1)) != 0 || alignment % sizeof(void *) != 0)
+		return EINVAL;
+	void *ptr = memalign(alignment, size);
+	if (!ptr)
+		return ENOMEM;
+	*memptr = ptr;
+	return 0;
+}
+
+void *valloc(size_t size)
+{
+	return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+int malloc_trim(size_t pad)
+{
+	return _malloc_trim(pad);
+}
+
+void *pvalloc(size_t size)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	return memalign(page_size, align_up(size ? size : 1, page_size));
+}
@@ -2,9 +2,11 @@
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+
+extern size_t block_size[];
 
 extern Block *freelist;
-extern int allocated_blocks;
 
 int ft_strlen(const char *s) {
     int len = 0; 
@@ -138,6 +140,1126 @@ void test_alignment() {
 }
 
 
+#define NUM_THREADS 8
+#define THREAD_ITERATIONS 100000
+
+static void *thread_alloc_free(void *arg) {
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    unsigned char *allocations[64] = {0};
+    size_t sizes[64] = {0};
+
+    for (size_t i = 0; i < THREAD_ITERATIONS; i++) {
+        size_t index = rand_r(&seed) % 64;
+        if (allocations[index]) {
+            for (size_t j = 0; j < sizes[index]; j++) {
+                if (allocations[index][j] != (unsigned char)index) {
+                    fprintf(stderr, "Error: Block %p corrupted by another thread\n", allocations[index]);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            _free(allocations[index]);
+            allocations[index] = NULL;
+        } else {
+            sizes[index] = (rand_r(&seed) % 512) + 1;
+            allocations[index] = _malloc(sizes[index]);
+            if (!allocations[index]) {
+                fprintf(stderr, "Error: Threaded allocation failed\n");
+                exit(EXIT_FAILURE);
+            }
+            memset(allocations[index], (int)index, sizes[index]);
+        }
+    }
+    for (size_t i = 0; i < 64; i++)
+        _free(allocations[i]);
+    return NULL;
+}
+
+void test_threads() {
+    printf("\n== Threaded Alloc/Free Test ==\n");
+    pthread_t threads[NUM_THREADS];
+
+    for (size_t i = 0; i < NUM_THREADS; i++)
+        pthread_create(&threads[i], NULL, thread_alloc_free, (void *)(i + 1));
+    for (size_t i = 0; i < NUM_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    check_for_leaks();
+    printf("Threaded alloc/free test passed.\n");
+}
+
+#define REMOTE_COUNT 1000
+
+static void *remote_ptrs[REMOTE_COUNT];
+static pthread_barrier_t remote_barrier;
+
+static void *remote_producer(void *arg) {
+    struct malloc_stats *groups = arg;
+
+    for (int i = 0; i < REMOTE_COUNT; i++)
+        remote_ptrs[i] = _malloc(64);
+    _malloc_stats(&groups[0]);
+    pthread_barrier_wait(&remote_barrier);
+    pthread_barrier_wait(&remote_barrier);
+    for (int i = 0; i < REMOTE_COUNT; i++)
+        remote_ptrs[i] = _malloc(64);
+    _malloc_stats(&groups[1]);
+    for (int i = 0; i < REMOTE_COUNT; i++)
+        _free(remote_ptrs[i]);
+    return NULL;
+}
+
+static void *remote_consumer(void *arg) {
+    (void)arg;
+    pthread_barrier_wait(&remote_barrier);
+    for (int i = 0; i < REMOTE_COUNT; i++)
+        _free(remote_ptrs[i]);
+    pthread_barrier_wait(&remote_barrier);
+    return NULL;
+}
+
+static void *remote_exiting(void *arg) {
+    (void)arg;
+    for (int i = 0; i < REMOTE_COUNT; i++)
+        remote_ptrs[i] = _malloc(32);
+    return NULL;
+}
+
+void test_remote_free() {
+    printf("\n== Remote Free Test ==\n");
+    struct malloc_stats before, after, groups[2];
+    pthread_t producer, consumer;
+
+    _malloc_stats(&before);
+    pthread_barrier_init(&remote_barrier, NULL, 2);
+    pthread_create(&producer, NULL, remote_producer, groups);
+    pthread_create(&consumer, NULL, remote_consumer, NULL);
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+    pthread_barrier_destroy(&remote_barrier);
+    _malloc_stats(&after);
+    if (after.remote_frees - before.remote_frees < REMOTE_COUNT) {
+        fprintf(stderr, "Error: Cross-thread frees did not go to the owner\n");
+        exit(EXIT_FAILURE);
+    }
+    if (groups[1].classes[3].groups > groups[0].classes[3].groups) {
+        fprintf(stderr, "Error: Owner did not reuse its remotely freed slots\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_create(&producer, NULL, remote_exiting, NULL);
+    pthread_join(producer, NULL);
+    for (int i = 0; i < REMOTE_COUNT; i++)
+        _free(remote_ptrs[i]);
+    check_for_leaks();
+    printf("Remote free test passed.\n");
+}
+
+#define REMOTE_BURST 4096
+
+static void *remote_burst_freer(void *arg) {
+    void **ptrs = arg;
+    for (int i = 0; i < REMOTE_BURST; i++)
+        _free(ptrs[i]);
+    return NULL;
+}
+
+static void *remote_burst_owner(void *arg) {
+    static void *ptrs[REMOTE_BURST];
+    struct malloc_stats *stats = arg;
+    pthread_t freer;
+
+    for (int i = 0; i < REMOTE_BURST; i++)
+        ptrs[i] = _malloc(64);
+    _malloc_stats(&stats[0]);
+    pthread_create(&freer, NULL, remote_burst_freer, ptrs);
+    pthread_join(freer, NULL);
+    void *ptr = _malloc(64);
+    _malloc_stats(&stats[1]);
+    _free(ptr);
+    return NULL;
+}
+
+void test_remote_burst() {
+    printf("\n== Remote Burst Test ==\n");
+    struct malloc_stats stats[2];
+    pthread_t owner;
+
+    pthread_create(&owner, NULL, remote_burst_owner, stats);
+    pthread_join(owner, NULL);
+    if (stats[1].classes[3].cached > stats[0].classes[3].cached + alloc_config.tcache_max[3]) {
+        fprintf(stderr, "Error: %lu slots cached after a remote burst, the bin keeps %u\n",
+            (unsigned long)stats[1].classes[3].cached, alloc_config.tcache_max[3]);
+        exit(EXIT_FAILURE);
+    }
+    check_for_leaks();
+    printf("Remote burst test passed.\n");
+}
+
+#define BATCH_COUNT 3000
+
+void test_batch() {
+    printf("\n== Batch Alloc/Free Test ==\n");
+    static void *ptrs[BATCH_COUNT + 3];
+    struct malloc_stats before, after;
+
+    _malloc_stats(&before);
+    size_t n = _malloc_batch(40, BATCH_COUNT, ptrs);
+    if (n != BATCH_COUNT) {
+        fprintf(stderr, "Error: Batch allocated %zu of %d blocks\n", n, BATCH_COUNT);
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!ptrs[i] || ((uintptr_t)ptrs[i] & (ALIGNMENT - 1)) || _malloc_usable_size(ptrs[i]) < 40) {
+            fprintf(stderr, "Error: Batch block %zu is invalid\n", i);
+            exit(EXIT_FAILURE);
+        }
+        memset(ptrs[i], (int)i, 40);
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (((unsigned char *)ptrs[i])[39] != (unsigned char)i) {
+            fprintf(stderr, "Error: Batch blocks overlap at %zu\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    _malloc_stats(&after);
+    if (after.classes[2].nmalloc - before.classes[2].nmalloc != BATCH_COUNT) {
+        fprintf(stderr, "Error: Batch allocations were not counted\n");
+        exit(EXIT_FAILURE);
+    }
+    ptrs[n] = NULL;
+    ptrs[n + 1] = _malloc(5000);
+    ptrs[n + 2] = _malloc(2 * MMAP_THRESHOLD);
+    _free_batch(ptrs, n + 3);
+    n = _malloc_batch(3000, 4, ptrs);
+    _free_batch(ptrs, n);
+    check_for_leaks();
+    printf("Batch alloc/free test passed.\n");
+}
+
+void test_free_sized() {
+    printf("\n== Sized Free Test ==\n");
+    size_t sizes[] = {1, 16, 17, 100, 256, 257, 3000, 40000, 2 * MMAP_THRESHOLD};
+    struct malloc_stats before, after;
+
+    _malloc_stats(&before);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (int round = 0; round < 100; round++) {
+            void *p = _malloc(sizes[i]);
+            memset(p, 0xAB, sizes[i]);
+            _free_sized(p, sizes[i]);
+        }
+        void *p = _aligned_alloc(64, sizes[i]);
+        _free_aligned_sized(p, 64, sizes[i]);
+        p = _aligned_alloc(8, sizes[i]);
+        _free_aligned_sized(p, 8, sizes[i]);
+    }
+    _malloc_stats(&after);
+    if (after.classes[6].nfree - before.classes[6].nfree < 100) {
+        fprintf(stderr, "Error: Sized frees did not reach the thread cache\n");
+        exit(EXIT_FAILURE);
+    }
+    void *p = _malloc(5000);
+    p = _realloc(p, 100);
+    if (!is_slab_ptr(p)) {
+        fprintf(stderr, "Error: Realloc to a small size did not move to a slab slot\n");
+        exit(EXIT_FAILURE);
+    }
+    _free_sized(p, 100);
+    p = _malloc(200);
+    void *same = _realloc(p, 195);
+    p = _realloc(same, 20);
+    if (same == NULL || !is_slab_ptr(p) || slab_class(p) != 1) {
+        fprintf(stderr, "Error: Realloc kept a slot whose bin differs from the new size\n");
+        exit(EXIT_FAILURE);
+    }
+    _free_sized(p, 20);
+    check_for_leaks();
+    printf("Sized free test passed.\n");
+}
+
+void test_realloc() {
+    printf("\n== Realloc Test ==\n");
+    size_t size = 16;
+    size_t moves = 0;
+    unsigned char *buffer = _malloc(size);
+    memset(buffer, 0x5A, size);
+
+    while (size < 4 * MMAP_THRESHOLD) {
+        size_t new_size = size * 3 / 2 + 16;
+        unsigned char *grown = _realloc(buffer, new_size);
+        if (!grown) {
+            fprintf(stderr, "Error: Realloc to %zu bytes failed\n", new_size);
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < size; i++) {
+            if (grown[i] != 0x5A) {
+                fprintf(stderr, "Error: Realloc lost data at offset %zu\n", i);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (_malloc_usable_size(grown) < new_size) {
+            fprintf(stderr, "Error: Usable size smaller than requested\n");
+            exit(EXIT_FAILURE);
+        }
+        moves += grown != buffer;
+        memset(grown + size, 0x5A, new_size - size);
+        buffer = grown;
+        size = new_size;
+    }
+    buffer = _realloc(buffer, 64);
+    if (buffer[63] != 0x5A) {
+        fprintf(stderr, "Error: Shrinking realloc lost data\n");
+        exit(EXIT_FAILURE);
+    }
+    _free(buffer);
+    printf("Realloc test passed (%zu moves).\n", moves);
+}
+
+void test_stats() {
+    printf("\n== Stats Test ==\n");
+    size_t sizes[] = {24, 3000, 60000, 2 * MMAP_THRESHOLD};
+    void *ptrs[4];
+    struct malloc_stats before, during, after;
+
+    _malloc_stats(&before);
+    for (int i = 0; i < 4; i++)
+        ptrs[i] = _malloc(sizes[i]);
+    _malloc_stats(&during);
+    if (during.live != before.live + 4 || during.allocated < before.allocated + 24 + 3000 + 60000 + 2 * MMAP_THRESHOLD) {
+        fprintf(stderr, "Error: Stats missed live allocations\n");
+        exit(EXIT_FAILURE);
+    }
+    if (during.mmap_calls + during.mapcache_hits <= before.mmap_calls + before.mapcache_hits
+        || during.mapped < during.active || during.classes[1].live < 1) {
+        fprintf(stderr, "Error: Stats mapping counters are wrong\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < 4; i++)
+        _free(ptrs[i]);
+
+    int class = 0;
+    while (class < BIN_COUNT && alloc_config.slab_slots[class] * block_size[class] == SPAN_SIZE)
+        class++;
+    if (class < BIN_COUNT) {
+        static void *slots[4 * SPAN_SIZE / 16];
+        size_t count = 4 * alloc_config.slab_slots[class];
+        size_t carved = alloc_config.slab_slots[class] * block_size[class];
+        struct malloc_stats empty, full;
+        _malloc_stats(&empty);
+        for (size_t i = 0; i < count; i++)
+            slots[i] = _malloc(block_size[class]);
+        _malloc_stats(&full);
+        uint64_t groups = full.classes[class].groups - empty.classes[class].groups;
+        if (groups == 0 || full.active - empty.active != groups * carved) {
+            fprintf(stderr, "Error: Stats active counts %zu bytes for %lu spans carving %zu\n",
+                    full.active - empty.active, (unsigned long)groups, carved);
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < count; i++)
+            _free(slots[i]);
+    }
+    _malloc_stats(&after);
+    if (after.live != before.live || after.allocated != before.allocated
+        || after.munmap_calls + after.mapcache_bytes <= during.munmap_calls + during.mapcache_bytes) {
+        fprintf(stderr, "Error: Stats did not see the frees\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("Stats test passed (%.1f%% thread cache hits).\n", 100.0 * after.tcache_hit_rate);
+}
+
+void test_profile() {
+    printf("\n== Profile Test ==\n");
+    const char *path = "/tmp/ft_malloc_test.heap";
+    void *ptrs[64];
+    char line[256];
+
+    _malloc_prof_start(4096);
+    for (int i = 0; i < 64; i++)
+        ptrs[i] = _malloc(8192);
+    _malloc_prof_stop();
+    if (_malloc_prof_dump(path) != 0) {
+        fprintf(stderr, "Error: Profile dump failed\n");
+        exit(EXIT_FAILURE);
+    }
+    FILE *file = fopen(path, "r");
+    unsigned long objs = 0, bytes = 0;
+    if (!file || !fgets(line, sizeof(line), file)
+        || sscanf(line, "heap profile: %lu: %lu", &objs, &bytes) != 2 || !strstr(line, "heap_v2/4096")) {
+        fprintf(stderr, "Error: Profile header is wrong\n");
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+    if (objs == 0 || bytes != objs * 8192) {
+        fprintf(stderr, "Error: Profile has %lu live samples of %lu bytes\n", objs, bytes);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < 64; i++)
+        _free(ptrs[i]);
+    _malloc_prof_dump(path);
+    file = fopen(path, "r");
+    if (!file || !fgets(line, sizeof(line), file) || sscanf(line, "heap profile: %lu: %lu", &objs, &bytes) != 2 || objs) {
+        fprintf(stderr, "Error: Freed blocks are still in the profile\n");
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+
+    _malloc_prof_start(1);
+    void *large = _malloc(200000);
+    void *medium = _malloc(40000);
+    _malloc_prof_stop();
+    large = _realloc(large, 4 << 20);
+    medium = _realloc(medium, 20000);
+    _malloc_prof_dump(path);
+    file = fopen(path, "r");
+    if (!file || !fgets(line, sizeof(line), file) || sscanf(line, "heap profile: %lu: %lu", &objs, &bytes) != 2
+        || objs != 2 || bytes != (4 << 20) + 20000) {
+        fprintf(stderr, "Error: Resized blocks have %lu live samples of %lu bytes\n", objs, bytes);
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+    _free(large);
+    _free(medium);
+    _malloc_prof_dump(path);
+    file = fopen(path, "r");
+    if (!file || !fgets(line, sizeof(line), file) || sscanf(line, "heap profile: %lu: %lu", &objs, &bytes) != 2 || objs) {
+        fprintf(stderr, "Error: Freed resized blocks are still in the profile\n");
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+
+    _malloc_prof_start(1);
+    void *slot = _aligned_alloc(64, 1000);
+    void *mapping = _aligned_alloc(4096, 300000);
+    _malloc_prof_stop();
+    _malloc_prof_dump(path);
+    file = fopen(path, "r");
+    if (!file || !fgets(line, sizeof(line), file) || sscanf(line, "heap profile: %lu: %lu", &objs, &bytes) != 2
+        || objs != 2 || bytes != 301000 || ((uintptr_t)slot & 63) || ((uintptr_t)mapping & 4095)) {
+        fprintf(stderr, "Error: Aligned blocks have %lu live samples of %lu bytes\n", objs, bytes);
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+    _free(slot);
+    _free(mapping);
+    _malloc_prof_dump(path);
+    file = fopen(path, "r");
+    if (!file || !fgets(line, sizeof(line), file) || sscanf(line, "heap profile: %lu: %lu", &objs, &bytes) != 2 || objs) {
+        fprintf(stderr, "Error: Freed aligned blocks are still in the profile\n");
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+    remove(path);
+    printf("Profile test passed.\n");
+}
+
+#define TRACE_TEST_COUNT 3000
+
+static void *trace_worker(void *arg) {
+    for (int i = 0; i < TRACE_TEST_COUNT; i++) {
+        void *ptr = _malloc(64);
+        trace_record(TRACE_MALLOC, ptr, NULL, 64, 0);
+        trace_record(TRACE_FREE, ptr, NULL, 0, 0);
+        _free(ptr);
+    }
+    return arg;
+}
+
+#define TRACE_LIVE_COUNT 500
+
+static pthread_barrier_t trace_barrier;
+
+static void *trace_sleeper(void *arg) {
+    for (int i = 0; i < TRACE_LIVE_COUNT; i++) {
+        void *ptr = _malloc(32);
+        trace_record(TRACE_MALLOC, ptr, NULL, 32, 0);
+        trace_record(TRACE_FREE, ptr, NULL, 0, 0);
+        _free(ptr);
+    }
+    pthread_barrier_wait(&trace_barrier);
+    pthread_barrier_wait(&trace_barrier);
+    return arg;
+}
+
+void test_trace() {
+    printf("\n== Trace Test ==\n");
+    const char *path = "/tmp/ft_malloc_test.trace";
+    pthread_t threads[2], sleeper;
+
+    if (_malloc_trace_start(path) != 0) {
+        fprintf(stderr, "Error: Trace could not start\n");
+        exit(EXIT_FAILURE);
+    }
+    if (_malloc_trace_start(path) == 0 || errno != EBUSY) {
+        fprintf(stderr, "Error: A second trace started\n");
+        exit(EXIT_FAILURE);
+    }
+    void *ptr = _aligned_alloc(64, 100);
+    trace_record(TRACE_ALIGNED, ptr, NULL, 100, 64);
+    for (int i = 0; i < 2; i++)
+        pthread_create(&threads[i], NULL, trace_worker, NULL);
+    for (int i = 0; i < 2; i++)
+        pthread_join(threads[i], NULL);
+    trace_record(TRACE_FREE, ptr, NULL, 0, 0);
+    _free(ptr);
+    pthread_barrier_init(&trace_barrier, NULL, 2);
+    pthread_create(&sleeper, NULL, trace_sleeper, NULL);
+    pthread_barrier_wait(&trace_barrier);
+    _malloc_trace_stop();
+
+    FILE *file = fopen(path, "rb");
+    TraceHeader header;
+    TraceRecord record;
+    size_t count = 0, frees = 0, aligned = 0;
+    uint64_t last_seq[4] = {0};
+    if (!file || fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) || header.record_size != sizeof(TraceRecord)) {
+        fprintf(stderr, "Error: Trace header is wrong\n");
+        exit(EXIT_FAILURE);
+    }
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.thread > 3 || (last_seq[record.thread] && record.seq <= last_seq[record.thread])) {
+            fprintf(stderr, "Error: Trace record %zu is out of order\n", count);
+            exit(EXIT_FAILURE);
+        }
+        last_seq[record.thread] = record.seq;
+        frees += record.op == TRACE_FREE;
+        aligned += record.op == TRACE_ALIGNED && record.align_shift == 6 && record.size == 100;
+        count++;
+    }
+    fclose(file);
+    pthread_barrier_wait(&trace_barrier);
+    pthread_join(sleeper, NULL);
+    pthread_barrier_destroy(&trace_barrier);
+    if (count != 4 * TRACE_TEST_COUNT + 2 * TRACE_LIVE_COUNT + 2 || frees != 2 * TRACE_TEST_COUNT + TRACE_LIVE_COUNT + 1
+        || aligned != 1) {
+        fprintf(stderr, "Error: Trace holds %zu records, %zu frees\n", count, frees);
+        exit(EXIT_FAILURE);
+    }
+    remove(path);
+    printf("Trace test passed.\n");
+}
+
+static size_t trace_records(const char *path) {
+    FILE *file = fopen(path, "rb");
+    TraceHeader header;
+    TraceRecord record;
+    size_t count = 0;
+
+    if (!file || fread(&header, sizeof(header), 1, file) != 1) {
+        fprintf(stderr, "Error: Trace %s cannot be read\n", path);
+        exit(EXIT_FAILURE);
+    }
+    while (fread(&record, sizeof(record), 1, file) == 1)
+        count++;
+    fclose(file);
+    return count;
+}
+
+static void *trace_restart_worker(void *arg) {
+    (void)arg;
+    for (int phase = 0; phase < 3; phase++) {
+        pthread_barrier_wait(&trace_barrier);
+        for (int i = 0; i < TRACE_LIVE_COUNT; i++) {
+            void *ptr = _malloc(32);
+            trace_record(TRACE_MALLOC, ptr, NULL, 32, 0);
+            trace_record(TRACE_FREE, ptr, NULL, 0, 0);
+            _free(ptr);
+        }
+        pthread_barrier_wait(&trace_barrier);
+        pthread_barrier_wait(&trace_barrier);
+    }
+    return NULL;
+}
+
+void test_trace_restart() {
+    printf("\n== Trace Restart Test ==\n");
+    const char *paths[2] = {"/tmp/ft_malloc_test.trace.1", "/tmp/ft_malloc_test.trace.2"};
+    pthread_t worker;
+
+    pthread_barrier_init(&trace_barrier, NULL, 2);
+    pthread_create(&worker, NULL, trace_restart_worker, NULL);
+    for (int i = 0; i < 2; i++) {
+        if (_malloc_trace_start(paths[i]) != 0) {
+            fprintf(stderr, "Error: Trace %d could not start after a stop\n", i + 1);
+            exit(EXIT_FAILURE);
+        }
+        pthread_barrier_wait(&trace_barrier);
+        pthread_barrier_wait(&trace_barrier);
+        _malloc_trace_stop();
+        pthread_barrier_wait(&trace_barrier);
+    }
+    for (int i = 0; i < 3; i++)
+        pthread_barrier_wait(&trace_barrier);
+    pthread_join(worker, NULL);
+    pthread_barrier_destroy(&trace_barrier);
+    for (int i = 0; i < 2; i++) {
+        size_t count = trace_records(paths[i]);
+        if (count != 2 * TRACE_LIVE_COUNT) {
+            fprintf(stderr, "Error: Trace %d holds %zu records instead of %d\n", i + 1, count, 2 * TRACE_LIVE_COUNT);
+            exit(EXIT_FAILURE);
+        }
+        remove(paths[i]);
+    }
+    printf("Trace restart test passed.\n");
+}
+
+#define FRAG_TEST_COUNT 4096
+
+void test_frag_report() {
+    printf("\n== Fragmentation Report Test ==\n");
+    static void *ptrs[FRAG_TEST_COUNT];
+    struct malloc_frag_report before, after;
+
+    _malloc_frag_report(&before);
+    for (int i = 0; i < FRAG_TEST_COUNT; i++)
+        ptrs[i] = _malloc(20);
+    for (int i = 0; i < FRAG_TEST_COUNT; i += 2) {
+        _free(ptrs[i]);
+        ptrs[i] = NULL;
+    }
+    void *heap[3];
+    for (int i = 0; i < 3; i++)
+        heap[i] = _malloc(40000);
+    _free(heap[1]);
+    _malloc_frag_report(&after);
+
+    struct malloc_frag_class *class = &after.classes[BIN_INDEX(20)];
+    size_t live = class->live_bytes - before.classes[BIN_INDEX(20)].live_bytes;
+    uint64_t occupancy = 0;
+    for (int i = 0; i < FRAG_OCCUPANCY_BUCKETS; i++)
+        occupancy += class->span_occupancy[i];
+    if (class->size != 32 || live < FRAG_TEST_COUNT / 2 * 32 || class->partial_spans == 0
+        || class->spans != class->full_spans + class->partial_spans + class->empty_spans
+        || class->spans != occupancy || class->full_spans != class->span_occupancy[FRAG_OCCUPANCY_BUCKETS - 1]
+        || class->internal_waste == 0 || class->internal_waste >= class->live_bytes) {
+        fprintf(stderr, "Error: Class report is wrong: %lu spans, %zu live, %zu waste\n",
+                (unsigned long)class->spans, live, class->internal_waste);
+        exit(EXIT_FAILURE);
+    }
+    if (after.heap_free_blocks == 0 || after.heap_largest_free < 40000
+        || after.heap_live_bytes < before.heap_live_bytes + 80000
+        || after.heap_header_bytes != after.heap_live_blocks * BLOCK_SIZE) {
+        fprintf(stderr, "Error: Heap report is wrong\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!after.rss || after.requested <= before.requested || after.rss_per_requested <= 0
+        || after.requested + after.internal_waste > after.mapped + after.rss) {
+        fprintf(stderr, "Error: Totals of the report are wrong\n");
+        exit(EXIT_FAILURE);
+    }
+    _free(heap[0]);
+    _free(heap[2]);
+    for (int i = 1; i < FRAG_TEST_COUNT; i += 2)
+        _free(ptrs[i]);
+    frag_info();
+    printf("Fragmentation report test passed.\n");
+}
+
+static long resident_pages() {
+    long size = 0, resident = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file) {
+        if (fscanf(file, "%ld %ld", &size, &resident) != 2)
+            resident = 0;
+        fclose(file);
+    }
+    return resident;
+}
+
+void test_trim() {
+    printf("\n== Trim Test ==\n");
+    void *ptrs[256];
+    struct malloc_stats stats;
+
+    for (int i = 0; i < 256; i++) {
+        ptrs[i] = _malloc(i % 2 ? 20000 : 60000);
+        memset(ptrs[i], 0xAB, i % 2 ? 20000 : 60000);
+    }
+    for (int i = 0; i < 256; i++)
+        _free(ptrs[i]);
+    long before = resident_pages();
+    if (!_malloc_trim(0)) {
+        fprintf(stderr, "Error: Trim released nothing\n");
+        exit(EXIT_FAILURE);
+    }
+    long after = resident_pages();
+    _malloc_stats(&stats);
+    if (after >= before || stats.purged == 0) {
+        fprintf(stderr, "Error: Trim kept the pages resident (%ld -> %ld pages)\n", before, after);
+        exit(EXIT_FAILURE);
+    }
+    unsigned char *p = _calloc(60000, 1);
+    for (size_t i = 0; i < 60000; i++) {
+        if (p[i]) {
+            fprintf(stderr, "Error: Calloc after trim returned dirty memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    _free(p);
+    printf("Trim test passed (%ld -> %ld resident pages).\n", before, after);
+}
+
+void test_hugepages() {
+    printf("\n== Huge Page Test ==\n");
+    int modes[] = {HUGEPAGE_THP, HUGEPAGE_HUGETLB};
+    struct malloc_stats before, during, after;
+
+    for (int m = 0; m < 2; m++) {
+        _malloc_set_hugepages(modes[m]);
+        _malloc_stats(&before);
+        unsigned char *large = _malloc(3 * HUGE_PAGE_SIZE + 100);
+        unsigned char *heap = _malloc(100000);
+        if (!large || !heap) {
+            fprintf(stderr, "Error: Huge page allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        if (((uintptr_t)large - BLOCK_SIZE) % HUGE_PAGE_SIZE != 0 || _malloc_usable_size(large) < 3 * HUGE_PAGE_SIZE + 100) {
+            fprintf(stderr, "Error: Large block is not a huge page arena\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(large, 0x11, 3 * HUGE_PAGE_SIZE + 100);
+        memset(heap, 0x22, 100000);
+        _malloc_stats(&during);
+        if (during.huge_mapped < before.huge_mapped + 4 * HUGE_PAGE_SIZE) {
+            fprintf(stderr, "Error: Huge page arenas are missing from the stats\n");
+            exit(EXIT_FAILURE);
+        }
+        _free(large);
+        _free(heap);
+        _malloc_stats(&after);
+        if (after.huge_mapped != during.huge_mapped - 4 * HUGE_PAGE_SIZE) {
+            fprintf(stderr, "Error: Huge page arena was not unmapped\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    _malloc_set_hugepages(HUGEPAGE_OFF);
+    printf("Huge page test passed.\n");
+}
+
+void test_mapcache() {
+    printf("\n== Mapping Cache Test ==\n");
+    struct malloc_stats before, after;
+
+    _malloc_trim(0);
+    _malloc_stats(&before);
+    for (int i = 0; i < 100; i++) {
+        unsigned char *p = _malloc(2 * MMAP_THRESHOLD);
+        p[0] = p[2 * MMAP_THRESHOLD - 1] = (unsigned char)i;
+        _free(p);
+    }
+    unsigned char *near = _calloc(2 * MMAP_THRESHOLD + 40000, 1);
+    for (size_t i = 0; i < 2 * MMAP_THRESHOLD + 40000; i += 4096) {
+        if (near[i]) {
+            fprintf(stderr, "Error: Cached mapping was not cleared by calloc\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    _free(near);
+    _malloc_stats(&after);
+    if (after.mmap_calls - before.mmap_calls > 1 || after.mapcache_hits - before.mapcache_hits < 100
+        || after.mremap_calls == before.mremap_calls) {
+        fprintf(stderr, "Error: Large blocks did not reuse their mappings\n");
+        exit(EXIT_FAILURE);
+    }
+    _malloc_trim(0);
+    _free(_malloc(1024 * 1024));
+    _malloc_stats(&before);
+    unsigned char *shrunk = _malloc(200 * 1024);
+    shrunk[200 * 1024 - 1] = 1;
+    _malloc_stats(&after);
+    _free(shrunk);
+    if (after.mapcache_hits != before.mapcache_hits + 1 || after.mmap_calls != before.mmap_calls) {
+        fprintf(stderr, "Error: A smaller block did not shrink a larger cached mapping\n");
+        exit(EXIT_FAILURE);
+    }
+    _malloc_trim(0);
+    _malloc_stats(&after);
+    if (after.mapcache_bytes != 0) {
+        fprintf(stderr, "Error: Trim left mappings in the cache\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("Mapping cache test passed.\n");
+}
+
+void test_config() {
+    printf("\n== Cache Topology Config Test ==\n");
+    _free(_malloc(32));
+    if (!alloc_config.l1d_size || !alloc_config.l2_size || alloc_config.llc_size < alloc_config.l2_size
+        || !alloc_config.line_size || alloc_config.cores < 1) {
+        fprintf(stderr, "Error: Cache topology was not detected\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        size_t carved = alloc_config.slab_slots[i] * block_size[i];
+        if ((i < BIN_COUNT && (alloc_config.tcache_max[i] < TCACHE_MIN || alloc_config.tcache_max[i] > TCACHE_MAX))
+            || !alloc_config.slab_slots[i] || carved > SPAN_SIZE
+            || (carved > alloc_config.l1d_size && alloc_config.slab_slots[i] > TCACHE_BATCH)) {
+            fprintf(stderr, "Error: Class %d is tuned out of bounds\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    size_t count = 2 * alloc_config.slab_slots[0];
+    void **slots = _malloc(count * sizeof(void *));
+    for (size_t i = 0; i < count; i++) {
+        slots[i] = _malloc(16);
+        if (((uintptr_t)slots[i] & (SPAN_SIZE - 1)) >= alloc_config.slab_slots[0] * 16) {
+            fprintf(stderr, "Error: A span carved more than %u slots\n", alloc_config.slab_slots[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (size_t i = 0; i < count; i++)
+        _free(slots[i]);
+    _free(slots);
+    printf("Config test passed (L1d %zu KB, L2 %zu KB, LLC %zu KB, line %zu, cores %d, tcache %u..%u, slots %u..%u).\n",
+           alloc_config.l1d_size / 1024, alloc_config.l2_size / 1024, alloc_config.llc_size / 1024,
+           alloc_config.line_size, alloc_config.cores, alloc_config.tcache_max[BIN_COUNT - 1],
+           alloc_config.tcache_max[0], alloc_config.slab_slots[BIN_COUNT - 1], alloc_config.slab_slots[0]);
+}
+
+void test_dense_slots() {
+    printf("\n== Header Free Slots Test ==\n");
+    void *ptrs[64];
+    int dense = 0;
+    for (int i = 0; i < 64; i++) {
+        ptrs[i] = _malloc(48);
+        if (!is_slab_ptr(ptrs[i]) || slab_class(ptrs[i]) != 2 || slab_meta(ptrs[i])->sizeclass != 2) {
+            fprintf(stderr, "Error: 48 bytes did not come from the 48 byte class\n");
+            exit(EXIT_FAILURE);
+        }
+        if (i && (char *)ptrs[i] - (char *)ptrs[i - 1] == 48)
+            dense++;
+    }
+    if (dense < 32) {
+        fprintf(stderr, "Error: Only %d of 63 slots were packed without a header\n", dense);
+        exit(EXIT_FAILURE);
+    }
+    void *aligned = _aligned_alloc(64, 100);
+    if (!aligned || !is_slab_ptr(aligned) || ((uintptr_t)aligned & 63) || _malloc_usable_size(aligned) < 100) {
+        fprintf(stderr, "Error: Small aligned allocation is not an aligned slot\n");
+        exit(EXIT_FAILURE);
+    }
+    void *foreign = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (is_slab_ptr(foreign) || is_slab_ptr((char *)foreign + 64)) {
+        fprintf(stderr, "Error: Foreign pointer taken for a slot\n");
+        exit(EXIT_FAILURE);
+    }
+    munmap(foreign, 4096);
+    _free(aligned);
+    for (int i = 0; i < 64; i++)
+        _free(ptrs[i]);
+    printf("Header free slots test passed (%d of 63 neighbours packed).\n", dense);
+}
+
+void test_pagemap() {
+    printf("\n== Pagemap Test ==\n");
+    static int global;
+    int local;
+    void *pool = _malloc(1000);
+    void *large = _malloc(512 * 1024);
+    void *heap[3];
+    for (int i = 0; i < 3; i++)
+        heap[i] = _malloc(40000);
+    if ((pagemap_lookup(pool) & PAGEMAP_TAG_MASK) != PAGEMAP_POOL
+        || (pagemap_lookup(large) & PAGEMAP_TAG_MASK) != PAGEMAP_MMAP
+        || (pagemap_lookup((char *)large + 300 * 1024) & PAGEMAP_TAG_MASK) != PAGEMAP_MMAP
+        || (pagemap_lookup(heap[1]) & PAGEMAP_TAG_MASK) != PAGEMAP_HEAP) {
+        fprintf(stderr, "Error: Pagemap does not know the tier of a block\n");
+        exit(EXIT_FAILURE);
+    }
+    if (is_our_ptr(&global) || is_our_ptr(&local) || is_our_ptr((void *)-4096L) || !is_our_ptr(pool)) {
+        fprintf(stderr, "Error: Pagemap ownership check is wrong\n");
+        exit(EXIT_FAILURE);
+    }
+    _free(large);
+    if (pagemap_lookup(large)) {
+        fprintf(stderr, "Error: Unmapped block is still in the pagemap\n");
+        exit(EXIT_FAILURE);
+    }
+    _free(heap[1]);
+    _free(heap[0]);
+    _free(heap[2]);
+    for (Block *block = freelist; block; block = block->next) {
+        if ((block->next && block->next->prev != block)
+            || (block->free && block->next && block->next->free && block_is_adjacent(block, block->next))) {
+            fprintf(stderr, "Error: Heap list is not coalesced or its back links are broken\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    _free(pool);
+    printf("Pagemap test passed.\n");
+}
+
+void test_arena() {
+    printf("\n== Arena Test ==\n");
+    Arena *arena = _arena_create(0);
+    struct malloc_stats stats;
+    uint64_t mmap_calls = 0;
+    if (!arena) {
+        fprintf(stderr, "Error: Arena creation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int round = 0; round < 3; round++) {
+        unsigned char *prev = NULL;
+        size_t prev_size = 0;
+        for (int i = 0; i < 2000; i++) {
+            size_t size = 1 + (i * 37) % 3000;
+            size_t align = (size_t)1 << (i % 8);
+            unsigned char *p = _arena_alloc(arena, size, align);
+            if (!p || ((uintptr_t)p & (align - 1)) || (prev && p >= prev && p < prev + prev_size)) {
+                fprintf(stderr, "Error: Arena allocation %d is wrong\n", i);
+                exit(EXIT_FAILURE);
+            }
+            memset(p, i, size);
+            prev = p;
+            prev_size = size;
+        }
+        _malloc_stats(&stats);
+        if (stats.arenas < 1 || stats.arena_allocated < 2000 || stats.arena_active < stats.arena_allocated) {
+            fprintf(stderr, "Error: Arena is missing from the stats\n");
+            exit(EXIT_FAILURE);
+        }
+        if (round && stats.mmap_calls != mmap_calls) {
+            fprintf(stderr, "Error: Arena chunks were not recycled by the reset\n");
+            exit(EXIT_FAILURE);
+        }
+        mmap_calls = stats.mmap_calls;
+        _arena_reset(arena);
+    }
+    if (_arena_alloc(arena, 16, 3) || _arena_alloc(arena, 0, 16) || !_arena_alloc(arena, 1 << 20, 4096)) {
+        fprintf(stderr, "Error: Arena argument checks are wrong\n");
+        exit(EXIT_FAILURE);
+    }
+    _arena_destroy(arena);
+    _malloc_stats(&stats);
+    if (stats.arenas) {
+        fprintf(stderr, "Error: Destroyed arena is still counted\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("Arena test passed.\n");
+}
+
+#define OBJPOOL_TEST_COUNT 5000
+
+static void *object_pool_worker(void *arg) {
+    ObjectPool *pool = arg;
+    void *objects[OBJPOOL_TEST_COUNT];
+    for (int round = 0; round < 20; round++) {
+        for (int i = 0; i < OBJPOOL_TEST_COUNT; i++) {
+            objects[i] = _pool_alloc(pool);
+            memset(objects[i], round, 40);
+        }
+        for (int i = 0; i < OBJPOOL_TEST_COUNT; i++)
+            _pool_free(pool, objects[i]);
+    }
+    return NULL;
+}
+
+void test_object_pool() {
+    printf("\n== Object Pool Test ==\n");
+    ObjectPool *pool = _pool_create(40, 64);
+    ObjectPool *other = _pool_create(24, 0);
+    unsigned char *objects[OBJPOOL_TEST_COUNT];
+    if (!pool || !other || _pool_create(0, 0) || _pool_create(16, 48)) {
+        fprintf(stderr, "Error: Object pool creation is wrong\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < OBJPOOL_TEST_COUNT; i++) {
+        objects[i] = _pool_alloc(pool);
+        if (!objects[i] || ((uintptr_t)objects[i] & 63)) {
+            fprintf(stderr, "Error: Pool object %d is not aligned\n", i);
+            exit(EXIT_FAILURE);
+        }
+        memset(objects[i], i & 0xff, 40);
+    }
+    int dense = 0;
+    for (int i = 0; i < OBJPOOL_TEST_COUNT; i++) {
+        if (objects[i][0] != (i & 0xff) || objects[i][39] != (i & 0xff)) {
+            fprintf(stderr, "Error: Pool objects overlap\n");
+            exit(EXIT_FAILURE);
+        }
+        if (i && objects[i] - objects[i - 1] == 64)
+            dense++;
+    }
+    void *small = _pool_alloc(other);
+    _pool_free(other, small);
+    for (int i = 0; i < OBJPOOL_TEST_COUNT; i++)
+        _pool_free(pool, objects[i]);
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, object_pool_worker, pool);
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+    if (dense < OBJPOOL_TEST_COUNT / 2 || _pool_alloc(other) != small) {
+        fprintf(stderr, "Error: Pool objects are not packed or not reused\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("Object pool test passed (%d of %d neighbours packed).\n", dense, OBJPOOL_TEST_COUNT - 1);
+}
+
+void test_native_alignment() {
+    printf("\n== Native Alignment Test ==\n");
+    size_t alignments[] = {32, 64, 256, 1024, 4096, 32768};
+    size_t sizes[] = {1, 64, 100, 1000, 4096, 20000};
+    for (size_t i = 0; i < sizeof(alignments) / sizeof(alignments[0]); i++) {
+        for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+            unsigned char *p = _aligned_alloc(alignments[i], sizes[j]);
+            if (!p || (uintptr_t)p % alignments[i] || _malloc_usable_size(p) < sizes[j]) {
+                fprintf(stderr, "Error: %zu bytes at %zu alignment are wrong\n", sizes[j], alignments[i]);
+                exit(EXIT_FAILURE);
+            }
+            memset(p, 0xa5, sizes[j]);
+            _free(p);
+        }
+    }
+    void *line = _aligned_alloc(64, 64);
+    void *page = _aligned_alloc(4096, 4096);
+    if (!is_slab_ptr(line) || _malloc_usable_size(line) != 64
+        || !is_slab_ptr(page) || _malloc_usable_size(page) != 4096) {
+        fprintf(stderr, "Error: Aligned buffers were over-allocated\n");
+        exit(EXIT_FAILURE);
+    }
+    void *again = _aligned_alloc(4096, 4096);
+    if ((char *)again - (char *)page != 4096 && (char *)page - (char *)again != 4096) {
+        fprintf(stderr, "Error: Page aligned buffers are not packed\n");
+        exit(EXIT_FAILURE);
+    }
+    void *large = _aligned_alloc(4096, 300000);
+    if (!large || (uintptr_t)large % 4096 || block_from_ptr(large)->aligned_address != large) {
+        fprintf(stderr, "Error: Large page aligned block is not native\n");
+        exit(EXIT_FAILURE);
+    }
+    void *small = _realloc(again, 100);
+    if (!is_slab_ptr(small) || slab_class(small) >= BIN_COUNT) {
+        fprintf(stderr, "Error: Shrunk aligned slot did not move to a bin\n");
+        exit(EXIT_FAILURE);
+    }
+    _free_sized(small, 100);
+    _free(large);
+    _free_aligned_sized(page, 4096, 4096);
+    _free(line);
+    printf("Native alignment test passed.\n");
+}
+
+struct test_node {
+    struct test_node *left;
+    struct test_node *right;
+    long key;
+    long value;
+    int color;
+};
+
+void test_constant_malloc() {
+    printf("\n== Constant Size Malloc Test ==\n");
+    struct test_node *node = _malloc(sizeof(struct test_node));
+    if (!node || !is_slab_ptr(node) || slab_class(node) != BIN_INDEX(sizeof(struct test_node))
+        || _malloc_usable_size(node) != block_size[BIN_INDEX(sizeof(struct test_node))]) {
+        fprintf(stderr, "Error: Constant size did not take its bin\n");
+        exit(EXIT_FAILURE);
+    }
+    node->left = node->right = NULL;
+    _free(node);
+    struct test_node *again = _malloc(sizeof(struct test_node));
+    if (again != node) {
+        fprintf(stderr, "Error: Constant size did not pop the thread cache\n");
+        exit(EXIT_FAILURE);
+    }
+    _free(again);
+    size_t size = sizeof(struct test_node);
+    void *runtime = _malloc(size);
+    if (runtime != node) {
+        fprintf(stderr, "Error: Constant and runtime sizes use different bins\n");
+        exit(EXIT_FAILURE);
+    }
+    _free(runtime);
+    void *ptrs[4] = {_malloc(1), _malloc(BIN_MAX_SIZE), _malloc(BIN_MAX_SIZE + 1), _malloc(0)};
+    if (!ptrs[0] || _malloc_usable_size(ptrs[0]) != ALIGNMENT || !ptrs[1] || !is_slab_ptr(ptrs[1])
+        || !ptrs[2] || _malloc_usable_size(ptrs[2]) <= BIN_MAX_SIZE || ptrs[3]) {
+        fprintf(stderr, "Error: Constant size edges are wrong\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < 4; i++)
+        _free(ptrs[i]);
+    printf("Constant size malloc test passed.\n");
+}
+
+typedef void *(*copy_fn)(void *, const void *, size_t);
+typedef void *(*fill_fn)(void *, int, size_t);
+
+void test_memory_kernels() {
+    printf("\n== Copy And Fill Kernels Test ==\n");
+    size_t sizes[] = {0, 1, 7, 15, 16, 31, 33, 63, 64, 65, 127, 200, 255, 513, 4095, 70000, 1 << 20};
+    copy_fn copies[] = {_memcpy, _memcpy_ERMS, _memcpy_nt, NULL, NULL};
+    fill_fn fills[] = {_memset, _memset_ERMS, _memset_nt, NULL, NULL};
+    size_t max = (1 << 20) + 128;
+    unsigned char *src = malloc(max), *dst = malloc(max), *ref = malloc(max);
+
+    cpu_features_init();
+    if (cpu_features.avx2) {
+        copies[3] = _memcpy_avx;
+        fills[3] = _memset_avx;
+    }
+    if (cpu_features.avx512) {
+        copies[4] = _memcpy_avx512;
+        fills[4] = _memset_avx512;
+    }
+    for (size_t i = 0; i < max; i++)
+        src[i] = (unsigned char)(i * 7 + 3);
+    for (int k = 0; k < 5; k++) {
+        if (!copies[k])
+            continue;
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            for (size_t off = 0; off < 64; off += 13) {
+                memset(dst, 0xEE, max);
+                memset(ref, 0xEE, max);
+                memcpy(ref + off, src + 64 - off, sizes[i]);
+                copies[k](dst + off, src + 64 - off, sizes[i]);
+                if (memcmp(dst, ref, max)) {
+                    fprintf(stderr, "Error: Copy kernel %d wrong for %zu bytes at offset %zu\n", k, sizes[i], off);
+                    exit(EXIT_FAILURE);
+                }
+                memset(ref + off, 0x5A, sizes[i]);
+                fills[k](dst + off, 0x5A, sizes[i]);
+                if (memcmp(dst, ref, max)) {
+                    fprintf(stderr, "Error: Fill kernel %d wrong for %zu bytes at offset %zu\n", k, sizes[i], off);
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+    }
+    free(src);
+    free(dst);
+    free(ref);
+    printf("Copy and fill kernels test passed (erms %d, fsrm %d, avx2 %d, avx512 %d).\n",
+           cpu_features.erms, cpu_features.fsrm, cpu_features.avx2, cpu_features.avx512);
+}
+
+void test_calloc() {
+    printf("\n== Calloc Test ==\n");
+    size_t sizes[] = {24, 200, 3000, 60000, 2 * MMAP_THRESHOLD};
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (int round = 0; round < 2; round++) {
+            unsigned char *p = _calloc(sizes[i], 1);
+            if (!p) {
+                fprintf(stderr, "Error: Calloc of %zu bytes failed\n", sizes[i]);
+                exit(EXIT_FAILURE);
+            }
+            for (size_t j = 0; j < sizes[i]; j++) {
+                if (p[j]) {
+                    fprintf(stderr, "Error: Calloc memory not zeroed at offset %zu\n", j);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            memset(p, 0xCC, sizes[i]);
+            _free(p);
+        }
+    }
+    if (_calloc(SIZE_MAX / 2, 4) != NULL || errno != ENOMEM) {
+        fprintf(stderr, "Error: Calloc overflow not detected\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("Calloc test passed.\n");
+}
+
 int is_in_mapped_heap(void *addr) {
     uintptr_t start, end;
     char line[256];
@@ -257,8 +1379,10 @@ int main() {
     printf("Deallocation successful for ptr_aligned\n\n");
 
     printf("===== Memory Leak Check =====\n\n");
-    printf("Number of blocks allocated: %d\n", allocated_blocks);
-    if (allocated_blocks == 0)
+    struct malloc_stats stats;
+    _malloc_stats(&stats);
+    printf("Number of blocks allocated: %lu\n", (unsigned long)stats.live);
+    if (stats.live == 0)
         printf("No memory leaks detected\n");
     else
         printf("Memory leak detected\n");
@@ -338,6 +1462,35 @@ int main() {
 	test_alignment();
 	test_large_allocations();
 	test_small_allocations();
+	test_threads();
+	test_realloc();
+	test_calloc();
+	test_stats();
+	test_profile();
+	test_trim();
+	test_hugepages();
+	test_mapcache();
+
+	test_config();
+	test_dense_slots();
+	test_pagemap();
+	test_arena();
+	test_object_pool();
+	test_native_alignment();
+	test_constant_malloc();
+	test_trace();
+	test_trace_restart();
+	test_frag_report();
+
+	test_remote_free();
+
+	test_remote_burst();
+
+	test_batch();
+
+	test_free_sized();
+
+	test_memory_kernels();
 
 	test_alignment();
 
@@ -1,84 +1,90 @@
 #include "include.h"
 
 Block  __attribute__((visibility("hidden")))*freelist = NULL;
-int  __attribute__((visibility("hidden")))allocated_blocks = 0;
-size_t  __attribute__((visibility("hidden")))block_size[] = {16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256};
-Block  __attribute__((visibility("hidden")))*bins[BIN_COUNT] = {NULL};
+Block  __attribute__((visibility("hidden")))*heap_tail = NULL;
+size_t  __attribute__((visibility("hidden")))block_size[] = {16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256,
+                                                       512, 1024, 2048, 4096, 8192, 16384, 32768};
+pthread_mutex_t  __attribute__((visibility("hidden")))heap_lock = PTHREAD_MUTEX_INITIALIZER;
 Block *is_mmap = NULL;
 
 
 /*
-	* this is the custom malloc function
-	* size: size of the memory to be allocated
-	* Returns: pointer to the allocated memory
-*/	
+	* first fit over the heap blocks, the heap lock must be held
+	* size: size of the memory to be allocated, already aligned
+	* the block is split when the remainder can hold another block
+	* a new chunk is requested when nothing fits
+	* Returns: the block, marked as used
+*/
 
-void *_realloc(void *ptr, size_t new_size) 
+Block *heap_alloc_block(size_t size) 
 {
-    if (new_size == 0) 
+    Block *block = freelist;
+
+    while (block && !(block->free && block->size >= size))
+        block = block->next;
+    if (block) 
 	{
-        _free(ptr);
-        return NULL;
+        if (block->size >= size + BLOCK_SIZE + ALIGNMENT)
+            split_block(block, size, ALIGNMENT);
+        block->free = 0;
+        return block;
     }
-    if (ptr == NULL) 
-        return _malloc(new_size);
-
-    Block *block = (Block *)((uintptr_t)ptr - sizeof(Block));
-    
-    if (block->size >= new_size) 
-        return ptr;
-
-    void *new_ptr = _malloc(new_size);
-    if (new_ptr == NULL)
-        return NULL; 
-	allocated_blocks++;
-    memcpy(new_ptr, ptr, block->size);
-    _free(ptr);
-
-    return new_ptr;
+    block = request_space(heap_tail, size, ALIGNMENT);
+    if (!block)
+        return NULL;
+    heap_tail = block->next ? block->next : block;
+    return block;
 }
 
+/*
+	* this is the custom malloc function
+	* size: size of the memory to be allocated
+	* the profiler countdown is charged first, prof_malloc takes the sampled calls
+	* the name is in parentheses to keep the constant size macro of include.h out of it
+	* Returns: pointer to the allocated memory
+*/	
+
 __attribute__((hot, flatten, always_inline))
-inline void *_malloc(size_t size) 
+inline void *(_malloc)(size_t size) 
 {
     if (__builtin_expect(size == 0, 0))
         return NULL;
-    size = __builtin_align_up(size, ALIGNMENT); 
-    Block *block = NULL;
+    if (__builtin_expect((tcache.prof_countdown -= size) < 0, 0))
+        return prof_malloc(size);
     if (size <= BIN_MAX_SIZE) 
 	{
-        int bin_index = size / ALIGNMENT - 1;
-        if (bin_index >= 0 && bin_index < BIN_COUNT && bins[bin_index]) 
+        int bin_index = (size - 1) / ALIGNMENT;
+        STAT_ADD(tcache.stats.requested[bin_index], size);
+        void *ptr = tcache.bins[bin_index];
+        if (__builtin_expect(ptr != NULL, 1)) 
 		{
-            Block *block = bins[bin_index];
-            bins[bin_index] = block->next;
-            block->free = 0;
-            return block->aligned_address;
+            tcache.bins[bin_index] = *(void **)ptr;
+            tcache.counts[bin_index]--;
+            STAT_ADD(tcache.stats.nmalloc[bin_index], 1);
+            return ptr;
         }
+        return tcache_refill(bin_index);
     }
 
+    size = __builtin_align_up(size, ALIGNMENT); 
+    if (size <= POOL_MAX_SIZE) 
+	{
+        void *ptr = find_free_block(size, ALIGNMENT);
+        if (__builtin_expect(ptr != NULL, 1))
+            return ptr;
+    }
     if (size >= MMAP_THRESHOLD)
         return request_space_mmap(size, ALIGNMENT);
-    else 
-	{
-		if (!freelist) 
-		{
-			block = request_space(NULL, size, ALIGNMENT);
-			freelist = block;
-		} 
-		else 
-		{
-			Block *last = freelist;
-			block = find_free_block(size, ALIGNMENT);
-			if (block) {
-				if (block->size >= size + BLOCK_SIZE)
-					split_block(block, size, ALIGNMENT);
-				block->free = 0;
-			} 
-			else
-				block = request_space(last, size, ALIGNMENT);
-		}
+
+    pthread_mutex_lock(&heap_lock);
+    Block *block = heap_alloc_block(size);
+    if (block)
+    {
+        STAT_ADD(alloc_stats.heap_nmalloc, 1);
+        STAT_ADD(alloc_stats.heap_allocated, block->size);
     }
+    pthread_mutex_unlock(&heap_lock);
+    if (!block)
+        return NULL;
     return __builtin_assume_aligned(block->aligned_address, ALIGNMENT);
 }
-
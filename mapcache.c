@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include "include.h"
+
+/*
+	* cache of the mappings released by large blocks
+	* _free parks the mapping of a BLOCK_MMAP block here instead of unmapping it,
+	* request_space_mmap looks here before it maps, so a large buffer allocated and
+	* freed in a loop costs no syscall and no page fault after the first round
+	* mappings are bucketed by the power of two of their length, a request takes one
+	* from its own bucket, resized with mremap when the length differs, or a larger one
+	* from the next bucket, trimmed with mremap
+	* when both are empty it takes the smallest mapping of the first higher bucket that has
+	* one, shrunk in place with mremap, as long as it is at most MAPCACHE_MAX_SHRINK times
+	* the length, the tail goes back to the kernel
+	* the cache holds at most MAPCACHE_MAX_BYTES, the oldest mappings are unmapped first,
+	* and a mapping is unmapped once its decay is over (see decay.c)
+	* the bookkeeping lives in the first bytes of the cached mapping itself
+	* MAPCACHE_MAX_ENTRY: larger mappings are never cached
+*/
+
+#define MAPCACHE_BUCKETS 64
+#define MAPCACHE_MAX_BYTES (64 * 1024 * 1024)
+#define MAPCACHE_MAX_ENTRY (MAPCACHE_MAX_BYTES / 4)
+#define MAPCACHE_MAX_SHRINK 16
+
+typedef struct CachedMap {
+	size_t len;
+	uint32_t epoch;
+	struct CachedMap *prev;
+	struct CachedMap *next;
+	struct CachedMap *older;
+	struct CachedMap *newer;
+} CachedMap;
+
+static CachedMap *buckets[MAPCACHE_BUCKETS];
+static CachedMap *oldest;
+static CachedMap *newest;
+static size_t cached_bytes;
+static pthread_mutex_t mapcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+__attribute__((always_inline))
+static inline int bucket_of(size_t len)
+{
+	return 63 - __builtin_clzll(len);
+}
+
+/*
+	* the mapcache lock must be held for link_map, unlink_map and evict_maps
+*/
+
+static void link_map(CachedMap *map)
+{
+	int bucket = bucket_of(map->len);
+
+	map->prev = NULL;
+	map->next = buckets[bucket];
+	if (map->next)
+		map->next->prev = map;
+	buckets[bucket] = map;
+	map->older = newest;
+	map->newer = NULL;
+	if (newest)
+		newest->newer = map;
+	else
+		oldest = map;
+	newest = map;
+	cached_bytes += map->len;
+	STAT_ADD(alloc_stats.mapcache_bytes, map->len);
+}
+
+static void unlink_map(CachedMap *map)
+{
+	if (map->prev)
+		map->prev->next = map->next;
+	else
+		buckets[bucket_of(map->len)] = map->next;
+	if (map->next)
+		map->next->prev = map->prev;
+	if (map->older)
+		map->older->newer = map->newer;
+	else
+		oldest = map->newer;
+	if (map->newer)
+		map->newer->older = map->older;
+	else
+		newest = map->older;
+	cached_bytes -= map->len;
+	STAT_ADD(alloc_stats.mapcache_bytes, -map->len);
+}
+
+/*
+	* take the mappings over budget or past their decay out of the cache, oldest first
+	* all: take every mapping
+	* Returns: the list of the mappings taken, linked through next, to unmap after unlocking
+*/
+
+static CachedMap *evict_maps(uint32_t epoch, int all)
+{
+	CachedMap *evicted = NULL;
+
+	while (oldest && (all || cached_bytes > MAPCACHE_MAX_BYTES || decay_is_due(oldest->epoch, epoch)))
+	{
+		CachedMap *map = oldest;
+		unlink_map(map);
+		map->next = evicted;
+		evicted = map;
+	}
+	return evicted;
+}
+
+static int unmap_evicted(CachedMap *map)
+{
+	int count = 0;
+
+	while (map)
+	{
+		CachedMap *next = map->next;
+		unmap_pages(map, map->len);
+		map = next;
+		count++;
+	}
+	return count;
+}
+
+/*
+	* len: page aligned length of the mapping wanted
+	* Returns: a cached mapping of exactly len bytes, its content is not zero, or NULL
+*/
+
+void *mapcache_get(size_t len)
+{
+	int bucket = bucket_of(len);
+	CachedMap *map = NULL;
+
+	pthread_mutex_lock(&mapcache_lock);
+	CachedMap *evicted = evict_maps(decay_epoch(), 0);
+	for (CachedMap *m = buckets[bucket]; m; m = m->next)
+	{
+		if (!map || m->len == len)
+			map = m;
+		if (m->len == len)
+			break;
+	}
+	if (!map && bucket + 1 < MAPCACHE_BUCKETS)
+		map = buckets[bucket + 1];
+	for (int b = bucket + 2; !map && b < MAPCACHE_BUCKETS && (1ULL << b) <= len * MAPCACHE_MAX_SHRINK; b++)
+		for (CachedMap *m = buckets[b]; m; m = m->next)
+			if (m->len <= len * MAPCACHE_MAX_SHRINK && (!map || m->len < map->len))
+				map = m;
+	if (map)
+		unlink_map(map);
+	pthread_mutex_unlock(&mapcache_lock);
+	unmap_evicted(evicted);
+
+	if (!map)
+	{
+		STAT_ATOMIC_ADD(alloc_stats.mapcache_misses, 1);
+		return NULL;
+	}
+	size_t have = map->len;
+	void *addr = map;
+	if (have != len)
+	{
+		addr = mremap(map, have, len, MREMAP_MAYMOVE);
+		STAT_ATOMIC_ADD(alloc_stats.mremap_calls, 1);
+		if (addr == MAP_FAILED)
+		{
+			unmap_pages(map, have);
+			STAT_ATOMIC_ADD(alloc_stats.mapcache_misses, 1);
+			return NULL;
+		}
+		STAT_ATOMIC_ADD(alloc_stats.mapped, len - have);
+	}
+	STAT_ATOMIC_ADD(alloc_stats.mapcache_hits, 1);
+	return addr;
+}
+
+/*
+	* park a released mapping, addr and len are page aligned
+	* Returns: 1 if the cache took it, 0 if the caller has to unmap it
+*/
+
+int mapcache_put(void *addr, size_t len)
+{
+	if (len > MAPCACHE_MAX_ENTRY)
+		return 0;
+
+	uint32_t epoch = decay_epoch();
+	CachedMap *map = addr;
+
+	pthread_mutex_lock(&mapcache_lock);
+	map->len = len;
+	map->epoch = epoch;
+	link_map(map);
+	CachedMap *evicted = evict_maps(epoch, 0);
+	pthread_mutex_unlock(&mapcache_lock);
+	unmap_evicted(evicted);
+	return 1;
+}
+
+void mapcache_fork_lock()
+{
+	pthread_mutex_lock(&mapcache_lock);
+}
+
+void mapcache_fork_unlock()
+{
+	pthread_mutex_unlock(&mapcache_lock);
+}
+
+/*
+	* unmap every cached mapping, used by _malloc_trim
+	* Returns: 1 if something was unmapped
+*/
+
+int mapcache_flush()
+{
+	pthread_mutex_lock(&mapcache_lock);
+	CachedMap *evicted = evict_maps(0, 1);
+	pthread_mutex_unlock(&mapcache_lock);
+	return unmap_evicted(evicted) != 0;
+}
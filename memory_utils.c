@@ -1,15 +1,432 @@
 #include "include.h"
 
+/*
+	* copy and fill kernels, picked once from CPUID by memory_utils_init
+	* _memcpy and _memset are the entry points used by the allocator:
+	*   n >= nt_threshold: non-temporal stores, the data does not evict the caches
+	*   n >= rep_threshold: rep movsb / rep stosb, fast with ERMS and even for short runs with FSRM
+	*   otherwise the widest vector kernel the CPU has, AVX-512, AVX2 or libc
+	* the library is built without -mavx2, the vector kernels carry their own target
+	* the non-temporal threshold and the prefetch distance come from alloc_config
+*/
+
+CpuFeatures __attribute__((visibility("hidden")))cpu_features = {0};
+
+static struct {
+	int ready;
+	size_t rep_threshold;
+	size_t nt_threshold;
+	size_t line_mask;
+	size_t prefetch_distance;
+	void *(*copy)(void *dest, const void *src, size_t n);
+	void *(*fill)(void *s, int c, size_t n);
+} mem_ops;
+
+/*
+	* CPUID leaf 7: ERMS is ebx bit 9, FSRM is edx bit 4
+	* AVX2 and AVX-512 go through __builtin_cpu_supports, which also checks the OS saves their state
+*/
+
+void cpu_features_init()
+{
+	unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+	__builtin_cpu_init();
+	asm volatile ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (0), "c" (0));
+	if (eax >= 7)
+	{
+		asm volatile ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (7), "c" (0));
+		cpu_features.erms = (ebx >> 9) & 1;
+		cpu_features.fsrm = (edx >> 4) & 1;
+	}
+	cpu_features.avx2 = !!__builtin_cpu_supports("avx2");
+	cpu_features.avx512 = !!__builtin_cpu_supports("avx512f");
+	__atomic_store_n(&cpu_features.ready, 1, __ATOMIC_RELEASE);
+}
+
+/*
+	* copies and fills of less than 32 bytes, with overlapping 16, 8, 4 and 1 byte moves
+*/
+
+__attribute__((always_inline))
+static inline void copy_small(unsigned char *d, const unsigned char *s, size_t n)
+{
+	if (n >= 16)
+	{
+		__m128i head = _mm_loadu_si128((const __m128i *)s);
+		__m128i tail = _mm_loadu_si128((const __m128i *)(s + n - 16));
+		_mm_storeu_si128((__m128i *)d, head);
+		_mm_storeu_si128((__m128i *)(d + n - 16), tail);
+	}
+	else if (n >= 8)
+	{
+		uint64_t head, tail;
+		memcpy(&head, s, 8);
+		memcpy(&tail, s + n - 8, 8);
+		memcpy(d, &head, 8);
+		memcpy(d + n - 8, &tail, 8);
+	}
+	else if (n >= 4)
+	{
+		uint32_t head, tail;
+		memcpy(&head, s, 4);
+		memcpy(&tail, s + n - 4, 4);
+		memcpy(d, &head, 4);
+		memcpy(d + n - 4, &tail, 4);
+	}
+	else
+		while (n--)
+			*d++ = *s++;
+}
+
+__attribute__((always_inline))
+static inline void fill_small(unsigned char *p, int c, size_t n)
+{
+	if (n >= 16)
+	{
+		__m128i v = _mm_set1_epi8((char)c);
+		_mm_storeu_si128((__m128i *)p, v);
+		_mm_storeu_si128((__m128i *)(p + n - 16), v);
+	}
+	else
+		while (n--)
+			*p++ = (unsigned char)c;
+}
+
 __attribute__((always_inline, hot))
-inline void *_memcpy_ERMS(void *dest, const void *src, size_t n) 
+inline void *_memcpy_ERMS(void *dest, const void *src, size_t n)
 {
-	__asm__ __volatile__ 
+	void *ret = dest;
+	__asm__ __volatile__
     (
 		"rep movsb"
 		: "+D"(dest), "+S"(src), "+c"(n)
 		:
 		: "memory"
 	);
+	return ret;
+}
+
+__attribute__((hot))
+void *_memset_ERMS(void *s, int c, size_t n)
+{
+	void *ret = s;
+	__asm__ __volatile__
+	(
+		"rep stosb"
+		: "+D"(s), "+c"(n)
+		: "a"(c)
+		: "memory"
+	);
+	return ret;
+}
+
+/*
+	* AVX2 memcpy
+	* the first and last 32 bytes are loaded up front and stored unaligned,
+	* the body goes through aligned 32 byte stores, four per iteration
+*/
+
+__attribute__((hot, target("avx2")))
+void *_memcpy_avx(void *dest, const void *src, size_t n)
+{
+	unsigned char *d = dest;
+	const unsigned char *s = src;
+
+	if (n < 32)
+	{
+		copy_small(d, s, n);
+		return dest;
+	}
+	__m256i head = _mm256_loadu_si256((const __m256i *)s);
+	__m256i tail = _mm256_loadu_si256((const __m256i *)(s + n - 32));
+	unsigned char *end = d + n - 32;
+	size_t skip = align_up((uintptr_t)d + 1, 32) - (uintptr_t)d;
+
+	d += skip;
+	s += skip;
+	while (d + 128 <= end)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i *)s);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+		__m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+		_mm256_store_si256((__m256i *)d, a);
+		_mm256_store_si256((__m256i *)(d + 32), b);
+		_mm256_store_si256((__m256i *)(d + 64), c);
+		_mm256_store_si256((__m256i *)(d + 96), e);
+		d += 128;
+		s += 128;
+	}
+	while (d < end)
+	{
+		_mm256_store_si256((__m256i *)d, _mm256_loadu_si256((const __m256i *)s));
+		d += 32;
+		s += 32;
+	}
+	_mm256_storeu_si256((__m256i *)dest, head);
+	_mm256_storeu_si256((__m256i *)end, tail);
+	return dest;
+}
+
+/*
+	* AVX2 memset
+	* the head and the tail are written with unaligned stores,
+	* the body with aligned 32 byte stores, four per iteration
+*/
+
+__attribute__((hot, target("avx2")))
+void *_memset_avx(void *s, int c, size_t n)
+{
+	unsigned char *p = s;
+
+	if (n < 32)
+	{
+		fill_small(p, c, n);
+		return s;
+	}
+	__m256i v = _mm256_set1_epi8((char)c);
+	unsigned char *end = p + n;
+
+	_mm256_storeu_si256((__m256i *)p, v);
+	_mm256_storeu_si256((__m256i *)(end - 32), v);
+	p = (unsigned char *)align_up((uintptr_t)p + 1, 32);
+	while (p + 128 <= end)
+	{
+		_mm256_store_si256((__m256i *)p, v);
+		_mm256_store_si256((__m256i *)(p + 32), v);
+		_mm256_store_si256((__m256i *)(p + 64), v);
+		_mm256_store_si256((__m256i *)(p + 96), v);
+		p += 128;
+	}
+	while (p + 32 <= end)
+	{
+		_mm256_store_si256((__m256i *)p, v);
+		p += 32;
+	}
+	return s;
+}
+
+/*
+	* AVX-512 versions of the two kernels above, 64 byte vectors
+*/
+
+__attribute__((hot, target("avx512f")))
+void *_memcpy_avx512(void *dest, const void *src, size_t n)
+{
+	unsigned char *d = dest;
+	const unsigned char *s = src;
+
+	if (n < 64)
+	{
+		if (n < 32)
+			copy_small(d, s, n);
+		else
+		{
+			__m256i head = _mm256_loadu_si256((const __m256i *)s);
+			__m256i tail = _mm256_loadu_si256((const __m256i *)(s + n - 32));
+			_mm256_storeu_si256((__m256i *)d, head);
+			_mm256_storeu_si256((__m256i *)(d + n - 32), tail);
+		}
+		return dest;
+	}
+	__m512i head = _mm512_loadu_si512(s);
+	__m512i tail = _mm512_loadu_si512(s + n - 64);
+	unsigned char *end = d + n - 64;
+	size_t skip = align_up((uintptr_t)d + 1, 64) - (uintptr_t)d;
+
+	d += skip;
+	s += skip;
+	while (d + 256 <= end)
+	{
+		__m512i a = _mm512_loadu_si512(s);
+		__m512i b = _mm512_loadu_si512(s + 64);
+		__m512i c = _mm512_loadu_si512(s + 128);
+		__m512i e = _mm512_loadu_si512(s + 192);
+		_mm512_store_si512(d, a);
+		_mm512_store_si512(d + 64, b);
+		_mm512_store_si512(d + 128, c);
+		_mm512_store_si512(d + 192, e);
+		d += 256;
+		s += 256;
+	}
+	while (d < end)
+	{
+		_mm512_store_si512(d, _mm512_loadu_si512(s));
+		d += 64;
+		s += 64;
+	}
+	_mm512_storeu_si512(dest, head);
+	_mm512_storeu_si512(end, tail);
+	return dest;
+}
+
+__attribute__((hot, target("avx512f")))
+void *_memset_avx512(void *s, int c, size_t n)
+{
+	unsigned char *p = s;
+
+	if (n < 64)
+	{
+		if (n < 32)
+			fill_small(p, c, n);
+		else
+		{
+			__m256i v = _mm256_set1_epi8((char)c);
+			_mm256_storeu_si256((__m256i *)p, v);
+			_mm256_storeu_si256((__m256i *)(p + n - 32), v);
+		}
+		return s;
+	}
+	__m512i v = _mm512_set1_epi32((unsigned char)c * 0x01010101u);
+	unsigned char *end = p + n;
+
+	_mm512_storeu_si512(p, v);
+	_mm512_storeu_si512(end - 64, v);
+	p = (unsigned char *)align_up((uintptr_t)p + 1, 64);
+	while (p + 256 <= end)
+	{
+		_mm512_store_si512(p, v);
+		_mm512_store_si512(p + 64, v);
+		_mm512_store_si512(p + 128, v);
+		_mm512_store_si512(p + 192, v);
+		p += 256;
+	}
+	while (p + 64 <= end)
+	{
+		_mm512_store_si512(p, v);
+		p += 64;
+	}
+	return s;
+}
+
+static void memory_utils_init();
+
+__attribute__((always_inline))
+static inline void mem_ops_check()
+{
+	if (__builtin_expect(!__atomic_load_n(&mem_ops.ready, __ATOMIC_ACQUIRE), 0))
+		memory_utils_init();
+}
+
+/*
+	* non-temporal copy and fill for buffers larger than the last level cache
+	* streaming stores go around the caches, the destination is aligned to a line first
+	* the copy prefetches its source prefetch_distance bytes ahead
+	* SSE2 is enough here, the stores are bound by memory bandwidth, not by vector width
+*/
+
+__attribute__((hot))
+void *_memcpy_nt(void *dest, const void *src, size_t n)
+{
+	mem_ops_check();
+	unsigned char *d = dest;
+	const unsigned char *s = src;
+	size_t head = -(uintptr_t)d & mem_ops.line_mask;
+	size_t ahead = mem_ops.prefetch_distance;
+
+	if (n < head + 64)
+		return mem_ops.copy(dest, src, n);
+	mem_ops.copy(d, s, head);
+	d += head;
+	s += head;
+	n -= head;
+	while (n >= 64)
+	{
+		if (n > ahead)
+			_mm_prefetch((const char *)s + ahead, _MM_HINT_NTA);
+		__m128i a = _mm_loadu_si128((const __m128i *)s);
+		__m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+		__m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+		_mm_stream_si128((__m128i *)d, a);
+		_mm_stream_si128((__m128i *)(d + 16), b);
+		_mm_stream_si128((__m128i *)(d + 32), c);
+		_mm_stream_si128((__m128i *)(d + 48), e);
+		d += 64;
+		s += 64;
+		n -= 64;
+	}
+	_mm_sfence();
+	mem_ops.copy(d, s, n);
 	return dest;
 }
 
+__attribute__((hot))
+void *_memset_nt(void *s, int c, size_t n)
+{
+	mem_ops_check();
+	unsigned char *p = s;
+	size_t head = -(uintptr_t)p & mem_ops.line_mask;
+	__m128i v = _mm_set1_epi8((char)c);
+
+	if (n < head + 64)
+		return mem_ops.fill(s, c, n);
+	mem_ops.fill(p, c, head);
+	p += head;
+	n -= head;
+	while (n >= 64)
+	{
+		_mm_stream_si128((__m128i *)p, v);
+		_mm_stream_si128((__m128i *)(p + 16), v);
+		_mm_stream_si128((__m128i *)(p + 32), v);
+		_mm_stream_si128((__m128i *)(p + 48), v);
+		p += 64;
+		n -= 64;
+	}
+	_mm_sfence();
+	mem_ops.fill(p, c, n);
+	return s;
+}
+
+/*
+	* pick the kernels and thresholds for this CPU
+	* FSRM makes rep movsb fast from short sizes, plain ERMS from about 2 KiB
+*/
+
+static void memory_utils_init()
+{
+	if (!cpu_features.ready)
+		cpu_features_init();
+	alloc_config_init();
+
+	mem_ops.copy = memcpy;
+	mem_ops.fill = memset;
+	if (cpu_features.avx512)
+	{
+		mem_ops.copy = _memcpy_avx512;
+		mem_ops.fill = _memset_avx512;
+	}
+	else if (cpu_features.avx2)
+	{
+		mem_ops.copy = _memcpy_avx;
+		mem_ops.fill = _memset_avx;
+	}
+	mem_ops.rep_threshold = cpu_features.fsrm ? 256 : cpu_features.erms ? 2048 : SIZE_MAX;
+	mem_ops.nt_threshold = alloc_config.nt_threshold;
+	mem_ops.line_mask = alloc_config.line_size - 1;
+	mem_ops.prefetch_distance = alloc_config.prefetch_distance;
+	__atomic_store_n(&mem_ops.ready, 1, __ATOMIC_RELEASE);
+}
+
+__attribute__((hot))
+void *_memcpy(void *dest, const void *src, size_t n)
+{
+	mem_ops_check();
+	if (n >= mem_ops.nt_threshold)
+		return _memcpy_nt(dest, src, n);
+	if (n >= mem_ops.rep_threshold)
+		return _memcpy_ERMS(dest, src, n);
+	return mem_ops.copy(dest, src, n);
+}
+
+__attribute__((hot))
+void *_memset(void *s, int c, size_t n)
+{
+	mem_ops_check();
+	if (n >= mem_ops.nt_threshold)
+		return _memset_nt(s, c, n);
+	if (n >= mem_ops.rep_threshold)
+		return _memset_ERMS(s, c, n);
+	return mem_ops.fill(s, c, n);
+}
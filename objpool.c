@@ -0,0 +1,297 @@
+#include "include.h"
+
+/*
+	* pools of fixed size objects, for hot types such as connections or tree nodes
+	* the objects of a pool sit back to back in spans mapped for it alone, away from
+	* the fragmentation of the general heap, and carry no header
+	* each thread caches free objects of up to OBJPOOL_CACHE_SLOTS pools in singly linked
+	* lists like the bins of the thread cache, a pool takes the slot id % OBJPOOL_CACHE_SLOTS
+	* and evicts the pool that held it, alloc and free only take the pool lock to move
+	* a batch of OBJPOOL_BATCH objects
+	* the objects of a pool go back to _pool_free of that pool, never to _free
+	* pools live as long as the process, they are linked so fork can hold their locks
+*/
+
+#define OBJCACHE_UNINIT 0
+#define OBJCACHE_ACTIVE 1
+#define OBJCACHE_DEAD 2
+
+typedef struct ObjectCache {
+	ObjectPool *pool;
+	void *list;
+	int count;
+} ObjectCache;
+
+static __thread ObjectCache object_caches[OBJPOOL_CACHE_SLOTS] __attribute__((tls_model("initial-exec")));
+static __thread int object_cache_state __attribute__((tls_model("initial-exec")));
+
+static unsigned int next_pool_id;
+static ObjectPool *object_pools;
+static pthread_mutex_t object_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t object_cache_key;
+static pthread_once_t object_cache_once = PTHREAD_ONCE_INIT;
+
+/*
+	* create a pool of objects of obj_size bytes
+	* align: power of two up to a page, 0 for ALIGNMENT, at least the size of a pointer
+	*   since a free object holds the link of its list
+	* Returns: the pool, NULL on a bad argument or when no memory is left
+*/
+
+ObjectPool *_pool_create(size_t obj_size, size_t align)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	if (!align)
+		align = ALIGNMENT;
+	if (obj_size == 0 || (align & (align - 1)) || align > page_size || obj_size > SIZE_MAX / OBJPOOL_BATCH)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	ObjectPool *pool = _aligned_alloc(CACHE_LINE_SIZE, sizeof(ObjectPool));
+	if (!pool)
+		return NULL;
+	pool->size = align_up(obj_size, align);
+	pool->span_size = OBJPOOL_SPAN_PAGES * page_size;
+	if (pool->span_size < pool->size * OBJPOOL_BATCH)
+		pool->span_size = align_up(pool->size * OBJPOOL_BATCH, page_size);
+	pool->id = __atomic_fetch_add(&next_pool_id, 1, __ATOMIC_RELAXED);
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->free = NULL;
+	pool->bump = NULL;
+	pool->limit = NULL;
+	pthread_mutex_lock(&object_pools_lock);
+	pool->next = object_pools;
+	object_pools = pool;
+	pthread_mutex_unlock(&object_pools_lock);
+	return pool;
+}
+
+/*
+	* the list of pools stays locked until objpool_fork_unlock, no pool is created meanwhile
+*/
+
+void objpool_fork_lock()
+{
+	pthread_mutex_lock(&object_pools_lock);
+	for (ObjectPool *pool = object_pools; pool; pool = pool->next)
+		pthread_mutex_lock(&pool->lock);
+}
+
+void objpool_fork_unlock()
+{
+	for (ObjectPool *pool = object_pools; pool; pool = pool->next)
+		pthread_mutex_unlock(&pool->lock);
+	pthread_mutex_unlock(&object_pools_lock);
+}
+
+/*
+	* hand count objects of the list, already linked, back to the shared list of pool
+	* Returns: the rest of the list
+*/
+
+static void *pool_release(ObjectPool *pool, void *list, int count)
+{
+	void *first = list;
+	void *last = list;
+
+	while (--count && *(void **)last)
+		last = *(void **)last;
+	list = *(void **)last;
+	pthread_mutex_lock(&pool->lock);
+	*(void **)last = pool->free;
+	pool->free = first;
+	pthread_mutex_unlock(&pool->lock);
+	return list;
+}
+
+static void object_cache_flush(ObjectCache *cache)
+{
+	if (cache->list)
+		pool_release(cache->pool, cache->list, -1);
+	cache->pool = NULL;
+	cache->list = NULL;
+	cache->count = 0;
+}
+
+/*
+	* called by pthread when the thread exits, every cached object goes back to its pool
+	* later calls from other destructors bypass the cache
+*/
+
+static void object_cache_destroy(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < OBJPOOL_CACHE_SLOTS; i++)
+		if (object_caches[i].pool)
+			object_cache_flush(&object_caches[i]);
+	object_cache_state = OBJCACHE_DEAD;
+}
+
+static void object_cache_create_key()
+{
+	pthread_key_create(&object_cache_key, object_cache_destroy);
+}
+
+/*
+	* give the cache slot of pool to it, the pool holding the slot hands its objects back
+	* the first claim of a thread sets up the key that flushes its caches on exit
+	* Returns: the slot, NULL once the thread has exited
+*/
+
+static ObjectCache *object_cache_claim(ObjectPool *pool)
+{
+	ObjectCache *cache = &object_caches[pool->id % OBJPOOL_CACHE_SLOTS];
+
+	if (object_cache_state != OBJCACHE_ACTIVE)
+	{
+		if (object_cache_state == OBJCACHE_DEAD)
+			return NULL;
+		pthread_once(&object_cache_once, object_cache_create_key);
+		pthread_setspecific(object_cache_key, object_caches);
+		object_cache_state = OBJCACHE_ACTIVE;
+	}
+	if (cache->pool != pool)
+	{
+		if (cache->pool)
+			object_cache_flush(cache);
+		cache->pool = pool;
+	}
+	return cache;
+}
+
+/*
+	* take up to count objects from pool, freed ones first, then carved from its spans
+	* carved objects head the list in address order, a new span is mapped when the last
+	* one is used up
+	* the pool lock must be held
+	* Returns: the number of objects pushed on list
+*/
+
+static int pool_take(ObjectPool *pool, int count, void **list)
+{
+	int n = 0;
+
+	while (n < count && pool->free)
+	{
+		void *ptr = pool->free;
+		pool->free = *(void **)ptr;
+		*(void **)ptr = *list;
+		*list = ptr;
+		n++;
+	}
+	while (n < count)
+	{
+		if ((size_t)(pool->limit - pool->bump) < pool->size)
+		{
+			unsigned char *span = map_pages(pool->span_size);
+			if (!span)
+				break;
+			pool->bump = span;
+			pool->limit = span + pool->span_size;
+		}
+		size_t run = (pool->limit - pool->bump) / pool->size;
+		if (run > (size_t)(count - n))
+			run = count - n;
+		unsigned char *last = pool->bump + (run - 1) * pool->size;
+		*(void **)last = *list;
+		for (unsigned char *ptr = pool->bump; ptr < last; ptr += pool->size)
+			*(void **)ptr = ptr + pool->size;
+		*list = pool->bump;
+		pool->bump = last + pool->size;
+		n += run;
+	}
+	return n;
+}
+
+/*
+	* slow path of _pool_alloc, the cache of this thread holds no object of pool
+*/
+
+__attribute__((noinline))
+static void *pool_refill(ObjectPool *pool)
+{
+	ObjectCache *cache = object_cache_claim(pool);
+	int batch = cache ? OBJPOOL_BATCH : 1;
+	void *list = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	int count = pool_take(pool, batch, &list);
+	pthread_mutex_unlock(&pool->lock);
+	if (!list)
+		return NULL;
+	void *ptr = list;
+	if (cache)
+	{
+		cache->list = *(void **)ptr;
+		cache->count = count - 1;
+	}
+	return ptr;
+}
+
+/*
+	* Returns: an object of pool, NULL if no memory is left
+*/
+
+__attribute__((hot))
+void *_pool_alloc(ObjectPool *pool)
+{
+	ObjectCache *cache = &object_caches[pool->id % OBJPOOL_CACHE_SLOTS];
+	void *ptr = cache->list;
+
+	if (__builtin_expect(cache->pool == pool && ptr != NULL, 1))
+	{
+		cache->list = *(void **)ptr;
+		cache->count--;
+		return ptr;
+	}
+	return pool_refill(pool);
+}
+
+/*
+	* slow path of _pool_free, the slot of pool belongs to another pool or the thread
+	* has exited, then the object goes straight back to the pool
+*/
+
+__attribute__((noinline))
+static void pool_free_slow(ObjectPool *pool, void *ptr)
+{
+	ObjectCache *cache = object_cache_claim(pool);
+
+	if (!cache)
+	{
+		pool_release(pool, ptr, 1);
+		return;
+	}
+	*(void **)ptr = cache->list;
+	cache->list = ptr;
+	cache->count++;
+}
+
+/*
+	* hand ptr back to pool, a full cache hands OBJPOOL_BATCH objects back
+*/
+
+__attribute__((hot))
+void _pool_free(ObjectPool *pool, void *ptr)
+{
+	ObjectCache *cache = &object_caches[pool->id % OBJPOOL_CACHE_SLOTS];
+
+	if (!ptr)
+		return;
+	if (__builtin_expect(cache->pool != pool, 0))
+	{
+		pool_free_slow(pool, ptr);
+		return;
+	}
+	*(void **)ptr = cache->list;
+	cache->list = ptr;
+	if (__builtin_expect(++cache->count > OBJPOOL_CACHE_MAX, 0))
+	{
+		cache->list = pool_release(pool, cache->list, OBJPOOL_BATCH);
+		cache->count -= OBJPOOL_BATCH;
+	}
+}
@@ -0,0 +1,70 @@
+#include "include.h"
+
+#define PAGEMAP_LEAF_SIZE ((1UL << PAGEMAP_LEAF_BITS) * sizeof(uintptr_t))
+
+/*
+	* the root covers the whole 48-bit address space, it is zero until a leaf is installed
+	* the root is zero-filled bss, only the pages of the root slots in use get touched
+*/
+
+uintptr_t __attribute__((visibility("hidden")))*pagemap_root[1UL << PAGEMAP_ROOT_BITS];
+
+/*
+	* leaf covering addr, mapped on first use
+	* the leaf is reserved without swap, only the pages of its entries in use get touched
+	* two threads may race for the same slot, the loser unmaps its leaf
+	* Returns: the leaf, NULL if it could not be mapped
+*/
+
+static uintptr_t *pagemap_leaf(uintptr_t addr)
+{
+	uintptr_t **slot = &pagemap_root[addr >> (PAGEMAP_PAGE_SHIFT + PAGEMAP_LEAF_BITS)];
+	uintptr_t *leaf = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+	if (leaf)
+		return leaf;
+	leaf = mmap(NULL, PAGEMAP_LEAF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	STAT_ATOMIC_ADD(alloc_stats.mmap_calls, 1);
+	if (leaf == MAP_FAILED)
+		return NULL;
+	uintptr_t *expected = NULL;
+	if (!__atomic_compare_exchange_n(slot, &expected, leaf, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		munmap(leaf, PAGEMAP_LEAF_SIZE);
+		STAT_ATOMIC_ADD(alloc_stats.munmap_calls, 1);
+		return expected;
+	}
+	return leaf;
+}
+
+/*
+	* set the entry of every page of addr..addr+size
+	* entry: base of the mapping tagged with PAGEMAP_HEAP, PAGEMAP_MMAP or PAGEMAP_POOL,
+	*   0 when the range is handed back, clearing never maps a leaf
+	* the caller owns the range, no lock is needed, other threads only read the entries
+	*   of pages they were handed
+	* Returns: 1 on success, 0 if a leaf could not be mapped
+*/
+
+int pagemap_set(void *addr, size_t size, uintptr_t entry)
+{
+	uintptr_t page = (uintptr_t)addr >> PAGEMAP_PAGE_SHIFT;
+	uintptr_t end = ((uintptr_t)addr + size + (1UL << PAGEMAP_PAGE_SHIFT) - 1) >> PAGEMAP_PAGE_SHIFT;
+
+	while (page < end)
+	{
+		uintptr_t index = page & ((1UL << PAGEMAP_LEAF_BITS) - 1);
+		uintptr_t count = (1UL << PAGEMAP_LEAF_BITS) - index;
+		if (count > end - page)
+			count = end - page;
+		uintptr_t *leaf = entry ? pagemap_leaf(page << PAGEMAP_PAGE_SHIFT)
+			: __atomic_load_n(&pagemap_root[page >> PAGEMAP_LEAF_BITS], __ATOMIC_ACQUIRE);
+		if (leaf)
+			for (uintptr_t i = 0; i < count; i++)
+				leaf[index + i] = entry;
+		else if (entry)
+			return 0;
+		page += count;
+	}
+	return 1;
+}
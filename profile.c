@@ -0,0 +1,548 @@
+#include "include.h"
+#include <execinfo.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+
+/*
+	* sampling heap profiler
+	* every thread counts down tcache.prof_countdown by the bytes it allocates,
+	* when it goes negative _malloc calls prof_malloc and that allocation is sampled
+	* the distance between samples is drawn from an exponential distribution of mean
+	* prof_interval bytes, so samples form a Poisson process over the allocated bytes
+	* a sample records the stack in a bucket and the pointer in the live table, _free removes it
+	* prof_filter counts the live samples per pointer hash, a free whose slot is 0 skips the lock
+	* dumps use the pprof heap_v2 text format: in-use and cumulative counts per stack
+	* PROF_DEPTH: frames kept per stack
+	* PROF_IDLE_CHECK: bytes between two looks at prof_interval while profiling is off
+*/
+
+#define PROF_DEPTH 32
+#define PROF_BUCKETS 4096
+#define PROF_TABLE_SIZE 4096
+#define PROF_FILTER_SIZE 65536
+#define PROF_DEFAULT_INTERVAL (512 * 1024)
+#define PROF_IDLE_CHECK (1 << 20)
+#define PROF_ARENA_SIZE (64 * 1024)
+
+typedef struct ProfBucket {
+	uint64_t hash;
+	int depth;
+	void *stack[PROF_DEPTH];
+	uint64_t live_objs;
+	uint64_t live_bytes;
+	uint64_t total_objs;
+	uint64_t total_bytes;
+	struct ProfBucket *next;
+	struct ProfBucket *all;
+} ProfBucket;
+
+typedef struct ProfSample {
+	void *ptr;
+	size_t size;
+	ProfBucket *bucket;
+	struct ProfSample *next;
+} ProfSample;
+
+size_t __attribute__((visibility("hidden")))prof_samples = 0;
+
+static size_t prof_interval = 0;
+static size_t prof_period = PROF_DEFAULT_INTERVAL;
+static int prof_dump_pending = 0;
+static unsigned int prof_dump_seq = 0;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static ProfBucket *buckets[PROF_BUCKETS];
+static ProfBucket *all_buckets;
+static ProfSample *live[PROF_TABLE_SIZE];
+static ProfSample *free_samples;
+static unsigned char prof_filter[PROF_FILTER_SIZE];
+static unsigned char *arena;
+static size_t arena_left;
+
+__attribute__((always_inline))
+static inline uint64_t hash_ptr(void *ptr)
+{
+	uint64_t h = (uintptr_t)ptr >> 4;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	return h ^ (h >> 33);
+}
+
+/*
+	* profiler records are carved from their own pages, never from _malloc
+	* the prof lock must be held
+*/
+
+static void *prof_arena_alloc(size_t size)
+{
+	size = align_up(size, ALIGNMENT);
+	if (arena_left < size)
+	{
+		arena = map_pages(PROF_ARENA_SIZE);
+		if (!arena)
+		{
+			arena_left = 0;
+			return NULL;
+		}
+		arena_left = PROF_ARENA_SIZE;
+	}
+	void *ptr = arena;
+	arena += size;
+	arena_left -= size;
+	return ptr;
+}
+
+/*
+	* -log2(u) for u in (0, 1], exponent from the bits and a cubic for the mantissa
+	* precise enough to draw sample distances, and it needs no libm
+*/
+
+static double fast_neg_log2(double u)
+{
+	uint64_t bits;
+	memcpy(&bits, &u, sizeof(bits));
+	int exponent = (int)((bits >> 52) & 0x7ff) - 1023;
+	bits = (bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+	double m;
+	memcpy(&m, &bits, sizeof(m));
+	double log2_m = -1.7417939 + (2.8212026 + (-1.4699568 + (0.44717955 - 0.056570851 * m) * m) * m) * m;
+	return -(exponent + log2_m);
+}
+
+/*
+	* Returns: bytes until the next sample, exponential of mean interval
+*/
+
+static int64_t prof_next_interval(size_t interval)
+{
+	if (!tcache.prof_rng)
+		tcache.prof_rng = (uintptr_t)&tcache ^ 0x9e3779b97f4a7c15ULL;
+	tcache.prof_rng ^= tcache.prof_rng << 13;
+	tcache.prof_rng ^= tcache.prof_rng >> 7;
+	tcache.prof_rng ^= tcache.prof_rng << 17;
+	double u = ((tcache.prof_rng >> 11) + 1) * (1.0 / 9007199254740992.0);
+	return (int64_t)(fast_neg_log2(u) * 0.6931471805599453 * interval) + 1;
+}
+
+static ProfBucket *find_bucket(void **stack, int depth)
+{
+	uint64_t h = 0;
+	for (int i = 0; i < depth; i++)
+		h = (h ^ hash_ptr(stack[i])) * 0x100000001b3ULL;
+	ProfBucket *bucket = buckets[h % PROF_BUCKETS];
+	while (bucket && (bucket->hash != h || bucket->depth != depth
+		|| memcmp(bucket->stack, stack, depth * sizeof(void *))))
+		bucket = bucket->next;
+	if (bucket || !(bucket = prof_arena_alloc(sizeof(ProfBucket))))
+		return bucket;
+	memset(bucket, 0, sizeof(*bucket));
+	bucket->hash = h;
+	bucket->depth = depth;
+	memcpy(bucket->stack, stack, depth * sizeof(void *));
+	bucket->next = buckets[h % PROF_BUCKETS];
+	buckets[h % PROF_BUCKETS] = bucket;
+	bucket->all = all_buckets;
+	all_buckets = bucket;
+	return bucket;
+}
+
+static void prof_record(void *ptr, size_t size, void **stack, int depth)
+{
+	uint64_t h = hash_ptr(ptr);
+
+	pthread_mutex_lock(&prof_lock);
+	ProfBucket *bucket = find_bucket(stack, depth);
+	ProfSample *sample = free_samples;
+	if (sample)
+		free_samples = sample->next;
+	else
+		sample = prof_arena_alloc(sizeof(ProfSample));
+	if (bucket && sample)
+	{
+		bucket->live_objs++;
+		bucket->live_bytes += size;
+		bucket->total_objs++;
+		bucket->total_bytes += size;
+		sample->ptr = ptr;
+		sample->size = size;
+		sample->bucket = bucket;
+		sample->next = live[h % PROF_TABLE_SIZE];
+		live[h % PROF_TABLE_SIZE] = sample;
+		if (prof_filter[h % PROF_FILTER_SIZE] < 255)
+			STAT_ADD(prof_filter[h % PROF_FILTER_SIZE], 1);
+		STAT_ADD(prof_samples, 1);
+	}
+	else if (sample)
+	{
+		sample->next = free_samples;
+		free_samples = sample;
+	}
+	pthread_mutex_unlock(&prof_lock);
+}
+
+/*
+	* record ptr with the stack of the caller of the function this is inlined in
+*/
+
+__attribute__((always_inline))
+static inline void prof_sample(void *ptr, size_t size)
+{
+	void *stack[PROF_DEPTH + 1];
+	int depth = backtrace(stack, PROF_DEPTH + 1);
+
+	prof_record(ptr, size, stack + 1, depth > 1 ? depth - 1 : 0);
+	if (__builtin_expect(STAT_LOAD(prof_dump_pending), 0))
+		_malloc_prof_dump(NULL);
+}
+
+/*
+	* slow path of _malloc, taken when the countdown of the thread runs out
+	* the countdown is rearmed first so the _malloc below does not come back here
+	* Returns: pointer to the allocated memory
+*/
+
+__attribute__((noinline))
+void *prof_malloc(size_t size)
+{
+	size_t interval = STAT_LOAD(prof_interval);
+
+	if (!interval)
+	{
+		tcache.prof_countdown = PROF_IDLE_CHECK + size;
+		return _malloc(size);
+	}
+	tcache.prof_countdown = prof_next_interval(interval) + size;
+	void *ptr = _malloc(size);
+	if (!ptr)
+		return NULL;
+	prof_sample(ptr, size);
+	return ptr;
+}
+
+/*
+	* called by _aligned_alloc instead of prof_malloc, for the slots of the aligned classes
+	* and the page aligned mappings, which do not go through _malloc
+	* Returns: pointer to the aligned memory
+*/
+
+__attribute__((noinline))
+void *prof_aligned_alloc(size_t alignment, size_t size)
+{
+	size_t interval = STAT_LOAD(prof_interval);
+
+	if (!interval)
+	{
+		tcache.prof_countdown = PROF_IDLE_CHECK + size;
+		return _aligned_alloc(alignment, size);
+	}
+	tcache.prof_countdown = prof_next_interval(interval) + size;
+	void *ptr = _aligned_alloc(alignment, size);
+	if (!ptr)
+		return NULL;
+	prof_sample(ptr, size);
+	return ptr;
+}
+
+/*
+	* unlink the sample of ptr from the live table, the prof lock must be held
+	* Returns: the sample, NULL if ptr was not sampled
+*/
+
+static ProfSample *prof_unlink(void *ptr)
+{
+	uint64_t h = hash_ptr(ptr);
+
+	for (ProfSample **link = &live[h % PROF_TABLE_SIZE]; *link; link = &(*link)->next)
+	{
+		ProfSample *sample = *link;
+		if (sample->ptr != ptr)
+			continue;
+		*link = sample->next;
+		if (prof_filter[h % PROF_FILTER_SIZE] < 255)
+			STAT_ADD(prof_filter[h % PROF_FILTER_SIZE], -1);
+		return sample;
+	}
+	return NULL;
+}
+
+/*
+	* called by _free while samples are live
+	* Returns: nothing, the sample of ptr is dropped if there is one
+*/
+
+__attribute__((noinline))
+void prof_free(void *ptr)
+{
+	uint64_t h = hash_ptr(ptr);
+
+	if (!STAT_LOAD(prof_filter[h % PROF_FILTER_SIZE]))
+		return;
+	pthread_mutex_lock(&prof_lock);
+	ProfSample *sample = prof_unlink(ptr);
+	if (sample)
+	{
+		sample->bucket->live_objs--;
+		sample->bucket->live_bytes -= sample->size;
+		sample->next = free_samples;
+		free_samples = sample;
+		STAT_ADD(prof_samples, -1);
+	}
+	pthread_mutex_unlock(&prof_lock);
+}
+
+/*
+	* called by _realloc while samples are live, before it resizes ptr without a new _malloc
+	* the sample leaves the live table so a block mapped at the old address meanwhile
+	* is not mistaken for it, its bucket still counts it
+	* Returns: the sample for prof_attach, NULL if ptr was not sampled
+*/
+
+__attribute__((noinline))
+void *prof_detach(void *ptr)
+{
+	uint64_t h = hash_ptr(ptr);
+
+	if (!STAT_LOAD(prof_filter[h % PROF_FILTER_SIZE]))
+		return NULL;
+	pthread_mutex_lock(&prof_lock);
+	ProfSample *sample = prof_unlink(ptr);
+	pthread_mutex_unlock(&prof_lock);
+	return sample;
+}
+
+/*
+	* put a sample from prof_detach back under the block the resize left, of size bytes,
+	* 0 keeps the size it had
+	* the bucket keeps the stack of the first allocation, its live bytes follow the size
+*/
+
+__attribute__((noinline))
+void prof_attach(void *detached, void *ptr, size_t size)
+{
+	ProfSample *sample = detached;
+	uint64_t h = hash_ptr(ptr);
+
+	if (!size)
+		size = sample->size;
+	pthread_mutex_lock(&prof_lock);
+	sample->bucket->live_bytes += size - sample->size;
+	sample->ptr = ptr;
+	sample->size = size;
+	sample->next = live[h % PROF_TABLE_SIZE];
+	live[h % PROF_TABLE_SIZE] = sample;
+	if (prof_filter[h % PROF_FILTER_SIZE] < 255)
+		STAT_ADD(prof_filter[h % PROF_FILTER_SIZE], 1);
+	pthread_mutex_unlock(&prof_lock);
+}
+
+/*
+	* the dump writes through a small buffer with write(2)
+	* no stdio, it can run from a signal handler and from inside the allocator
+*/
+
+typedef struct ProfOut {
+	int fd;
+	size_t len;
+	char buf[4096];
+} ProfOut;
+
+static void out_flush(ProfOut *out)
+{
+	size_t done = 0;
+	while (done < out->len)
+	{
+		ssize_t n = write(out->fd, out->buf + done, out->len - done);
+		if (n <= 0 && errno != EINTR)
+			break;
+		if (n > 0)
+			done += n;
+	}
+	out->len = 0;
+}
+
+static void out_str(ProfOut *out, const char *s)
+{
+	while (*s)
+	{
+		if (out->len == sizeof(out->buf))
+			out_flush(out);
+		out->buf[out->len++] = *s++;
+	}
+}
+
+static void out_num(ProfOut *out, uint64_t n, int base)
+{
+	char digits[24];
+	int i = sizeof(digits) - 1;
+
+	digits[i] = 0;
+	do
+		digits[--i] = "0123456789abcdef"[n % base];
+	while (n /= base);
+	if (base == 16)
+		out_str(out, "0x");
+	out_str(out, digits + i);
+}
+
+static void out_counts(ProfOut *out, uint64_t live_objs, uint64_t live_bytes, uint64_t total_objs, uint64_t total_bytes)
+{
+	out_num(out, live_objs, 10);
+	out_str(out, ": ");
+	out_num(out, live_bytes, 10);
+	out_str(out, " [");
+	out_num(out, total_objs, 10);
+	out_str(out, ": ");
+	out_num(out, total_bytes, 10);
+	out_str(out, "] @");
+}
+
+static void prof_write(ProfOut *out)
+{
+	uint64_t live_objs = 0, live_bytes = 0, total_objs = 0, total_bytes = 0;
+
+	for (ProfBucket *bucket = all_buckets; bucket; bucket = bucket->all)
+	{
+		live_objs += bucket->live_objs;
+		live_bytes += bucket->live_bytes;
+		total_objs += bucket->total_objs;
+		total_bytes += bucket->total_bytes;
+	}
+	out_str(out, "heap profile: ");
+	out_counts(out, live_objs, live_bytes, total_objs, total_bytes);
+	out_str(out, " heap_v2/");
+	out_num(out, prof_period, 10);
+	out_str(out, "\n");
+	for (ProfBucket *bucket = all_buckets; bucket; bucket = bucket->all)
+	{
+		out_counts(out, bucket->live_objs, bucket->live_bytes, bucket->total_objs, bucket->total_bytes);
+		for (int i = 0; i < bucket->depth; i++)
+		{
+			out_str(out, " ");
+			out_num(out, (uintptr_t)bucket->stack[i], 16);
+		}
+		out_str(out, "\n");
+	}
+
+	out_str(out, "\nMAPPED_LIBRARIES:\n");
+	out_flush(out);
+	int maps = open("/proc/self/maps", O_RDONLY);
+	if (maps < 0)
+		return;
+	ssize_t n;
+	while ((n = read(maps, out->buf, sizeof(out->buf))) > 0)
+	{
+		out->len = n;
+		out_flush(out);
+	}
+	close(maps);
+}
+
+/*
+	* write the profile to path, NULL picks ft_malloc.<pid>.<seq>.heap in the working directory
+	* read it with: pprof -inuse_space (or -alloc_space) <binary> <file>
+	* if the profiler is busy, from a signal handler, the dump is left to the next sample
+	* Returns: 0 on success, -1 with errno set otherwise
+*/
+
+int _malloc_prof_dump(const char *path)
+{
+	char name[64];
+	ProfOut out;
+
+	if (pthread_mutex_trylock(&prof_lock) != 0)
+	{
+		STAT_ADD(prof_dump_pending, 1);
+		errno = EBUSY;
+		return -1;
+	}
+	prof_dump_pending = 0;
+	if (!path)
+	{
+		ProfOut label = {.fd = -1};
+		out_str(&label, "ft_malloc.");
+		out_num(&label, getpid(), 10);
+		out_str(&label, ".");
+		out_num(&label, prof_dump_seq++, 10);
+		out_str(&label, ".heap");
+		memcpy(name, label.buf, label.len);
+		name[label.len] = 0;
+		path = name;
+	}
+	out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out.fd < 0)
+	{
+		pthread_mutex_unlock(&prof_lock);
+		return -1;
+	}
+	out.len = 0;
+	prof_write(&out);
+	close(out.fd);
+	pthread_mutex_unlock(&prof_lock);
+	return 0;
+}
+
+void prof_fork_lock()
+{
+	pthread_mutex_lock(&prof_lock);
+}
+
+void prof_fork_unlock()
+{
+	pthread_mutex_unlock(&prof_lock);
+}
+
+/*
+	* start sampling, about one allocation every interval bytes (0 = 512 KiB)
+	* threads pick the new interval within PROF_IDLE_CHECK bytes
+	* backtrace is warmed up here: its first call loads the unwinder, which allocates
+*/
+
+void _malloc_prof_start(size_t interval)
+{
+	void *stack[1];
+
+	backtrace(stack, 1);
+	pthread_mutex_lock(&prof_lock);
+	prof_period = interval ? interval : PROF_DEFAULT_INTERVAL;
+	pthread_mutex_unlock(&prof_lock);
+	__atomic_store_n(&prof_interval, prof_period, __ATOMIC_RELAXED);
+	tcache.prof_countdown = 0;
+}
+
+/*
+	* stop taking new samples, the live ones are still dropped by _free
+*/
+
+void _malloc_prof_stop(void)
+{
+	__atomic_store_n(&prof_interval, 0, __ATOMIC_RELAXED);
+}
+
+static void prof_signal(int sig)
+{
+	int saved_errno = errno;
+	(void)sig;
+	_malloc_prof_dump(NULL);
+	errno = saved_errno;
+}
+
+/*
+	* FT_MALLOC_PROF=<interval> turns the profiler on at load time,
+	* SIGUSR2 then writes ft_malloc.<pid>.<seq>.heap
+*/
+
+__attribute__((constructor))
+static void prof_init()
+{
+	const char *env = getenv("FT_MALLOC_PROF");
+	struct sigaction action;
+
+	if (!env)
+		return;
+	_malloc_prof_start(strtoul(env, NULL, 10));
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = prof_signal;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGUSR2, &action, NULL);
+}
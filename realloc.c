@@ -0,0 +1,206 @@
+#define _GNU_SOURCE
+#include "include.h"
+
+extern Block *heap_tail;
+extern size_t block_size[];
+
+/*
+	* merge the next block into block when it is free and touches it
+	* the heap lock must be held
+	* Returns: 1 if the blocks were merged
+*/
+
+static int absorb_next(Block *block)
+{
+	Block *next = block->next;
+
+	if (!next || !next->free || !block_is_adjacent(block, next))
+		return 0;
+	if (next == heap_tail)
+		heap_tail = block;
+	block->size += BLOCK_SIZE + next->size;
+	block->next = next->next;
+	if (block->next)
+		block->next->prev = block;
+	block->zeroed = 0;
+	block->purged = 0;
+	if (next->dirty_epoch > block->dirty_epoch)
+		block->dirty_epoch = next->dirty_epoch;
+	return 1;
+}
+
+/*
+	* resize a heap block without moving it
+	* grows into the next block when it is free, shrinks by splitting off the tail
+	* the tail is handed back and merged with a free neighbour
+	* Returns: 1 if the block now holds new_size bytes
+*/
+
+static int resize_heap_block(Block *block, size_t new_size)
+{
+	int done = 0;
+	size_t old_size = block->size;
+
+	pthread_mutex_lock(&heap_lock);
+	if (block->size < new_size && block->next && block->next->free
+		&& block_is_adjacent(block, block->next)
+		&& block->size + BLOCK_SIZE + block->next->size >= new_size)
+		absorb_next(block);
+	if (block->size >= new_size)
+	{
+		if (block->size >= new_size + BLOCK_SIZE + ALIGNMENT)
+		{
+			block->zeroed = 0;
+			split_block(block, new_size, ALIGNMENT);
+			block->next->purged = 0;
+			block->next->dirty_epoch = decay_epoch();
+			absorb_next(block->next);
+		}
+		done = 1;
+	}
+	STAT_ADD(alloc_stats.heap_allocated, block->size - old_size);
+	pthread_mutex_unlock(&heap_lock);
+	return done;
+}
+
+/*
+	* resize a block from request_space_mmap with mremap
+	* the pages are moved by the kernel, nothing is copied
+	* the old range leaves the pagemap before the call, once it is unmapped another thread
+	* may map it again, if the leaf of the new range cannot be mapped the block is no longer
+	* known and _free ignores it
+	* a huge page block keeps its arena while the new size fits in it
+	* Returns: the new user pointer or NULL if mremap failed
+*/
+
+static void *resize_mmap_block(void *ptr, Block *block, size_t new_size)
+{
+	static size_t page_size;
+	if (!page_size)
+		page_size = sysconf(_SC_PAGESIZE);
+
+	uintptr_t base = (uintptr_t)block & ~(page_size - 1);
+	size_t offset = (uintptr_t)ptr - base;
+	size_t old_total = align_up(offset + block->size, page_size);
+	size_t new_total = align_up(offset + new_size, page_size);
+	size_t old_size = block->size;
+	int huge = block->huge;
+
+	if (huge && new_size <= old_size)
+		return ptr;
+	if (old_total == new_total)
+	{
+		STAT_ATOMIC_ADD(alloc_stats.large_allocated, new_size - old_size);
+		block->size = new_size;
+		return ptr;
+	}
+	pagemap_set((void *)base, old_total, 0);
+	void *mapped = mremap((void *)base, old_total, new_total, MREMAP_MAYMOVE);
+	STAT_ATOMIC_ADD(alloc_stats.mremap_calls, 1);
+	if (mapped == MAP_FAILED)
+	{
+		pagemap_set((void *)base, old_total, base | PAGEMAP_MMAP);
+		return NULL;
+	}
+	STAT_ATOMIC_ADD(alloc_stats.large_allocated, new_size - old_size);
+	STAT_ATOMIC_ADD(alloc_stats.large_mapped, new_total - old_total);
+	STAT_ATOMIC_ADD(alloc_stats.mapped, new_total - old_total);
+	if (huge)
+		STAT_ATOMIC_ADD(alloc_stats.huge_mapped, new_total - old_total);
+	if (!pagemap_set(mapped, new_total, (uintptr_t)mapped | PAGEMAP_MMAP))
+		pagemap_set(mapped, new_total, 0);
+	block = (Block *)((uintptr_t)mapped + offset - sizeof(Block));
+	block->size = new_size;
+	block->zeroed = 0;
+	block->aligned_address = (void *)((uintptr_t)mapped + offset);
+	return block->aligned_address;
+}
+
+/*
+	* this is the custom realloc function
+	* ptr: pointer to the memory to be resized
+	* new_size: new size of the memory
+	* a slot of a bin is kept when the new size maps to the same bin, a slot of an aligned
+	* class when the new size fits it and is above BIN_MAX_SIZE
+	* the pagemap gives the tier of other pointers, a pointer it does not know is refused
+	* mmap blocks are resized with mremap, heap and pool blocks are resized in place when possible
+	* any other block resized to BIN_MAX_SIZE or less moves to the slot of the bin of the new
+	* size, so _free_sized can trust a small size
+	* aligned pointers are always moved, the result only keeps ALIGNMENT
+	* otherwise the memory is moved to a new allocation
+	* a sampled block resized without a new allocation takes its profiler sample along
+	* Returns: pointer to the resized memory
+*/
+
+void *_realloc(void *ptr, size_t new_size)
+{
+    if (new_size == 0)
+	{
+        _free(ptr);
+        return NULL;
+    }
+    if (ptr == NULL)
+        return _malloc(new_size);
+
+    size_t old_size;
+    size_t size = __builtin_align_up(new_size, ALIGNMENT);
+    void *sample = NULL;
+    if (__builtin_expect(STAT_LOAD(prof_samples) != 0, 0))
+        sample = prof_detach(ptr);
+    void *resized = NULL;
+    if (is_slab_ptr(ptr))
+	{
+        int class = slab_class(ptr);
+        old_size = block_size[class];
+        if (class < BIN_COUNT ? size == old_size : size > BIN_MAX_SIZE && size <= old_size)
+            resized = ptr;
+    }
+	else
+	{
+        uintptr_t page = pagemap_lookup(ptr);
+        if (__builtin_expect(!page, 0))
+        {
+            if (sample)
+                prof_attach(sample, ptr, 0);
+            return NULL;
+        }
+        Block *block = block_from_ptr(ptr);
+        int tier = page & PAGEMAP_TAG_MASK;
+        old_size = block->size;
+        if (size > BIN_MAX_SIZE && !is_aligned_proxy(block, ptr))
+        {
+            if (tier == PAGEMAP_MMAP)
+                resized = resize_mmap_block(ptr, block, size);
+            else if (tier == PAGEMAP_POOL ? resize_pool_block(block, size) : resize_heap_block(block, size))
+                resized = ptr;
+        }
+    }
+    if (sample)
+        prof_attach(sample, resized ? resized : ptr, resized ? new_size : 0);
+    if (resized)
+        return resized;
+
+    void *new_ptr = _malloc(new_size);
+    if (new_ptr == NULL)
+        return NULL;
+    _memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    _free(ptr);
+
+    return new_ptr;
+}
+
+/*
+	* Returns: the number of usable bytes in the block behind ptr
+	* this can be larger than the size asked to _malloc
+*/
+
+size_t _malloc_usable_size(void *ptr)
+{
+	if (!ptr)
+		return 0;
+	if (is_slab_ptr(ptr))
+		return block_size[slab_class(ptr)];
+	if (!pagemap_lookup(ptr))
+		return 0;
+	return block_from_ptr(ptr)->size;
+}
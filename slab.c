@@ -0,0 +1,336 @@
+#include "include.h"
+
+extern size_t block_size[];
+
+static struct meta *free_spans;
+static SlabHeap *parked_heaps;
+static SlabHeap *free_heaps;
+static uintptr_t region_top;
+static uintptr_t region_committed;
+static uint32_t spans_purged_epoch;
+
+SlabRegion __attribute__((visibility("hidden")))slab_region = {0};
+
+/*
+	* spans of threads whose cache is dead, nobody owns them so their lists stay closed
+*/
+
+static SlabHeap shared_heap = {.remote = {[0 ... SLAB_CLASS_COUNT - 1] = REMOTE_CLOSED}};
+
+/*
+	* reserve the slab region on first use, without backing it
+	* the largest size the kernel accepts is kept, from SLAB_REGION_MAX down to SLAB_REGION_MIN
+	* the classes and metas arrays are reserved for every span of the region, only the
+	* pages of the spans in use are ever touched
+	* Returns: 1 if the region exists
+*/
+
+static int slab_region_init()
+{
+	if (slab_region.size)
+		return 1;
+	alloc_config_init();
+	for (size_t size = SLAB_REGION_MAX; size >= SLAB_REGION_MIN; size /= 2)
+	{
+		size_t spans = size / SPAN_SIZE;
+		size_t meta_size = spans * sizeof(struct meta);
+		void *region = mmap(NULL, size + SPAN_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		STAT_ATOMIC_ADD(alloc_stats.mmap_calls, 1);
+		if (region == MAP_FAILED)
+			continue;
+		unsigned char *arrays = mmap(NULL, meta_size + spans, PROT_READ | PROT_WRITE,
+									 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		STAT_ATOMIC_ADD(alloc_stats.mmap_calls, 1);
+		if (arrays == MAP_FAILED)
+		{
+			munmap(region, size + SPAN_SIZE);
+			STAT_ATOMIC_ADD(alloc_stats.munmap_calls, 1);
+			continue;
+		}
+		slab_region.base = align_up((uintptr_t)region, SPAN_SIZE);
+		slab_region.metas = (struct meta *)arrays;
+		slab_region.classes = arrays + meta_size;
+		region_top = region_committed = slab_region.base;
+		__atomic_store_n(&slab_region.size, size, __ATOMIC_RELEASE);
+		return 1;
+	}
+	return 0;
+}
+
+static inline void link_meta(struct meta *m)
+{
+	m->prev = NULL;
+	m->next = m->owner->active[m->sizeclass];
+	if (m->next)
+		m->next->prev = m;
+	m->owner->active[m->sizeclass] = m;
+}
+
+static inline void unlink_meta(struct meta *m)
+{
+	if (m->prev)
+		m->prev->next = m->next;
+	else
+		m->owner->active[m->sizeclass] = m->next;
+	if (m->next)
+		m->next->prev = m->prev;
+	m->prev = m->next = NULL;
+}
+
+/*
+	* take a span for a size class, a free span first, else the next one of the region
+	* the region is made accessible SPAN_COMMIT bytes at a time
+	* slots are not carved here, slab_alloc_batch bumps through the span as it hands them out,
+	* up to the alloc_config.slab_slots of the class
+	* Returns: the meta of the span, linked as active in the slab heap of its owner
+*/
+
+static struct meta *alloc_span(SlabHeap *owner, int sizeclass)
+{
+	struct meta *m = free_spans;
+
+	if (m)
+	{
+		free_spans = m->next;
+		if (m->next)
+			m->next->prev = NULL;
+	}
+	else
+	{
+		if (!slab_region_init() || region_top - slab_region.base >= slab_region.size)
+			return NULL;
+		if (region_top == region_committed)
+		{
+			size_t commit = SPAN_COMMIT;
+			if (region_committed + commit > slab_region.base + slab_region.size)
+				commit = slab_region.base + slab_region.size - region_committed;
+			if (mprotect((void *)region_committed, commit, PROT_READ | PROT_WRITE) != 0)
+				return NULL;
+			region_committed += commit;
+			STAT_ATOMIC_ADD(alloc_stats.mapped, commit);
+		}
+		m = &slab_region.metas[(region_top - slab_region.base) >> SPAN_SHIFT];
+		m->span = (unsigned char *)region_top;
+		region_top += SPAN_SIZE;
+	}
+	size_t stride = block_size[sizeclass];
+	m->free = NULL;
+	m->bump = m->span;
+	m->capacity = alloc_config.slab_slots[sizeclass];
+	m->limit = m->span + m->capacity * stride;
+	m->used = 0;
+	m->sizeclass = sizeclass;
+	m->owner = owner;
+	m->purged = 0;
+	slab_region.classes[(m->span - (unsigned char *)slab_region.base) >> SPAN_SHIFT] = sizeclass;
+	link_meta(m);
+	STAT_ADD(alloc_stats.slab_groups[sizeclass], 1);
+	STAT_ADD(alloc_stats.slab_free_slots[sizeclass], m->capacity);
+	return m;
+}
+
+/*
+	* take up to count slots of one size class
+	* heap: slab heap the slots are taken from, NULL for the shared heap of dead threads
+	* sizeclass: index in block_size
+	* count: number of slots wanted
+	* list: slots are pushed on this list, linked through their first word
+	* freed slots are reused first, then the span is carved further with its bump pointer
+	* Returns: the number of slots pushed
+*/
+
+__attribute__((hot))
+int slab_alloc_batch(SlabHeap *heap, int sizeclass, int count, void **list)
+{
+	int n = 0;
+	size_t stride = block_size[sizeclass];
+
+	if (!heap)
+		heap = &shared_heap;
+	while (n < count)
+	{
+		struct meta *m = heap->active[sizeclass];
+		if (!m && !(m = alloc_span(heap, sizeclass)))
+			break;
+		int start = n;
+		while (n < count && m->free)
+		{
+			void *p = m->free;
+			m->free = *(void **)p;
+			*(void **)p = *list;
+			*list = p;
+			n++;
+		}
+		while (n < count && m->bump < m->limit)
+		{
+			*(void **)m->bump = *list;
+			*list = m->bump;
+			m->bump += stride;
+			n++;
+		}
+		m->used += n - start;
+		if (!m->free && m->bump == m->limit)
+			unlink_meta(m);
+	}
+	STAT_ADD(alloc_stats.slab_free_slots[sizeclass], -n);
+	return n;
+}
+
+/*
+	* purge the free spans that are due, or all of them with all set
+	* the heap lock must be held
+	* Returns: 1 if pages were purged
+*/
+
+int purge_spans(uint32_t epoch, int all)
+{
+	int purged = 0;
+
+	for (struct meta *m = free_spans; m; m = m->next)
+		if (!m->purged && (all || decay_is_due(m->dirty_epoch, epoch)))
+		{
+			purge_pages(m->span, SPAN_SIZE);
+			m->purged = 1;
+			purged = 1;
+		}
+	return purged;
+}
+
+/*
+	* called by slab_free when a span becomes free, the free spans are walked at most once per epoch
+*/
+
+static void slab_decay(uint32_t epoch)
+{
+	if (!epoch || epoch == spans_purged_epoch)
+		return;
+	spans_purged_epoch = epoch;
+	purge_spans(epoch, 0);
+}
+
+/*
+	* give a slot back to its span
+	* the span is found from the address alone, the slot has no header
+	* a span that becomes empty goes to the free spans, where it waits for any class,
+	* unless it is the last one of its class in its slab heap
+*/
+
+__attribute__((hot))
+void slab_free(void *ptr)
+{
+	struct meta *m = slab_meta(ptr);
+
+	if (!m->free && m->bump == m->limit)
+		link_meta(m);
+	*(void **)ptr = m->free;
+	m->free = ptr;
+	m->used--;
+	STAT_ADD(alloc_stats.slab_free_slots[m->sizeclass], 1);
+	if (!m->used && (m->prev || m->next))
+	{
+		STAT_ADD(alloc_stats.slab_groups[m->sizeclass], -1);
+		STAT_ADD(alloc_stats.slab_free_slots[m->sizeclass], -(int64_t)m->capacity);
+		unlink_meta(m);
+		m->sizeclass = -1;
+		m->owner = NULL;
+		m->dirty_epoch = decay_epoch();
+		m->next = free_spans;
+		if (free_spans)
+			free_spans->prev = m;
+		free_spans = m;
+		slab_decay(m->dirty_epoch);
+	}
+}
+
+/*
+	* span part of _malloc_frag_report, one pass over the metas of the spans carved so far,
+	* no slot is read
+	* cached_bytes gets every slot a thread took, the caller takes the live ones out
+	* the heap lock must be held
+*/
+
+void slab_frag(struct malloc_frag_report *report)
+{
+	size_t spans = slab_region.size ? (region_top - slab_region.base) >> SPAN_SHIFT : 0;
+
+	for (size_t i = 0; i < spans; i++)
+	{
+		struct meta *m = &slab_region.metas[i];
+		if (m->sizeclass < 0)
+		{
+			report->free_spans++;
+			if (!m->purged)
+				report->free_span_resident += m->limit - m->span;
+			continue;
+		}
+		struct malloc_frag_class *class = &report->classes[m->sizeclass];
+		int full = m->used == m->capacity;
+		class->spans++;
+		class->full_spans += full;
+		class->partial_spans += !full && m->used;
+		class->empty_spans += !m->used;
+		class->span_occupancy[full ? FRAG_OCCUPANCY_BUCKETS - 1 : m->used * (FRAG_OCCUPANCY_BUCKETS - 1) / m->capacity]++;
+		class->cached_bytes += (size_t)m->used * block_size[m->sizeclass];
+		class->free_bytes += (size_t)(m->capacity - m->used) * block_size[m->sizeclass];
+	}
+}
+
+/*
+	* give a slab heap to a new thread cache, a parked one first
+	* its remote lists are opened, remote frees go to the new owner from now on
+	* Returns: the heap, NULL if no memory is left
+*/
+
+SlabHeap *slab_heap_adopt()
+{
+	SlabHeap *heap = parked_heaps;
+
+	if (heap)
+		parked_heaps = heap->next;
+	else
+	{
+		if (!free_heaps)
+		{
+			size_t page_size = sysconf(_SC_PAGESIZE);
+			SlabHeap *page = map_pages(page_size);
+			if (!page)
+				return NULL;
+			for (size_t i = 0; i < page_size / sizeof(SlabHeap); i++)
+			{
+				page[i].next = free_heaps;
+				free_heaps = &page[i];
+			}
+		}
+		heap = free_heaps;
+		free_heaps = heap->next;
+	}
+	heap->next = NULL;
+	for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+	{
+		heap->remote_count[i] = 0;
+		__atomic_store_n(&heap->remote[i], NULL, __ATOMIC_RELEASE);
+	}
+	return heap;
+}
+
+/*
+	* close the remote lists of the heap of an exiting thread and park it
+	* the slots already pushed go back to their spans, later remote frees see
+	* REMOTE_CLOSED and do the same, the spans wait for the next thread to adopt the heap
+*/
+
+void slab_heap_park(SlabHeap *heap)
+{
+	for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+	{
+		void *ptr = __atomic_exchange_n(&heap->remote[i], REMOTE_CLOSED, __ATOMIC_ACQUIRE);
+		while (ptr)
+		{
+			void *next = *(void **)ptr;
+			slab_free(ptr);
+			ptr = next;
+		}
+	}
+	heap->next = parked_heaps;
+	parked_heaps = heap;
+}
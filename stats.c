@@ -0,0 +1,263 @@
+#include "include.h"
+#include <fcntl.h>
+
+extern size_t block_size[];
+extern Block *freelist;
+
+AllocStats __attribute__((visibility("hidden")))alloc_stats = {0};
+
+static ThreadCache *caches = NULL;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+	* the registry links the caches of the live threads so their counters can be summed
+	* it has its own lock, reading the stats never blocks an allocation
+*/
+
+void tcache_register(ThreadCache *cache)
+{
+	pthread_mutex_lock(&registry_lock);
+	cache->prev = NULL;
+	cache->next = caches;
+	if (caches)
+		caches->prev = cache;
+	caches = cache;
+	pthread_mutex_unlock(&registry_lock);
+}
+
+/*
+	* the counters of an exiting thread are moved to alloc_stats.retired
+	* the move happens under the registry lock so a reader never counts them twice or misses them
+*/
+
+void tcache_unregister(ThreadCache *cache)
+{
+	pthread_mutex_lock(&registry_lock);
+	for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+	{
+		STAT_ATOMIC_ADD(alloc_stats.retired.nmalloc[i], cache->stats.nmalloc[i]);
+		STAT_ATOMIC_ADD(alloc_stats.retired.nfree[i], cache->stats.nfree[i]);
+		STAT_ATOMIC_ADD(alloc_stats.retired.requested[i], cache->stats.requested[i]);
+	}
+	STAT_ATOMIC_ADD(alloc_stats.retired.refills, cache->stats.refills);
+	STAT_ATOMIC_ADD(alloc_stats.retired.flushes, cache->stats.flushes);
+	STAT_ATOMIC_ADD(alloc_stats.retired.remote_frees, cache->stats.remote_frees);
+	if (cache->prev)
+		cache->prev->next = cache->next;
+	else
+		caches = cache->next;
+	if (cache->next)
+		cache->next->prev = cache->prev;
+	cache->prev = cache->next = NULL;
+	pthread_mutex_unlock(&registry_lock);
+}
+
+static void sum_tcache_stats(TcacheStats *sum, TcacheStats *stats)
+{
+	for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+	{
+		sum->nmalloc[i] += STAT_LOAD(stats->nmalloc[i]);
+		sum->nfree[i] += STAT_LOAD(stats->nfree[i]);
+		sum->requested[i] += STAT_LOAD(stats->requested[i]);
+	}
+	sum->refills += STAT_LOAD(stats->refills);
+	sum->flushes += STAT_LOAD(stats->flushes);
+	sum->remote_frees += STAT_LOAD(stats->remote_frees);
+}
+
+void registry_fork_lock()
+{
+	pthread_mutex_lock(&registry_lock);
+}
+
+void registry_fork_unlock()
+{
+	pthread_mutex_unlock(&registry_lock);
+}
+
+/*
+	* counters of the live thread caches and of the exited ones
+*/
+
+static void sum_all_tcache_stats(TcacheStats *sum)
+{
+	pthread_mutex_lock(&registry_lock);
+	sum_tcache_stats(sum, &alloc_stats.retired);
+	for (ThreadCache *cache = caches; cache; cache = cache->next)
+		sum_tcache_stats(sum, &cache->stats);
+	pthread_mutex_unlock(&registry_lock);
+}
+
+/*
+	* fill stats with a snapshot of the allocator
+	* only counters are read: one pass over the thread caches and the arenas, no block is touched
+	* and neither the heap lock nor the pool lock is taken, so it can run every second
+	* from a monitoring thread while the others keep allocating
+	* counters are read one by one, a snapshot taken under load is not exact to the byte
+*/
+
+void _malloc_stats(struct malloc_stats *stats)
+{
+	TcacheStats small = {0};
+
+	sum_all_tcache_stats(&small);
+	memset(stats, 0, sizeof(*stats));
+	for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+	{
+		struct malloc_class_stats *class = &stats->classes[i];
+		uint64_t free_slots = STAT_LOAD(alloc_stats.slab_free_slots[i]);
+
+		class->size = block_size[i];
+		class->nmalloc = small.nmalloc[i];
+		class->nfree = small.nfree[i];
+		class->live = class->nmalloc > class->nfree ? class->nmalloc - class->nfree : 0;
+		class->groups = STAT_LOAD(alloc_stats.slab_groups[i]);
+		class->slots = class->groups * alloc_config.slab_slots[i];
+		if (class->slots > free_slots + class->live)
+			class->cached = class->slots - free_slots - class->live;
+		class->occupancy = class->slots ? 100.0 * class->live / class->slots : 0;
+
+		stats->nmalloc += class->nmalloc;
+		stats->nfree += class->nfree;
+		stats->allocated += class->live * class->size;
+		stats->active += class->slots * class->size;
+	}
+
+	uint64_t heap_live = STAT_LOAD(alloc_stats.heap_nmalloc) - STAT_LOAD(alloc_stats.heap_nfree);
+	stats->nmalloc += STAT_LOAD(alloc_stats.pool_nmalloc) + STAT_LOAD(alloc_stats.heap_nmalloc)
+		+ STAT_LOAD(alloc_stats.large_nmalloc);
+	stats->nfree += STAT_LOAD(alloc_stats.pool_nfree) + STAT_LOAD(alloc_stats.heap_nfree)
+		+ STAT_LOAD(alloc_stats.large_nfree);
+	stats->live = stats->nmalloc > stats->nfree ? stats->nmalloc - stats->nfree : 0;
+	stats->allocated += STAT_LOAD(alloc_stats.pool_allocated) + STAT_LOAD(alloc_stats.heap_allocated)
+		+ STAT_LOAD(alloc_stats.large_allocated);
+	stats->active += STAT_LOAD(alloc_stats.pool_units) * BLOCK_UNIT_SIZE
+		+ STAT_LOAD(alloc_stats.heap_allocated) + heap_live * BLOCK_SIZE
+		+ STAT_LOAD(alloc_stats.large_mapped);
+	arena_stats(stats);
+	stats->allocated += stats->arena_allocated;
+	stats->active += stats->arena_active;
+	stats->mapped = STAT_LOAD(alloc_stats.mapped);
+	stats->retained = stats->mapped > stats->active ? stats->mapped - stats->active : 0;
+
+	stats->mmap_calls = STAT_LOAD(alloc_stats.mmap_calls);
+	stats->munmap_calls = STAT_LOAD(alloc_stats.munmap_calls);
+	stats->mremap_calls = STAT_LOAD(alloc_stats.mremap_calls);
+	stats->madvise_calls = STAT_LOAD(alloc_stats.madvise_calls);
+	stats->purged = STAT_LOAD(alloc_stats.purged);
+	stats->huge_mapped = STAT_LOAD(alloc_stats.huge_mapped);
+	stats->mapcache_hits = STAT_LOAD(alloc_stats.mapcache_hits);
+	stats->mapcache_misses = STAT_LOAD(alloc_stats.mapcache_misses);
+	stats->mapcache_bytes = STAT_LOAD(alloc_stats.mapcache_bytes);
+
+	uint64_t small_nmalloc = 0;
+	for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+		small_nmalloc += small.nmalloc[i];
+	stats->tcache_misses = small.refills;
+	stats->tcache_hits = small_nmalloc > small.refills ? small_nmalloc - small.refills : 0;
+	stats->tcache_flushes = small.flushes;
+	stats->remote_frees = small.remote_frees;
+	stats->tcache_hit_rate = small_nmalloc ? (double)stats->tcache_hits / small_nmalloc : 0;
+}
+
+/*
+	* resident bytes of the process from /proc/self/statm, read without stdio
+	* Returns: the bytes, 0 if the file cannot be read
+*/
+
+static size_t resident_bytes()
+{
+	char buf[64];
+	size_t pages = 0;
+	int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return 0;
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = 0;
+	char *p = strchr(buf, ' ');
+	while (p && *++p >= '0' && *p <= '9')
+		pages = pages * 10 + *p - '0';
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+/*
+	* fill report with the fragmentation of the allocator, see struct malloc_frag_report
+	* the counters come from _malloc_stats, then one pass over the span metas and one over
+	* the heap block list under the heap lock, and one over the pools under the pool lock
+	* no user memory is read beyond the heap block headers, the cost grows with the
+	* number of spans and heap blocks, not with the allocated bytes
+	* the requested bytes of the slab classes are estimated: the live slots of a class are
+	* taken to hold the mean size asked for in it since start
+*/
+
+void _malloc_frag_report(struct malloc_frag_report *report)
+{
+	struct malloc_stats stats;
+	TcacheStats small = {0};
+
+	_malloc_stats(&stats);
+	sum_all_tcache_stats(&small);
+	memset(report, 0, sizeof(*report));
+
+	pthread_mutex_lock(&heap_lock);
+	slab_frag(report);
+	for (Block *block = freelist; block; block = block->next)
+	{
+		if (!block->free)
+		{
+			report->heap_live_blocks++;
+			report->heap_live_bytes += block->size;
+			continue;
+		}
+		report->heap_free_blocks++;
+		report->heap_free_bytes += block->size;
+		if (block->size > report->heap_largest_free)
+			report->heap_largest_free = block->size;
+	}
+	pthread_mutex_unlock(&heap_lock);
+	pool_frag(report);
+
+	for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+	{
+		struct malloc_frag_class *class = &report->classes[i];
+		uint64_t live = stats.classes[i].live;
+
+		class->size = block_size[i];
+		class->live_bytes = live * class->size;
+		if (class->live_bytes > class->cached_bytes)
+			class->live_bytes = class->cached_bytes;
+		class->cached_bytes -= class->live_bytes;
+		if (small.nmalloc[i])
+			class->requested_bytes = (double)small.requested[i] / small.nmalloc[i] * class->live_bytes / class->size;
+		if (class->requested_bytes > class->live_bytes)
+			class->requested_bytes = class->live_bytes;
+		class->internal_waste = class->live_bytes - class->requested_bytes;
+
+		report->requested += class->requested_bytes;
+		report->internal_waste += class->internal_waste;
+		report->external_free += class->cached_bytes + class->free_bytes;
+	}
+
+	size_t pool_units = STAT_LOAD(alloc_stats.pool_units) * BLOCK_UNIT_SIZE;
+	size_t large_mapped = STAT_LOAD(alloc_stats.large_mapped);
+	report->heap_header_bytes = report->heap_live_blocks * BLOCK_SIZE;
+	report->heap_external = report->heap_free_bytes
+		? 1.0 - (double)report->heap_largest_free / report->heap_free_bytes : 0;
+	report->pool_live_bytes = STAT_LOAD(alloc_stats.pool_allocated);
+	report->pool_overhead = pool_units > report->pool_live_bytes ? pool_units - report->pool_live_bytes : 0;
+	report->large_live_bytes = STAT_LOAD(alloc_stats.large_allocated);
+	report->large_overhead = large_mapped > report->large_live_bytes ? large_mapped - report->large_live_bytes : 0;
+
+	report->requested += report->heap_live_bytes + report->pool_live_bytes + report->large_live_bytes
+		+ stats.arena_allocated;
+	report->internal_waste += report->heap_header_bytes + report->pool_overhead + report->large_overhead;
+	report->external_free += report->free_span_resident + report->heap_free_bytes + report->pool_free_bytes
+		+ stats.arena_active - stats.arena_allocated + stats.mapcache_bytes;
+	report->mapped = stats.mapped;
+	report->rss = resident_bytes();
+	report->rss_per_requested = report->requested ? (double)report->rss / report->requested : 0;
+}
@@ -0,0 +1,300 @@
+#include "include.h"
+
+__thread ThreadCache tcache __attribute__((tls_model("initial-exec"))) = {0};
+
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+/*
+	* push the slots first..last, already linked, on the remote list of their owner
+	* one CAS for the whole run, no lock is taken, then count is added to the remote count
+	* if the owner has exited its list is closed and the slots go back to their spans
+*/
+
+static void remote_push(SlabHeap *owner, void *first, void *last, int count, int bin_index)
+{
+	void *head = __atomic_load_n(&owner->remote[bin_index], __ATOMIC_RELAXED);
+
+	do
+	{
+		if (head == REMOTE_CLOSED)
+		{
+			pthread_mutex_lock(&heap_lock);
+			for (void *ptr = first, *next; ; ptr = next)
+			{
+				next = *(void **)ptr;
+				slab_free(ptr);
+				if (ptr == last)
+					break;
+			}
+			pthread_mutex_unlock(&heap_lock);
+			return;
+		}
+		*(void **)last = head;
+	} while (!__atomic_compare_exchange_n(&owner->remote[bin_index], &head, first, 1,
+										  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	__atomic_fetch_add(&owner->remote_count[bin_index], count, __ATOMIC_RELAXED);
+}
+
+/*
+	* hand back up to count slots of the list ptr, cached in bin_index
+	* the slots of this thread's heap go back to their spans in one locked section,
+	* the others go to the remote list of their owner, a run of slots with the same owner
+	* costs one CAS
+	* Returns: the rest of the list
+*/
+
+static void *release_slots(void *ptr, int count, int bin_index)
+{
+	void *local = NULL;
+	uint64_t remote = 0;
+
+	while (ptr && count)
+	{
+		void *next = *(void **)ptr;
+		SlabHeap *owner = slab_meta(ptr)->owner;
+		count--;
+		if (owner == tcache.heap)
+		{
+			*(void **)ptr = local;
+			local = ptr;
+			ptr = next;
+			continue;
+		}
+		void *last = ptr;
+		int run = 1;
+		while (next && count && slab_meta(next)->owner == owner)
+		{
+			last = next;
+			next = *(void **)next;
+			count--;
+			run++;
+		}
+		remote_push(owner, ptr, last, run, bin_index);
+		remote += run;
+		ptr = next;
+	}
+	if (local)
+	{
+		pthread_mutex_lock(&heap_lock);
+		while (local)
+		{
+			void *next = *(void **)local;
+			slab_free(local);
+			local = next;
+		}
+		pthread_mutex_unlock(&heap_lock);
+	}
+	STAT_ADD(tcache.stats.remote_frees, remote);
+	return ptr;
+}
+
+/*
+	* called by pthread when the thread exits
+	* every cached slot goes back to its span or its owner, and the slab heap is parked
+	* the cache is marked dead so late frees from other destructors bypass it
+*/
+
+static void tcache_destroy(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+	{
+		release_slots(tcache.bins[i], -1, i);
+		tcache.bins[i] = NULL;
+		tcache.counts[i] = 0;
+	}
+	pthread_mutex_lock(&heap_lock);
+	if (tcache.heap)
+		slab_heap_park(tcache.heap);
+	tcache.heap = NULL;
+	pthread_mutex_unlock(&heap_lock);
+	tcache_unregister(&tcache);
+	tcache.state = TCACHE_DEAD;
+}
+
+static void tcache_create_key()
+{
+	pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/*
+	* first use of the cache by this thread
+	* the key makes pthread call tcache_destroy when the thread exits
+	* the first thread also sizes the caches and the slab spans, see config.c
+	* the thread gets a slab heap of its own, the spans it allocates belong to it
+*/
+
+static void tcache_init()
+{
+	alloc_config_init();
+	pthread_once(&tcache_once, tcache_create_key);
+	pthread_setspecific(tcache_key, &tcache);
+	pthread_mutex_lock(&heap_lock);
+	tcache.heap = slab_heap_adopt();
+	pthread_mutex_unlock(&heap_lock);
+	tcache_register(&tcache);
+	tcache.state = TCACHE_ACTIVE;
+}
+
+/*
+	* take back the slots other threads freed to this thread's heap for one bin
+	* the whole list is swapped out at once and becomes the bin, which is empty when this runs
+	* the remote count gives the length of the list without walking it, only a list longer
+	* than alloc_config.tcache_max is walked, the bin keeps that many slots and the rest of
+	* the burst goes back to its spans
+	* Returns: the number of slots put in the bin, 0 if the remote list was empty
+*/
+
+static int tcache_collect(int bin_index)
+{
+	void *list = __atomic_exchange_n(&tcache.heap->remote[bin_index], NULL, __ATOMIC_ACQUIRE);
+	int max = alloc_config.tcache_max[bin_index];
+
+	if (!list)
+		return 0;
+	int count = __atomic_exchange_n(&tcache.heap->remote_count[bin_index], 0, __ATOMIC_RELAXED);
+	if (count > max)
+	{
+		void *last = list;
+		count = 1;
+		while (count < max && *(void **)last)
+		{
+			last = *(void **)last;
+			count++;
+		}
+		if (*(void **)last)
+			release_slots(*(void **)last, -1, bin_index);
+		*(void **)last = NULL;
+	}
+	tcache.bins[bin_index] = list;
+	tcache.counts[bin_index] = count > 0 ? count : 1;
+	return 1;
+}
+
+/*
+	* slow path of _malloc for the small bins, and of _aligned_alloc for the aligned classes
+	* bin_index: bin of the requested size
+	* slots freed by other threads are taken back first, without the heap lock,
+	* otherwise up to TCACHE_BATCH slots are pulled from the slab spans of the bin,
+	* no more than one span holds for the large aligned classes
+	* Returns: pointer to the allocated memory
+*/
+
+__attribute__((noinline))
+void *tcache_refill(int bin_index)
+{
+	if (__builtin_expect(tcache.state == TCACHE_UNINIT, 0))
+		tcache_init();
+	int batch = tcache.state == TCACHE_DEAD ? 1 : TCACHE_BATCH;
+	if (batch > (int)alloc_config.slab_slots[bin_index])
+		batch = alloc_config.slab_slots[bin_index];
+	void *list = NULL;
+	int count = 0;
+
+	if (tcache.heap && tcache_collect(bin_index))
+	{
+		void *ptr = tcache.bins[bin_index];
+		tcache.bins[bin_index] = *(void **)ptr;
+		tcache.counts[bin_index]--;
+		STAT_ADD(tcache.stats.nmalloc[bin_index], 1);
+		STAT_ADD(tcache.stats.refills, 1);
+		return ptr;
+	}
+	pthread_mutex_lock(&heap_lock);
+	count = slab_alloc_batch(tcache.heap, bin_index, batch, &list);
+	pthread_mutex_unlock(&heap_lock);
+
+	if (!list)
+		return NULL;
+	void *ptr = list;
+	if (tcache.state == TCACHE_DEAD)
+	{
+		STAT_ATOMIC_ADD(alloc_stats.retired.nmalloc[bin_index], 1);
+		STAT_ATOMIC_ADD(alloc_stats.retired.refills, 1);
+		return ptr;
+	}
+	tcache.bins[bin_index] = *(void **)ptr;
+	tcache.counts[bin_index] = count - 1;
+	STAT_ADD(tcache.stats.nmalloc[bin_index], 1);
+	STAT_ADD(tcache.stats.refills, 1);
+	return ptr;
+}
+
+/*
+	* slow path of _malloc_batch, the bin is empty and the cache is active
+	* out is filled from the remote list of the bin first, the slots left over stay in the bin,
+	* then from the slab spans, up to count slots in one locked section
+	* Returns: the number of slots written to out
+*/
+
+__attribute__((noinline))
+size_t tcache_refill_batch(int bin_index, size_t count, void **out)
+{
+	size_t n = 0;
+
+	if (tcache.heap && tcache_collect(bin_index))
+	{
+		void *ptr = tcache.bins[bin_index];
+		while (ptr && n < count)
+		{
+			out[n++] = ptr;
+			ptr = *(void **)ptr;
+		}
+		tcache.bins[bin_index] = ptr;
+		tcache.counts[bin_index] -= n;
+	}
+	if (n < count)
+	{
+		void *list = NULL;
+		pthread_mutex_lock(&heap_lock);
+		while (n < count)
+		{
+			size_t want = count - n < INT_MAX ? count - n : INT_MAX;
+			int got = slab_alloc_batch(tcache.heap, bin_index, want, &list);
+			for (; list; list = *(void **)list)
+				out[n++] = list;
+			if (got < (int)want)
+				break;
+		}
+		pthread_mutex_unlock(&heap_lock);
+	}
+	STAT_ADD(tcache.stats.refills, 1);
+	return n;
+}
+
+/*
+	* called by _free when a bin holds more than alloc_config.tcache_max slots
+	* hands count slots back, see release_slots
+*/
+
+__attribute__((noinline))
+void tcache_flush(int bin_index, int count)
+{
+	tcache.bins[bin_index] = release_slots(tcache.bins[bin_index], count, bin_index);
+	tcache.counts[bin_index] -= count;
+	STAT_ADD(tcache.stats.flushes, 1);
+}
+
+/*
+	* slow path of _free for a slab slot when the cache is not active
+	* a thread that frees before it ever allocated sets its cache up here,
+	* after the thread has exited the slot goes to its owner, or to its span if it has none
+*/
+
+__attribute__((noinline))
+void tcache_free_slow(void *ptr, int bin_index)
+{
+	if (tcache.state == TCACHE_UNINIT)
+	{
+		tcache_init();
+		*(void **)ptr = tcache.bins[bin_index];
+		tcache.bins[bin_index] = ptr;
+		tcache.counts[bin_index]++;
+		STAT_ADD(tcache.stats.nfree[bin_index], 1);
+		return;
+	}
+	remote_push(slab_meta(ptr)->owner, ptr, ptr, 1, bin_index);
+	STAT_ATOMIC_ADD(alloc_stats.retired.nfree[bin_index], 1);
+	STAT_ATOMIC_ADD(alloc_stats.retired.remote_frees, 1);
+}
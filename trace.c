@@ -0,0 +1,316 @@
+#include "include.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+	* allocation trace recorder
+	* while tracing, the entry points of interpose.c log every malloc, calloc, realloc,
+	* aligned allocation and free they serve, bench/replay.c plays the file back
+	* each thread fills a buffer of its own, mapped on its first record, and appends it
+	* to the file in one write(2) when it is full and when the thread exits
+	* the buffers are linked so _malloc_trace_stop, and so exit, writes those of every
+	* live thread, a buffer lock keeps its owner from appending meanwhile
+	* frees take their seq before the call and allocations after it, so the free of an
+	* address comes before its reuse by another thread
+	* no stdio and no _malloc, the recorder runs inside the allocator
+	* TRACE_BUFFER_RECORDS: records a thread holds before it writes them
+*/
+
+#define TRACE_BUFFER_RECORDS 2048
+
+typedef struct TraceBuffer {
+	pthread_mutex_t lock;
+	struct TraceBuffer *prev;
+	struct TraceBuffer *next;
+	uint32_t count;
+	TraceRecord records[TRACE_BUFFER_RECORDS];
+} TraceBuffer;
+
+#define TRACE_BUFFER_DEAD ((TraceBuffer *)1)
+
+int __attribute__((visibility("hidden")))trace_enabled = 0;
+
+static int trace_fd = -1;
+static uint64_t trace_seq;
+static uint32_t trace_threads;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer *trace_buffers;
+static pthread_mutex_t trace_buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static __thread TraceBuffer *trace_buffer __attribute__((tls_model("initial-exec")));
+static __thread uint32_t trace_thread __attribute__((tls_model("initial-exec")));
+
+/*
+	* append len bytes to the trace file, the trace lock keeps the buffers of two threads
+	* from interleaving
+*/
+
+static void trace_write(const void *data, size_t len)
+{
+	size_t done = 0;
+
+	pthread_mutex_lock(&trace_lock);
+	while (done < len && trace_fd >= 0)
+	{
+		ssize_t n = write(trace_fd, (const char *)data + done, len - done);
+		if (n <= 0 && errno != EINTR)
+			break;
+		if (n > 0)
+			done += n;
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/*
+	* the buffer lock must be held
+*/
+
+static void trace_flush(TraceBuffer *buffer)
+{
+	if (buffer->count)
+		trace_write(buffer->records, buffer->count * sizeof(TraceRecord));
+	buffer->count = 0;
+}
+
+/*
+	* called by pthread when the thread exits, the records left are written
+	* the buffer is unlinked and unmapped, later records of this thread are written one by one
+*/
+
+static void trace_buffer_destroy(void *arg)
+{
+	TraceBuffer *buffer = arg;
+
+	pthread_mutex_lock(&trace_buffers_lock);
+	if (buffer->prev)
+		buffer->prev->next = buffer->next;
+	else
+		trace_buffers = buffer->next;
+	if (buffer->next)
+		buffer->next->prev = buffer->prev;
+	pthread_mutex_unlock(&trace_buffers_lock);
+	pthread_mutex_lock(&buffer->lock);
+	trace_flush(buffer);
+	pthread_mutex_unlock(&buffer->lock);
+	unmap_pages(buffer, sizeof(TraceBuffer));
+	trace_buffer = TRACE_BUFFER_DEAD;
+}
+
+static void trace_create_key()
+{
+	pthread_key_create(&trace_key, trace_buffer_destroy);
+}
+
+/*
+	* first record of this thread, it gets its index and its buffer
+	* Returns: the buffer, NULL once the thread has exited or if no memory is left
+*/
+
+static TraceBuffer *trace_buffer_create()
+{
+	if (trace_buffer == TRACE_BUFFER_DEAD)
+		return NULL;
+	trace_thread = __atomic_fetch_add(&trace_threads, 1, __ATOMIC_RELAXED);
+	TraceBuffer *buffer = map_pages(sizeof(TraceBuffer));
+	if (!buffer)
+	{
+		trace_buffer = TRACE_BUFFER_DEAD;
+		return NULL;
+	}
+	buffer->count = 0;
+	pthread_mutex_init(&buffer->lock, NULL);
+	pthread_mutex_lock(&trace_buffers_lock);
+	buffer->prev = NULL;
+	buffer->next = trace_buffers;
+	if (trace_buffers)
+		trace_buffers->prev = buffer;
+	trace_buffers = buffer;
+	pthread_mutex_unlock(&trace_buffers_lock);
+	pthread_once(&trace_once, trace_create_key);
+	pthread_setspecific(trace_key, buffer);
+	trace_buffer = buffer;
+	return buffer;
+}
+
+/*
+	* log one call, see TraceRecord
+	* alignment: power of two, 0 unless op is TRACE_ALIGNED
+*/
+
+void trace_record(int op, void *ptr, void *old_ptr, size_t size, size_t alignment)
+{
+	TraceBuffer *buffer = trace_buffer;
+	TraceRecord single;
+	TraceRecord *record = &single;
+	struct timespec ts;
+
+	if (__builtin_expect(!buffer, 0))
+		buffer = trace_buffer_create();
+	if (buffer && buffer != TRACE_BUFFER_DEAD)
+	{
+		pthread_mutex_lock(&buffer->lock);
+		record = &buffer->records[buffer->count];
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	record->seq = __atomic_fetch_add(&trace_seq, 1, __ATOMIC_RELAXED);
+	record->time = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	record->ptr = (uintptr_t)ptr;
+	record->old_ptr = (uintptr_t)old_ptr;
+	record->size = size;
+	record->thread = trace_thread;
+	record->op = op;
+	record->align_shift = alignment ? __builtin_ctzl(alignment) : 0;
+	record->reserved = 0;
+	if (record == &single)
+	{
+		trace_write(record, sizeof(TraceRecord));
+		return;
+	}
+	if (++buffer->count == TRACE_BUFFER_RECORDS)
+		trace_flush(buffer);
+	pthread_mutex_unlock(&buffer->lock);
+}
+
+/*
+	* write the records of every live thread, or drop them when write is 0
+*/
+
+static void trace_flush_all(int write)
+{
+	pthread_mutex_lock(&trace_buffers_lock);
+	for (TraceBuffer *buffer = trace_buffers; buffer; buffer = buffer->next)
+	{
+		pthread_mutex_lock(&buffer->lock);
+		if (write)
+			trace_flush(buffer);
+		buffer->count = 0;
+		pthread_mutex_unlock(&buffer->lock);
+	}
+	pthread_mutex_unlock(&trace_buffers_lock);
+}
+
+void trace_fork_lock()
+{
+	pthread_mutex_lock(&trace_buffers_lock);
+	for (TraceBuffer *buffer = trace_buffers; buffer; buffer = buffer->next)
+		pthread_mutex_lock(&buffer->lock);
+	pthread_mutex_lock(&trace_lock);
+}
+
+void trace_fork_unlock()
+{
+	pthread_mutex_unlock(&trace_lock);
+	for (TraceBuffer *buffer = trace_buffers; buffer; buffer = buffer->next)
+		pthread_mutex_unlock(&buffer->lock);
+	pthread_mutex_unlock(&trace_buffers_lock);
+}
+
+/*
+	* the child of a fork stops tracing, the records of the parent stay with the parent
+	* the buffers of the threads the child does not have are unmapped
+*/
+
+static void trace_fork_child()
+{
+	trace_enabled = 0;
+	if (trace_fd >= 0)
+		close(trace_fd);
+	trace_fd = -1;
+	for (TraceBuffer *buffer = trace_buffers, *next; buffer; buffer = next)
+	{
+		next = buffer->next;
+		if (buffer != trace_buffer)
+			unmap_pages(buffer, sizeof(TraceBuffer));
+	}
+	trace_buffers = NULL;
+	if (trace_buffer && trace_buffer != TRACE_BUFFER_DEAD)
+	{
+		trace_buffer->count = 0;
+		trace_buffer->prev = trace_buffer->next = NULL;
+		trace_buffers = trace_buffer;
+	}
+}
+
+/*
+	* start recording to path, one trace at a time
+	* the records a thread took after the last stop are dropped
+	* the file is written as the buffers fill, the last records reach it when their
+	* threads exit, on _malloc_trace_stop or when the process exits
+	* Returns: 0 on success, -1 with errno set otherwise
+*/
+
+int _malloc_trace_start(const char *path)
+{
+	TraceHeader header = {.magic = TRACE_MAGIC, .record_size = sizeof(TraceRecord)};
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_fd >= 0)
+	{
+		pthread_mutex_unlock(&trace_lock);
+		errno = EBUSY;
+		return -1;
+	}
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	if (trace_fd < 0)
+	{
+		pthread_mutex_unlock(&trace_lock);
+		return -1;
+	}
+	header.pid = getpid();
+	pthread_mutex_unlock(&trace_lock);
+	trace_flush_all(0);
+	trace_write(&header, sizeof(header));
+	__atomic_store_n(&trace_enabled, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/*
+	* stop logging new calls, the records every thread holds are written now and the
+	* file is closed, a later _malloc_trace_start records a new trace
+	* the destructor calls it, so a process that exits with live threads loses none
+*/
+
+void _malloc_trace_stop(void)
+{
+	__atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+	trace_flush_all(1);
+	pthread_mutex_lock(&trace_lock);
+	if (trace_fd >= 0)
+		close(trace_fd);
+	trace_fd = -1;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/*
+	* FT_MALLOC_TRACE=<path> records a trace of the whole run in <path>.<pid>,
+	* every program the run starts writes a file of its own
+*/
+
+__attribute__((constructor))
+static void trace_init()
+{
+	const char *path = getenv("FT_MALLOC_TRACE");
+	char name[PATH_MAX];
+	char digits[16];
+	size_t len;
+	int i = sizeof(digits);
+
+	pthread_atfork(NULL, NULL, trace_fork_child);
+	if (!path || !*path || (len = strlen(path)) > PATH_MAX - sizeof(digits) - 1)
+		return;
+	for (pid_t pid = getpid(); pid || i == sizeof(digits); pid /= 10)
+		digits[--i] = '0' + pid % 10;
+	memcpy(name, path, len);
+	name[len++] = '.';
+	memcpy(name + len, digits + i, sizeof(digits) - i);
+	name[len + sizeof(digits) - i] = 0;
+	_malloc_trace_start(name);
+}
+
+__attribute__((destructor))
+static void trace_fini()
+{
+	_malloc_trace_stop();
+}
@@ -2,7 +2,6 @@
 
 extern Block *freelist;
 extern size_t block_size;
-extern int allocated_blocks;
 extern MemoryAllocator allocator;
 
 #include <stdio.h>
@@ -16,33 +15,79 @@ extern MemoryAllocator allocator;
 #define CYAN "\033[36m"
 #define BOLD "\033[1m"
 
+/*
+	* print a summary of _malloc_stats
+	* it only reads counters, nothing walks the blocks
+*/
+
 void heap_info(void) {
     static long nb_call = 0;
-    long total_alloc = 0;
+    struct malloc_stats stats;
 
+    _malloc_stats(&stats);
     printf(BOLD CYAN "Heap Info #%ld:\n" RESET, nb_call);
-
-    for (Block *heap = freelist; heap; heap = heap->next) {
-        printf(BOLD BLUE "Heap: %p - %p\n" RESET, (void *)heap, (void *)((char *)heap + heap->size));
-        printf("  " YELLOW "Size: " RESET "%zu\n", heap->size);
-        printf("  " YELLOW "Free space: " RESET "%d\n", heap->free);
-        printf("  " YELLOW "Aligned address: " RESET "%p\n", heap->aligned_address);
-        printf("  " YELLOW "Is mmap: " RESET "%d\n", heap->is_mmap);
-
-        if (allocated_blocks == 0) {
-            printf("  " GREEN "Freed: yes\n" RESET);
-        } else {
-            printf("  " RED "Freed: no\n" RESET);
-            total_alloc += heap->size;
-			printf(RED "total_alloc %ld\n" RED, total_alloc);
-        }
+    printf("  " YELLOW "Allocated: " RESET "%zu bytes in %lu blocks\n", stats.allocated, (unsigned long)stats.live);
+    printf("  " YELLOW "Active: " RESET "%zu bytes\n", stats.active);
+    printf("  " YELLOW "Mapped: " RESET "%zu bytes, " YELLOW "retained: " RESET "%zu bytes\n", stats.mapped, stats.retained);
+    printf("  " YELLOW "Syscalls: " RESET "%lu mmap, %lu munmap, %lu mremap, %lu madvise\n",
+           (unsigned long)stats.mmap_calls, (unsigned long)stats.munmap_calls, (unsigned long)stats.mremap_calls,
+           (unsigned long)stats.madvise_calls);
+    printf("  " YELLOW "Purged: " RESET "%lu bytes\n", (unsigned long)stats.purged);
+    printf("  " YELLOW "Mapping cache: " RESET "%lu hits, %lu misses, %lu bytes\n",
+           (unsigned long)stats.mapcache_hits, (unsigned long)stats.mapcache_misses, (unsigned long)stats.mapcache_bytes);
+    if (stats.arenas)
+        printf("  " YELLOW "Arenas: " RESET "%lu, %zu bytes allocated in %zu bytes of chunks\n",
+               (unsigned long)stats.arenas, stats.arena_allocated, stats.arena_active);
+    printf("  " YELLOW "Thread cache: " RESET "%.1f%% hits, %lu refills, %lu flushes, %lu remote frees\n",
+           100.0 * stats.tcache_hit_rate, (unsigned long)stats.tcache_misses, (unsigned long)stats.tcache_flushes,
+           (unsigned long)stats.remote_frees);
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        struct malloc_class_stats *class = &stats.classes[i];
+        if (!class->nmalloc && !class->groups)
+            continue;
+        printf("  " BLUE "%4zu" RESET ": %lu live, %lu cached, %lu groups, %.1f%% occupancy\n",
+               class->size, (unsigned long)class->live, (unsigned long)class->cached,
+               (unsigned long)class->groups, class->occupancy);
     }
-
-    printf(BOLD CYAN "Total allocated memory: %ld bytes\n" RESET, total_alloc);
-
     nb_call++;
 }
 
+/*
+	* print _malloc_frag_report: why the process holds more than the program asked for
+*/
+
+void frag_info(void) {
+    struct malloc_frag_report report;
+
+    _malloc_frag_report(&report);
+    printf(BOLD CYAN "Fragmentation:\n" RESET);
+    printf("  " YELLOW "Requested: " RESET "%zu bytes, " YELLOW "RSS: " RESET "%zu bytes (%.2fx)\n",
+           report.requested, report.rss, report.rss_per_requested);
+    printf("  " YELLOW "Internal waste: " RESET "%zu bytes, " YELLOW "free but held: " RESET "%zu bytes, "
+           YELLOW "mapped: " RESET "%zu bytes\n", report.internal_waste, report.external_free, report.mapped);
+    printf("  " YELLOW "Heap: " RESET "%lu blocks, %zu bytes, %zu header bytes, %lu free blocks of %zu bytes, "
+           "largest %zu, %.1f%% external\n", (unsigned long)report.heap_live_blocks, report.heap_live_bytes,
+           report.heap_header_bytes, (unsigned long)report.heap_free_blocks, report.heap_free_bytes,
+           report.heap_largest_free, 100.0 * report.heap_external);
+    printf("  " YELLOW "Pools: " RESET "%lu, %zu bytes, %zu overhead, %zu free\n", (unsigned long)report.pools,
+           report.pool_live_bytes, report.pool_overhead, report.pool_free_bytes);
+    printf("  " YELLOW "Large: " RESET "%zu bytes, %zu overhead\n", report.large_live_bytes, report.large_overhead);
+    printf("  " YELLOW "Free spans: " RESET "%lu, %zu bytes resident\n", (unsigned long)report.free_spans,
+           report.free_span_resident);
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        struct malloc_frag_class *class = &report.classes[i];
+        if (!class->spans)
+            continue;
+        printf("  " BLUE "%5zu" RESET ": %lu spans (%lu partial, %lu full, %lu empty), %zu live, %zu waste,"
+               " %zu cached, %zu free, occupancy", class->size, (unsigned long)class->spans,
+               (unsigned long)class->partial_spans, (unsigned long)class->full_spans, (unsigned long)class->empty_spans,
+               class->live_bytes, class->internal_waste, class->cached_bytes, class->free_bytes);
+        for (int j = 0; j < FRAG_OCCUPANCY_BUCKETS; j++)
+            printf(" %lu", (unsigned long)class->span_occupancy[j]);
+        printf("\n");
+    }
+}
+
 size_t print_blocks(Block *block) {
     size_t total_alloc_block = 0;
     while (block) {
@@ -69,15 +114,17 @@ int count_blocks(Block *list)
     }
     printf(CYAN "Number of blocks: " RESET "%d\n", count);
     heap_info();
-    print_blocks(list);
     return count;
 }
 
 void check_for_leaks() 
 {
-    if (allocated_blocks != 0) 
-        printf(RED "Potential memory leak detected: " RESET "%d blocks allocated, %d blocks freed.\n",
-               allocated_blocks, 0);
+    struct malloc_stats stats;
+
+    _malloc_stats(&stats);
+    if (stats.live != 0) 
+        printf(RED "Potential memory leak detected: " RESET "%lu blocks allocated, %lu blocks freed.\n",
+               (unsigned long)stats.nmalloc, (unsigned long)stats.nfree);
     else
         printf(GREEN "No memory leaks detected.\n" RESET);
 }